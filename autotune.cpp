@@ -0,0 +1,195 @@
+#include "autotune.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <string>
+
+extern std::vector<GPUTrainer> gpuTrainers;
+extern int layer1_size;
+extern int debug_mode;
+extern real starting_alpha;
+extern real *syn0;
+
+int autotune = 0;
+char autotune_cache[MAX_STRING] = "word2vec.autotune";
+
+// Candidates of the search, the sentence length is kept as configured
+static const int tune_threads_per_word[] = { 64, 128, 256, 512 };
+static const int tune_sentence_num[] = { 1, 3, 6, 12 };
+#define NUM_TUNE_THREADS (int) (sizeof(tune_threads_per_word) / sizeof(int))
+#define NUM_TUNE_SENTENCES (int) (sizeof(tune_sentence_num) / sizeof(int))
+
+// Devices whose geometry came from the cache
+static std::vector<std::string> cached_devices;
+
+// Cache lines: <layer1_size> <threads_per_word> <sentence_num> <device name>
+static int readCache(const char * device_name, BatchGeometry * g) {
+	FILE * fi = fopen(autotune_cache, "rb");
+	if (fi == NULL)
+		return 0;
+	char line[MAX_STRING * 2], name[MAX_STRING * 2];
+	int size, threads, sentences, found = 0;
+	while (fgets(line, sizeof(line), fi)) {
+		if (sscanf(line, "%d %d %d %[^\n]", &size, &threads, &sentences, name) != 4)
+			continue;
+		if (size == layer1_size && !strcmp(name, device_name)) {
+			g->threads_per_word = threads;
+			g->sentence_num = sentences;
+			found = 1;
+		}
+	}
+	fclose(fi);
+	return found;
+}
+
+// Rewrites the cache with the entry of the device replaced
+static void writeCache(const char * device_name, const BatchGeometry & g) {
+	std::vector<std::string> lines;
+	char line[MAX_STRING * 2], name[MAX_STRING * 2];
+	int size, threads, sentences;
+	FILE * fi = fopen(autotune_cache, "rb");
+	if (fi != NULL) {
+		while (fgets(line, sizeof(line), fi)) {
+			if (sscanf(line, "%d %d %d %[^\n]", &size, &threads, &sentences, name) == 4
+					&& size == layer1_size && !strcmp(name, device_name))
+				continue;
+			lines.push_back(line);
+		}
+		fclose(fi);
+	}
+	FILE * fo = fopen(autotune_cache, "wb");
+	if (fo == NULL) {
+		printf("Cannot write autotune cache %s\n", autotune_cache);
+		return;
+	}
+	for (unsigned int i = 0; i < lines.size(); i++)
+		fputs(lines[i].c_str(), fo);
+	fprintf(fo, "%d %d %d %s\n", layer1_size, g.threads_per_word, g.sentence_num, device_name);
+	fclose(fo);
+}
+
+static int isCached(const char * device_name) {
+	for (unsigned int i = 0; i < cached_devices.size(); i++)
+		if (cached_devices[i] == device_name)
+			return 1;
+	return 0;
+}
+
+// Called before the program is built, so the cached geometry is used right away
+int autotuneLookup(GPUTrainer & trainer) {
+	BatchGeometry g = trainer.getGeometry();
+	if (!readCache(trainer.getDeviceName(), &g))
+		return 0;
+	trainer.setGeometry(g);
+	cached_devices.push_back(trainer.getDeviceName());
+	if (debug_mode > 0)
+		printf("Cached geometry for %s: %d threads per word, %d sentences per batch\n",
+				trainer.getDeviceName(), g.threads_per_word, g.sentence_num);
+	return 1;
+}
+
+int autotuneNeeded() {
+	if (autotune == 0)
+		return 0;
+	for (unsigned int i = 0; i < gpuTrainers.size(); i++)
+		if (autotune == 2 || !isCached(gpuTrainers[i].getDeviceName()))
+			return 1;
+	return 0;
+}
+
+// Packs the next full batch from the sample, wrapping around at its end
+static int packSample(GPUTrainer & trainer, int slot, const int * sample, int sample_size, int * pos,
+		int * sentence_num) {
+	const BatchGeometry & g = trainer.getGeometry();
+	trainer.beginBatch(slot);
+	int * sen = trainer.getSentencePtr(slot);
+	int * offsets = trainer.getOffsetsPtr(slot);
+	int ntokens = 0;
+	*sentence_num = 0;
+	offsets[0] = 0;
+	while (ntokens < g.batchTokens()) {
+		int word = sample[*pos];
+		*pos = (*pos + 1) % sample_size;
+		if (word != 0)
+			sen[ntokens++] = word;
+		if (ntokens > offsets[*sentence_num] && (word == 0 || *pos == 0
+				|| ntokens - offsets[*sentence_num] >= g.sentence_length))
+			offsets[++*sentence_num] = ntokens;
+	}
+	if (ntokens > offsets[*sentence_num])
+		offsets[++*sentence_num] = ntokens;
+	return ntokens;
+}
+
+// Trains one warm up batch, then times batches until the sample was seen
+// once. The slots are used in turn, as by a single tokenizer.
+static double timeGeometry(GPUTrainer & trainer, const int * sample, int sample_size) {
+	int pos = 0, sentence_num, ntokens, slot = 0;
+	ntokens = packSample(trainer, slot, sample, sample_size, &pos, &sentence_num);
+	trainer.trainGPU(slot, ntokens, sentence_num, starting_alpha);
+	trainer.finishQueue();
+	unsigned long long start = monotonicNs(), words = 0;
+	while (words < (unsigned long long) sample_size) {
+		slot = (slot + 1) % trainer.getSlotCount();
+		ntokens = packSample(trainer, slot, sample, sample_size, &pos, &sentence_num);
+		trainer.trainGPU(slot, ntokens, sentence_num, starting_alpha);
+		words += ntokens;
+	}
+	trainer.finishQueue();
+	return words / ((monotonicNs() - start) / 1e9);
+}
+
+static void tuneDevice(GPUTrainer & trainer, const int * sample, int sample_size) {
+	BatchGeometry best = trainer.getGeometry();
+	double best_rate = 0;
+	for (int t = 0; t < NUM_TUNE_THREADS; t++)
+		for (int s = 0; s < NUM_TUNE_SENTENCES; s++) {
+			BatchGeometry g = best;
+			g.threads_per_word = tune_threads_per_word[t];
+			g.sentence_num = tune_sentence_num[s];
+			if (!trainer.supportsGeometry(g) || !trainer.applyGeometry(g))
+				continue;
+			double rate = timeGeometry(trainer, sample, sample_size);
+			if (debug_mode > 1)
+				printf("\t%4d threads per word, %3d sentences per batch: %.2fk words/sec\n",
+						g.threads_per_word, g.sentence_num, rate / 1000);
+			if (rate > best_rate) {
+				best_rate = rate;
+				best = g;
+			}
+		}
+	if (!trainer.applyGeometry(best)) {
+		printf("%s cannot run %d threads per word\n", trainer.getDeviceName(), best.threads_per_word);
+		exit(1);
+	}
+	if (best_rate > 0)
+		writeCache(trainer.getDeviceName(), best);
+	printf("Tuned %s: %d threads per word, %d sentences per batch, %.2fk words/sec\n",
+			trainer.getDeviceName(), best.threads_per_word, best.sentence_num, best_rate / 1000);
+}
+
+// Devices are tuned one after the other so their timings do not compete for
+// the bus. Identical cards share the result of the first one.
+void autotuneDevices(const int * sample, int sample_size) {
+	int words = 0;
+	for (int i = 0; i < sample_size; i++)
+		words += sample[i] != 0;
+	if (words == 0)
+		return;
+	std::vector<int> tuned;
+	for (unsigned int i = 0; i < gpuTrainers.size(); i++) {
+		GPUTrainer & trainer = gpuTrainers[i];
+		if (autotune == 1 && isCached(trainer.getDeviceName()))
+			continue;
+		int same = -1;
+		for (unsigned int j = 0; j < tuned.size(); j++)
+			if (!strcmp(gpuTrainers[tuned[j]].getDeviceName(), trainer.getDeviceName()))
+				same = tuned[j];
+		if (same >= 0 && trainer.applyGeometry(gpuTrainers[same].getGeometry()))
+			continue;
+		trainer.updateSyn0(syn0);
+		tuneDevice(trainer, sample, sample_size);
+		tuned.push_back(i);
+	}
+}
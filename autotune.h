@@ -0,0 +1,28 @@
+/*
+ * autotune.h
+ *
+ *  Picks the batch geometry of each device from short timed runs on a
+ *  sample of the corpus. The winner is cached per device name and vector
+ *  size, so later runs on the same card skip the search.
+ */
+
+#ifndef AUTOTUNE_H_
+#define AUTOTUNE_H_
+
+#include "cbow.h"
+
+// 0 = off, 1 = use the cache and tune devices missing from it, 2 = always tune
+extern int autotune;
+extern char autotune_cache[MAX_STRING];
+
+// Tokens of the corpus sample used for the timed runs
+#define AUTOTUNE_SAMPLE_TOKENS (2 * 12 * DEFAULT_SENTENCE_LENGTH)
+
+int autotuneLookup(GPUTrainer & trainer);
+int autotuneNeeded();
+// sample holds vocabulary ids as read from the corpus, 0 marks a line break.
+// The device models must be uploaded; the timed runs train on them, so they
+// have to be overwritten before the real training starts.
+void autotuneDevices(const int * sample, int sample_size);
+
+#endif /* AUTOTUNE_H_ */
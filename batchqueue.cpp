@@ -0,0 +1,162 @@
+#include "batchqueue.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <unistd.h>
+#include <pthread.h>
+
+// Failed tries before a waiting thread sleeps instead of yielding
+#define IDLE_SPINS 64
+#define IDLE_SLEEP_US 50
+
+void batchQueueInit(BatchQueue * q, int capacity) {
+	unsigned long long size = 2;
+	while (size < (unsigned long long) capacity)
+		size <<= 1;
+	q->cells = (BatchQueueCell *) malloc(size * sizeof(BatchQueueCell));
+	if (q->cells == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	for (unsigned long long i = 0; i < size; i++)
+		q->cells[i].sequence = i;
+	q->mask = size - 1;
+	q->tail = q->head = 0;
+}
+
+void batchQueueFree(BatchQueue * q) {
+	free(q->cells);
+	q->cells = NULL;
+}
+
+// A cell at position pos is free to write when its sequence is pos, and
+// holds a value to read when it is pos + 1
+int batchQueuePush(BatchQueue * q, int value) {
+	unsigned long long pos = q->tail;
+	BatchQueueCell * cell;
+	while (1) {
+		cell = &q->cells[pos & q->mask];
+		long long diff = (long long) cell->sequence - (long long) pos;
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&q->tail, pos, pos + 1))
+				break;
+		} else if (diff < 0)
+			return 0;
+		pos = q->tail;
+	}
+	cell->value = value;
+	__sync_synchronize();
+	cell->sequence = pos + 1;
+	return 1;
+}
+
+int batchQueuePop(BatchQueue * q, int * value) {
+	unsigned long long pos = q->head;
+	BatchQueueCell * cell;
+	while (1) {
+		cell = &q->cells[pos & q->mask];
+		long long diff = (long long) cell->sequence - (long long) (pos + 1);
+		if (diff == 0) {
+			if (__sync_bool_compare_and_swap(&q->head, pos, pos + 1))
+				break;
+		} else if (diff < 0)
+			return 0;
+		pos = q->head;
+	}
+	__sync_synchronize();
+	*value = cell->value;
+	__sync_synchronize();
+	// Free for the push one lap later
+	cell->sequence = pos + q->mask + 1;
+	return 1;
+}
+
+void batchQueueIdle(int attempt) {
+	if (attempt < IDLE_SPINS)
+		sched_yield();
+	else
+		usleep(IDLE_SLEEP_US);
+}
+
+// Stress test: producers push their own runs of values through a queue of
+// four cells, consumers pop until all of them are through
+#define CHECK_QUEUE_VALUES 1000000
+#define CHECK_QUEUE_CAPACITY 4
+
+struct QueueCheck {
+	BatchQueue queue;
+	int threads;
+	volatile unsigned char * seen;
+	volatile int popped;
+	volatile int out_of_order;
+	int index;
+};
+
+static void * checkProducer(void * arg) {
+	QueueCheck * c = (QueueCheck *) arg;
+	int first = __sync_fetch_and_add(&c->index, 1) * CHECK_QUEUE_VALUES;
+	for (int v = first; v < first + CHECK_QUEUE_VALUES; v++)
+		for (int attempt = 0; !batchQueuePush(&c->queue, v); attempt++)
+			batchQueueIdle(attempt);
+	return NULL;
+}
+
+// The values of one producer leave in the order they went in
+static void * checkConsumer(void * arg) {
+	QueueCheck * c = (QueueCheck *) arg;
+	int total = c->threads * CHECK_QUEUE_VALUES;
+	int * last = (int *) malloc(c->threads * sizeof(int));
+	for (int p = 0; p < c->threads; p++)
+		last[p] = -1;
+	while (c->popped < total) {
+		int v;
+		for (int attempt = 0; !batchQueuePop(&c->queue, &v); attempt++) {
+			if (c->popped >= total) {
+				free(last);
+				return NULL;
+			}
+			batchQueueIdle(attempt);
+		}
+		int p = v / CHECK_QUEUE_VALUES;
+		if (v <= last[p])
+			__sync_add_and_fetch(&c->out_of_order, 1);
+		last[p] = v;
+		__sync_add_and_fetch(&c->seen[v], 1);
+		__sync_add_and_fetch(&c->popped, 1);
+	}
+	free(last);
+	return NULL;
+}
+
+int batchQueueSelfCheck(int threads) {
+	unsigned long long start = monotonicNs();
+	QueueCheck c;
+	batchQueueInit(&c.queue, CHECK_QUEUE_CAPACITY);
+	c.threads = threads;
+	c.seen = (volatile unsigned char *) calloc((size_t) threads * CHECK_QUEUE_VALUES, 1);
+	c.popped = c.out_of_order = c.index = 0;
+	pthread_t * pt = (pthread_t *) malloc(2 * threads * sizeof(pthread_t));
+	for (int t = 0; t < threads; t++) {
+		pthread_create(&pt[t], NULL, checkProducer, &c);
+		pthread_create(&pt[threads + t], NULL, checkConsumer, &c);
+	}
+	for (int t = 0; t < 2 * threads; t++)
+		pthread_join(pt[t], NULL);
+	long long lost = 0, twice = 0;
+	for (long long v = 0; v < (long long) threads * CHECK_QUEUE_VALUES; v++) {
+		lost += c.seen[v] == 0;
+		twice += c.seen[v] > 1;
+	}
+	int leftover, bad;
+	bad = batchQueuePop(&c.queue, &leftover) || lost || twice || c.out_of_order;
+	printf("Queue: %d producers and %d consumers passed %lld values through %d cells in %.2fs:"
+			" %lld lost, %lld popped twice, %d out of order\n", threads, threads,
+			(long long) threads * CHECK_QUEUE_VALUES, CHECK_QUEUE_CAPACITY, (monotonicNs() - start) / 1e9,
+			lost, twice, c.out_of_order);
+	printf("%s\n", bad ? "Queue check failed" : "Queue check passed");
+	free(pt);
+	free((void *) c.seen);
+	batchQueueFree(&c.queue);
+	return bad;
+}
@@ -0,0 +1,41 @@
+/*
+ * batchqueue.h
+ *
+ *  Bounded lock-free queue of batch slot indices between the tokenizer
+ *  threads and the thread driving a device. Any number of threads may push
+ *  and pop at the same time: every cell carries a sequence number telling
+ *  whether it is ready to be written or read at the current position, and
+ *  the positions advance with compare and swap.
+ */
+
+#ifndef BATCHQUEUE_H_
+#define BATCHQUEUE_H_
+
+struct BatchQueueCell {
+	volatile unsigned long long sequence;
+	int value;
+};
+
+struct BatchQueue {
+	BatchQueueCell * cells;
+	// Capacity - 1, the capacity is a power of two
+	unsigned long long mask;
+	// Kept on separate cache lines, producers and consumers race on them
+	volatile unsigned long long tail __attribute__((aligned(64)));
+	volatile unsigned long long head __attribute__((aligned(64)));
+};
+
+// Room for at least capacity values
+void batchQueueInit(BatchQueue * q, int capacity);
+void batchQueueFree(BatchQueue * q);
+// Return 0 when the queue is full / empty
+int batchQueuePush(BatchQueue * q, int value);
+int batchQueuePop(BatchQueue * q, int * value);
+// Waiting for the other side: spins a while, then sleeps shortly. attempt
+// counts the failed tries since the last success.
+void batchQueueIdle(int attempt);
+// Pushes and pops a million values per thread with the given number of
+// producers and consumers, returns 0 if each arrives once and in order
+int batchQueueSelfCheck(int threads);
+
+#endif /* BATCHQUEUE_H_ */
@@ -1,18 +1,42 @@
 #include "cbow.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "autotune.h"
+#include "cluster.h"
+#include "topology.h"
 #include <stdio.h>
+#include <string.h>
 #include <assert.h>
 #include <math.h>
+#include <pthread.h>
+#include <unistd.h>
 #include <vector>
 
 
 extern std::vector<GPUTrainer> gpuTrainers;
 
 extern int * table;
+extern real * keep_table;
 extern int vocab_size, layer1_size , layer1_size_aligned;
 extern int negative , window;
 extern int table_size;
-// To batch data to minimize data transfer, sen stores words + alpha values
-// alpha value start at offset = MAX_SENTENCE_NUM * MAX_SENTENCE_LENGTH
+extern int debug_mode;
+extern int async_average;
+// To batch data to minimize data transfer, sen stores raw word ids + sentence
+// offsets, see BatchGeometry. The device subsamples the raw ids and compacts
+// the survivors into d_words, with the sentence offsets moved to d_offsets.
+
+BatchGeometry default_geometry = { DEFAULT_SENTENCE_NUM, DEFAULT_SENTENCE_LENGTH, DEFAULT_THREADS_PER_WORD };
+
+int zero_copy = 1;
+int queue_depth = 2;
+int tokenizer_threads = 0;
+char device_type[MAX_STRING] = "gpu";
+char device_list[MAX_STRING] = "";
+int sub_devices = 1;
+int sync_quantize = 0;
+int cbow_tile = 0;
+static const char * host_memory_names[] = { "host copies", "pinned staging", "shared, zero copy" };
 
 
 
@@ -24,151 +48,622 @@ extern int table_size;
 	} \
 }
 
-GPUTrainer::GPUTrainer(cl_device_id device)
+// Kernel source, kept for the rebuilds of applyGeometry()
+static char * source_str;
+static size_t source_size;
+
+GPUTrainer::GPUTrainer(cl_device_id device, int id)
 {
 	int ret;
 	device_id = device;
-	// Create an OpenCL context
-	context = clCreateContext( NULL, 1, &device_id, NULL, NULL, &ret);
-	openclCheck(ret);
-	// Create a command queue
-	command_queue = clCreateCommandQueue(context, device_id, 0, &ret);
-	openclCheck(ret);
+	sub_device = 0;
+	this->id = id;
+	context = NULL;
+	command_queue = transfer_queue = NULL;
+	program = NULL;
+	k_memset = k_add = k_cbow = k_cbow_tile = k_subsample_count = k_subsample_scan = NULL;
+	tile = 0;
+	k_subsample_compact = k_subsample_offsets = NULL;
+	k_quantize_delta = k_apply_delta = NULL;
+	wavefront_size = 0;
+	lockstep = 0;
+	geometry = default_geometry;
+	d_syn0 = d_syn1neg = d_random = d_table = d_expTable = d_delta = NULL;
+	memset(d_ref, 0, sizeof(d_ref));
+	memset(d_error, 0, sizeof(d_error));
+	memset(d_q, 0, sizeof(d_q));
+	memset(d_scale, 0, sizeof(d_scale));
+	d_words = d_offsets = d_position = d_count = d_block_sum = d_keep = NULL;
+	h_random = NULL;
+	memset(slots, 0, sizeof(slots));
+	memset(lanes, 0, sizeof(lanes));
+	slot_count = 0;
+	syn0 = syn1neg = NULL;
+	h_syn0 = h_syn1neg = NULL;
+	model_mapped = 0;
 
     ret = clGetDeviceInfo(device, CL_DEVICE_MAX_COMPUTE_UNITS,
             sizeof(ComputeUnits), &ComputeUnits, NULL); openclCheck(ret)
+    ret = clGetDeviceInfo(device, CL_DEVICE_MAX_WORK_GROUP_SIZE,
+            sizeof(max_work_group), &max_work_group, NULL); openclCheck(ret)
+    ret = clGetDeviceInfo(device, CL_DEVICE_LOCAL_MEM_SIZE,
+            sizeof(local_mem_size), &local_mem_size, NULL); openclCheck(ret)
+    ret = clGetDeviceInfo(device, CL_DEVICE_NAME, sizeof(device_name), device_name, NULL);
+    if (ret != CL_SUCCESS)
+        strcpy(device_name, "unknown");
+    numa_node = topologyDeviceNode(device);
+
+    cl_bool unified = CL_FALSE;
+    cl_device_type type = 0;
+    clGetDeviceInfo(device, CL_DEVICE_HOST_UNIFIED_MEMORY, sizeof(unified), &unified, NULL);
+    clGetDeviceInfo(device, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+    if (!zero_copy)
+        host_memory = HOST_MEMORY_COPY;
+    else if (unified || (type & CL_DEVICE_TYPE_CPU))
+        host_memory = HOST_MEMORY_SHARED;
+    else
+        host_memory = HOST_MEMORY_PINNED;
 }
 
-void GPUTrainer::initialWithSource(const char * source_str, size_t size){
-	if (context != NULL){
-		cl_int ret;
-		program = clCreateProgramWithSource(context, 1, (const char **)&source_str,
-			(const size_t *)&size, &ret); openclCheck(ret);
-		if (program == NULL)
-		{
-			printf("Failed to create CL program from source.\n");
-			exit(0);
-		}
-		ret  = clBuildProgram(program, 0, NULL, NULL, NULL, NULL);
-		if (ret != CL_SUCCESS)
-		{
-			// Determine the reason for the error
-			size_t len;
-			ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
-			char *buffer = (char *) calloc(len, sizeof(char));
-			ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
-
-			printf("Error in kernel:\n");
-			printf("%s\n", buffer);
-			free(buffer);
-			clReleaseProgram(program);
-			exit(0);
+// Sub-devices keep the name of their device, the compute units tell them
+// apart from it in the autotune cache
+void GPUTrainer::markSubDevice(){
+	size_t len = strlen(device_name);
+	snprintf(device_name + len, MAX_STRING - len, " (%d compute units)", ComputeUnits);
+	sub_device = 1;
+}
+
+// Root devices belong to the platform, only sub-devices are released
+void GPUTrainer::releaseDevice(){
+	if (sub_device)
+		openclCheck(clReleaseDevice(device_id));
+	sub_device = 0;
+}
+
+// The host copies of the model hold the corrections of async averaging, see
+// ComputeDeltas(), so only a synchronously averaged model is read in place.
+// Quantized sync reads the quantized change instead.
+int GPUTrainer::sharedModel(){
+	return host_memory == HOST_MEMORY_SHARED && !async_average && !sync_quantize;
+}
+
+// Host array of bytes: a pinned staging buffer mapped for its whole life,
+// or plain memory on the NUMA node of the device
+void * GPUTrainer::allocHost(cl_mem * staging, size_t bytes){
+	cl_int ret;
+	void * ptr = NULL;
+	*staging = NULL;
+	if (host_memory == HOST_MEMORY_COPY) {
+		if (posix_memalign(&ptr, 128, bytes) != 0) {
+			printf("Not enough host memory for %s\n", device_name);
+			exit(1);
 		}
+		topologyPlace(ptr, bytes, numa_node);
+		return ptr;
+	}
+	*staging = clCreateBuffer(context, CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR, bytes, NULL, &ret); openclCheck(ret)
+	ptr = clEnqueueMapBuffer(command_queue, *staging, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0, bytes, 0, NULL, NULL, &ret);
+	openclCheck(ret)
+	return ptr;
+}
 
-		k_memset = clCreateKernel(program, "device_memset", &ret); openclCheck(ret) ;
+void GPUTrainer::freeHost(cl_mem * staging, void * ptr){
+	if (ptr == NULL)
+		return;
+	if (*staging == NULL) {
+		free(ptr);
+		return;
+	}
+	openclCheck(clEnqueueUnmapMemObject(command_queue, *staging, ptr, 0, NULL, NULL));
+	openclCheck(clFinish(command_queue));
+	openclCheck(clReleaseMemObject(*staging));
+	*staging = NULL;
+}
 
-//		size_t workgroup_size;
-//		ret = clGetKernelWorkGroupInfo(k_memset, device_id, CL_KERNEL_WORK_GROUP_SIZE,
-//		                                              sizeof(size_t), &workgroup_size, NULL);openclCheck(ret);
-//		maxThreadsPerBlock = workgroup_size;
+// Creates the context and queue on the first call and builds the kernels
+// for the current threads_per_word. Runs on its own thread for each device,
+// so it must not touch any shared state.
+void GPUTrainer::buildProgram(const char * source_str, size_t size){
+	cl_int ret;
+	if (context == NULL) {
+		// Create an OpenCL context
+		context = clCreateContext( NULL, 1, &device_id, NULL, NULL, &ret);
+		openclCheck(ret);
+		// Create a command queue
+		cl_command_queue_properties properties = KERNEL_TIMING ? CL_QUEUE_PROFILING_ENABLE : 0;
+		command_queue = clCreateCommandQueue(context, device_id, properties, &ret);
+		openclCheck(ret);
+		transfer_queue = clCreateCommandQueue(context, device_id, properties, &ret);
+		openclCheck(ret);
+	}
+	if (program != NULL) {
+		clReleaseKernel(k_memset);
+		clReleaseKernel(k_add);
+		if (k_cbow)
+			clReleaseKernel(k_cbow);
+		clReleaseKernel(k_cbow_tile);
+		clReleaseKernel(k_subsample_count);
+		clReleaseKernel(k_subsample_scan);
+		clReleaseKernel(k_subsample_compact);
+		clReleaseKernel(k_subsample_offsets);
+		clReleaseKernel(k_quantize_delta);
+		clReleaseKernel(k_apply_delta);
+		clReleaseProgram(program);
+	}
 
-		ret = clGetKernelWorkGroupInfo(k_memset, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
-	                                              sizeof(size_t), &wavefront_size, NULL); openclCheck(ret)
+	program = clCreateProgramWithSource(context, 1, (const char **)&source_str,
+		(const size_t *)&size, &ret); openclCheck(ret);
+	if (program == NULL)
+	{
+		printf("Failed to create CL program from source.\n");
+		exit(0);
+	}
+	char options[MAX_STRING];
+	snprintf(options, sizeof(options), "-D THREADS_PER_WORD=%d -D BLOCK_SIZE=%d -D SCAN_BLOCK=%d",
+			geometry.threads_per_word, geometry.threads_per_word, SCAN_BLOCK);
+	ret  = clBuildProgram(program, 1, &device_id, options, NULL, NULL);
+	if (ret != CL_SUCCESS)
+	{
+		// Determine the reason for the error
+		size_t len;
+		ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, 0, NULL, &len);
+		char *buffer = (char *) calloc(len, sizeof(char));
+		ret = clGetProgramBuildInfo(program, device_id, CL_PROGRAM_BUILD_LOG, len, buffer, NULL);
 
-		if (wavefront_size == 32){
-			k_cbow   = clCreateKernel(program, "device_cbow", &ret); openclCheck(ret) ;
-		}
-		else if (wavefront_size == 64){
-			k_cbow   = clCreateKernel(program, "device_cbow64", &ret); openclCheck(ret) ;
-		}else {
-			printf("Unsupport wave front size of %d.\n", wavefront_size);
-			assert(wavefront_size == 64);
-		}
-		real * h_expTable = (real *)malloc((EXP_TABLE_SIZE ) * sizeof(real));
-		for (int i = 0; i < EXP_TABLE_SIZE; i++) {
-			h_expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP);
-			h_expTable[i] = h_expTable[i] / (h_expTable[i] + 1);
-		}
+		printf("Error in kernel:\n");
+		printf("%s\n", buffer);
+		free(buffer);
+		clReleaseProgram(program);
+		exit(0);
+	}
 
-		d_expTable = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(real) * EXP_TABLE_SIZE, NULL, &ret); openclCheck(ret)
-		ret = clEnqueueWriteBuffer(command_queue, d_expTable, CL_TRUE, 0,
-				sizeof(real) * EXP_TABLE_SIZE, h_expTable, 0, NULL, NULL);openclCheck(ret)
+	k_memset = clCreateKernel(program, "device_memset", &ret); openclCheck(ret) ;
+	k_add = clCreateKernel(program, "device_add", &ret); openclCheck(ret) ;
+	k_subsample_count = clCreateKernel(program, "device_subsample_count", &ret); openclCheck(ret) ;
+	k_subsample_scan = clCreateKernel(program, "device_subsample_scan", &ret); openclCheck(ret) ;
+	k_subsample_compact = clCreateKernel(program, "device_subsample_compact", &ret); openclCheck(ret) ;
+	k_subsample_offsets = clCreateKernel(program, "device_subsample_offsets", &ret); openclCheck(ret) ;
+	k_quantize_delta = clCreateKernel(program, "device_quantize_delta", &ret); openclCheck(ret) ;
+	k_apply_delta = clCreateKernel(program, "device_apply_delta", &ret); openclCheck(ret) ;
 
-		free(h_expTable);
+//	size_t workgroup_size;
+//	ret = clGetKernelWorkGroupInfo(k_memset, device_id, CL_KERNEL_WORK_GROUP_SIZE,
+//	                                              sizeof(size_t), &workgroup_size, NULL);openclCheck(ret);
+//	maxThreadsPerBlock = workgroup_size;
 
-		if (negative>0) {
-			int syn1neg_size = vocab_size * layer1_size_aligned;
-			d_syn1neg = clCreateBuffer(context, CL_MEM_READ_WRITE, syn1neg_size * sizeof(real), NULL, &ret);openclCheck(ret)
+	ret = clGetKernelWorkGroupInfo(k_memset, device_id, CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                                              sizeof(size_t), &wavefront_size, NULL); openclCheck(ret)
 
-			// call memset kernel
-			cl_int ret  = clSetKernelArg(k_memset, 0, sizeof(cl_mem), &d_syn1neg); openclCheck(ret);
-			ret = clSetKernelArg(k_memset, 1, sizeof(syn1neg_size), &syn1neg_size);
-			size_t global_size = syn1neg_size;
-			ret =  clEnqueueNDRangeKernel(command_queue, k_memset, 1, NULL,&global_size, NULL, 0, NULL, NULL);
-			openclCheck(ret);
-			openclCheck(clFinish(command_queue));
+	cl_device_type type = 0;
+	clGetDeviceInfo(device_id, CL_DEVICE_TYPE, sizeof(type), &type, NULL);
+	lockstep = !(type & CL_DEVICE_TYPE_CPU) && (wavefront_size == 32 || wavefront_size == 64);
+	k_cbow = NULL;
+	if (lockstep) {
+		k_cbow = clCreateKernel(program, wavefront_size == 32 ? "device_cbow" : "device_cbow64", &ret);
+		openclCheck(ret);
+	}
+	k_cbow_tile = clCreateKernel(program, "device_cbow_tile", &ret); openclCheck(ret) ;
+	cl_kernel kernels[2] = { k_cbow_tile, k_cbow };
+	for (int k = 0; k < (k_cbow ? 2 : 1); k++) {
+		size_t kernel_group;
+		ret = clGetKernelWorkGroupInfo(kernels[k], device_id, CL_KERNEL_WORK_GROUP_SIZE,
+				sizeof(size_t), &kernel_group, NULL); openclCheck(ret)
+		if (kernel_group < max_work_group)
+			max_work_group = kernel_group;
+	}
+}
+
+// The cbow reductions unroll the last 2 * wavefront_size steps, so a word
+// needs at least that many threads, and a power of two. The tile kernel
+// reduces with a barrier per step and needs room for a tile of one. Only
+// valid once the program was built.
+int GPUTrainer::supportsGeometry(const BatchGeometry & g){
+	int t = g.threads_per_word;
+	if ((lockstep && t < 2 * (int) wavefront_size) || (t & (t - 1)) != 0 || t > (int) max_work_group)
+		return 0;
+	size_t rows = lockstep ? 0 : 2 * (2 * window + 2) * (size_t) layer1_size_aligned;
+	if ((t + 2 * layer1_size_aligned + rows) * sizeof(real) > local_mem_size)
+		return 0;
+	return g.sentence_num > 0 && g.sentence_length > 0;
+}
+
+// Switches to another geometry, rebuilding the program and the batch buffers
+// only when they change. Returns 0 if the device cannot run it.
+int GPUTrainer::applyGeometry(const BatchGeometry & g){
+	BatchGeometry old = geometry;
+	geometry = g;
+	if (g.threads_per_word != old.threads_per_word)
+		buildProgram(source_str, source_size);
+	if (g.batchTokens() != old.batchTokens()) {
+		releaseBatchBuffers();
+		allocBatchBuffers();
+		openclCheck(clFinish(command_queue));
+		free(h_random);
+		h_random = NULL;
+	}
+	if (!supportsGeometry(g))
+		return 0;
+	this->setCbowArgs();
+	return 1;
+}
 
-			d_table = clCreateBuffer(context, CL_MEM_READ_ONLY, table_size * sizeof(int), NULL, &ret);openclCheck(ret)
-			size_t table_mem = table_size * sizeof(int);
+void GPUTrainer::finishQueue(){
+	openclCheck(clFinish(transfer_queue));
+	openclCheck(clFinish(command_queue));
+	for (int i = 0; i < slot_count; i++)
+		waitKernel(slots[i]);
+}
 
-			ret= clEnqueueWriteBuffer(command_queue, d_table, CL_TRUE, 0,table_mem, table, 0, NULL, NULL);openclCheck(ret)
+// Allocates the device buffers and queues all initial uploads without
+// waiting for them, so the transfers of all devices overlap.
+// The host arrays must stay valid until finishUpload() returns.
+void GPUTrainer::startUpload(const real * h_expTable){
+	cl_int ret;
+	cl_event ev = NULL;
+	d_expTable = clCreateBuffer(context, CL_MEM_READ_ONLY, sizeof(real) * EXP_TABLE_SIZE, NULL, &ret); openclCheck(ret)
+	ret = clEnqueueWriteBuffer(command_queue, d_expTable, CL_FALSE, 0,
+			sizeof(real) * EXP_TABLE_SIZE, h_expTable, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+	profilerDeviceEvent(id, "upload expTable", ev, sizeof(real) * EXP_TABLE_SIZE);
+
+	if (negative>0) {
+		cl_long syn1neg_size = (cl_long) vocab_size * layer1_size_aligned;
+		d_syn1neg = clCreateBuffer(context, CL_MEM_READ_WRITE | (sharedModel() ? CL_MEM_ALLOC_HOST_PTR : 0),
+				(size_t) syn1neg_size * sizeof(real), NULL, &ret);openclCheck(ret)
+
+		// call memset kernel
+		ret = clSetKernelArg(k_memset, 0, sizeof(cl_mem), &d_syn1neg); openclCheck(ret);
+		ret = clSetKernelArg(k_memset, 1, sizeof(syn1neg_size), &syn1neg_size); openclCheck(ret);
+		size_t global_size = syn1neg_size;
+		ret =  clEnqueueNDRangeKernel(command_queue, k_memset, 1, NULL,&global_size, NULL, 0, NULL, PROFILE_EVENT(ev));
+		openclCheck(ret);
+		profilerDeviceEvent(id, "memset syn1neg", ev, 0);
+
+		d_table = clCreateBuffer(context, CL_MEM_READ_ONLY, table_size * sizeof(int), NULL, &ret);openclCheck(ret)
+		size_t table_mem = table_size * sizeof(int);
+
+		ret= clEnqueueWriteBuffer(command_queue, d_table, CL_FALSE, 0,table_mem, table, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+		profilerDeviceEvent(id, "upload table", ev, table_mem);
+	}
+
+	size_t syn0_size = (size_t) vocab_size * layer1_size_aligned;
+	d_syn0 = clCreateBuffer(context, CL_MEM_READ_WRITE | (sharedModel() ? CL_MEM_ALLOC_HOST_PTR : 0),
+			syn0_size * sizeof(real), NULL, &ret);openclCheck(ret)
+
+	d_keep = clCreateBuffer(context, CL_MEM_READ_ONLY, vocab_size * sizeof(real), NULL, &ret);openclCheck(ret)
+	ret = clEnqueueWriteBuffer(command_queue, d_keep, CL_FALSE, 0, vocab_size * sizeof(real), keep_table, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+	profilerDeviceEvent(id, "upload keep", ev, vocab_size * sizeof(real));
+
+	subsample_seed = (unsigned int) rand();
+	allocBatchBuffers();
+	openclCheck(clFlush(command_queue));
+}
+
+// Allocates the buffers sized by the batch geometry. The random seeds are
+// uploaded without waiting, h_random is freed once the queue drained.
+// With shared memory the host fills the device buffers of the batch.
+void GPUTrainer::allocBatchBuffers(){
+	cl_int ret;
+	cl_event ev = NULL;
+	int tokens = geometry.batchTokens();
+	cl_mem_flags batch_flags = CL_MEM_READ_ONLY | (host_memory == HOST_MEMORY_SHARED ? CL_MEM_ALLOC_HOST_PTR : 0);
+	int depth = queue_depth < 1 ? 1 : queue_depth > MAX_QUEUE_DEPTH ? MAX_QUEUE_DEPTH : queue_depth;
+	slot_count = depth + tokenizer_threads - 1;
+	for (int i = 0; i < slot_count; i++) {
+		BatchSlot & slot = slots[i];
+		slot.d_sen = clCreateBuffer(context, batch_flags, tokens * sizeof(int), NULL, &ret);openclCheck(ret)
+		slot.d_sen_offsets = clCreateBuffer(context, batch_flags, (tokens + 1) * sizeof(int), NULL, &ret);openclCheck(ret)
+		if (host_memory == HOST_MEMORY_SHARED)
+			mapBatch(slot);
+		else {
+			slot.sen = (int *) allocHost(&slot.h_batch, (2 * tokens + 1) * sizeof(int));
+			slot.sen_offsets = slot.sen + tokens;
 		}
+	}
+	d_words = clCreateBuffer(context, CL_MEM_READ_WRITE, tokens * sizeof(int), NULL, &ret);openclCheck(ret)
+	d_offsets = clCreateBuffer(context, CL_MEM_READ_WRITE, (tokens + 1) * sizeof(int), NULL, &ret);openclCheck(ret)
+	d_position = clCreateBuffer(context, CL_MEM_READ_WRITE, tokens * sizeof(int), NULL, &ret);openclCheck(ret)
+	d_count = clCreateBuffer(context, CL_MEM_READ_WRITE, sizeof(int), NULL, &ret);openclCheck(ret)
+	d_block_sum = clCreateBuffer(context, CL_MEM_READ_WRITE, (tokens + SCAN_BLOCK - 1) / SCAN_BLOCK * sizeof(int), NULL, &ret);openclCheck(ret)
+
+	d_random = clCreateBuffer(context, CL_MEM_READ_WRITE, tokens * sizeof(unsigned int), NULL, &ret);openclCheck(ret)
+	h_random = (unsigned int *) malloc(tokens * sizeof(unsigned int));
 
-		int syn0_size = vocab_size * layer1_size_aligned;
-		d_syn0 = clCreateBuffer(context, CL_MEM_READ_WRITE, syn0_size * sizeof(real), NULL, &ret);openclCheck(ret)
+	for (int i = 0 ; i < tokens; i++) h_random[i] = (unsigned int) rand();
+	ret = clEnqueueWriteBuffer(command_queue, d_random, CL_FALSE, 0, tokens * sizeof(unsigned int), h_random, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+	profilerDeviceEvent(id, "upload random", ev, tokens * sizeof(unsigned int));
+}
 
-		d_sen = clCreateBuffer(context, CL_MEM_READ_ONLY, (MAX_SENTENCE_NUM * MAX_SENTENCE_LENGTH + MAX_SENTENCE_NUM) * sizeof(int), NULL, &ret);openclCheck(ret)
+// Shared memory: maps the batch buffers of the slot for its next batch
+// behind the kernels reading them, beginBatch() waits for the mapping
+void GPUTrainer::mapBatch(BatchSlot & slot){
+	cl_int ret;
+	int tokens = geometry.batchTokens();
+	slot.sen = (int *) clEnqueueMapBuffer(command_queue, slot.d_sen, CL_FALSE, CL_MAP_WRITE, 0,
+			tokens * sizeof(int), 0, NULL, NULL, &ret);openclCheck(ret)
+	slot.sen_offsets = (int *) clEnqueueMapBuffer(command_queue, slot.d_sen_offsets, CL_FALSE, CL_MAP_WRITE, 0,
+			(tokens + 1) * sizeof(int), 0, NULL, &slot.ready, &ret);openclCheck(ret)
+	openclCheck(clFlush(command_queue));
+}
 
-		d_random = clCreateBuffer(context, CL_MEM_READ_WRITE, MAX_SENTENCE_LENGTH * sizeof(unsigned int), NULL, &ret);openclCheck(ret)
-		int h_random[MAX_SENTENCE_LENGTH];
+void GPUTrainer::unmapBatch(BatchSlot & slot){
+	if (slot.ready) {
+		openclCheck(clWaitForEvents(1, &slot.ready));
+		clReleaseEvent(slot.ready);
+		slot.ready = NULL;
+	}
+	if (slot.sen == NULL)
+		return;
+	openclCheck(clEnqueueUnmapMemObject(command_queue, slot.d_sen, slot.sen, 0, NULL, NULL));
+	openclCheck(clEnqueueUnmapMemObject(command_queue, slot.d_sen_offsets, slot.sen_offsets, 0, NULL, NULL));
+	slot.sen = slot.sen_offsets = NULL;
+}
 
-		for (int i = 0 ; i < MAX_SENTENCE_LENGTH; i++) h_random[i] = (unsigned int) rand();
-		ret = clEnqueueWriteBuffer(command_queue, d_random, CL_TRUE, 0, MAX_SENTENCE_LENGTH * sizeof(unsigned int), h_random, 0, NULL, NULL);openclCheck(ret)
+void GPUTrainer::beginBatch(int index){
+	BatchSlot & slot = slots[index];
+	if (slot.ready == NULL)
+		return;
+	openclCheck(clWaitForEvents(1, &slot.ready));
+	clReleaseEvent(slot.ready);
+	slot.ready = NULL;
+}
 
-		numBlock = MAX_SENTENCE_LENGTH / (BLOCK_SIZE/THREADS_PER_WORD) + 1;
-		shared_mem_usage = (BLOCK_SIZE + (BLOCK_SIZE/THREADS_PER_WORD) * layer1_size_aligned * 2) * sizeof(real);
+// Shared memory: hands the model mapped by getResultData() back to the device
+void GPUTrainer::unmapModel(){
+	if (!model_mapped)
+		return;
+	openclCheck(clEnqueueUnmapMemObject(command_queue, d_syn0, syn0, 0, NULL, NULL));
+	openclCheck(clEnqueueUnmapMemObject(command_queue, d_syn1neg, syn1neg, 0, NULL, NULL));
+	syn0 = syn1neg = NULL;
+	model_mapped = 0;
+}
 
-		this->setCbowArgs();
+void GPUTrainer::releaseBatchBuffers(){
+	for (int i = 0; i < slot_count; i++) {
+		BatchSlot & slot = slots[i];
+		waitKernel(slot);
+		if (host_memory == HOST_MEMORY_SHARED)
+			unmapBatch(slot);
+		else {
+			if (slot.ready) {
+				openclCheck(clWaitForEvents(1, &slot.ready));
+				clReleaseEvent(slot.ready);
+			}
+			freeHost(&slot.h_batch, slot.sen);
+		}
+		if (slot.d_sen) openclCheck(clReleaseMemObject(slot.d_sen));
+		if (slot.d_sen_offsets) openclCheck(clReleaseMemObject(slot.d_sen_offsets));
+		memset(&slot, 0, sizeof(slot));
 	}
+	if (d_words) openclCheck(clReleaseMemObject(d_words));
+	if (d_offsets) openclCheck(clReleaseMemObject(d_offsets));
+	if (d_position) openclCheck(clReleaseMemObject(d_position));
+	if (d_count) openclCheck(clReleaseMemObject(d_count));
+	if (d_block_sum) openclCheck(clReleaseMemObject(d_block_sum));
+	if (d_random) openclCheck(clReleaseMemObject(d_random));
+	d_words = d_offsets = d_position = d_count = d_block_sum = d_random = NULL;
+}
+
+void GPUTrainer::finishUpload(){
+	openclCheck(clFinish(command_queue));
+	free(h_random);
+	h_random = NULL;
+	profilerResolve(id);
 
-	sen = (int*) malloc((MAX_SENTENCE_NUM * MAX_SENTENCE_LENGTH + MAX_SENTENCE_NUM) * sizeof(int));
-	posix_memalign((void **) &syn0, 128, (int) vocab_size * layer1_size_aligned * sizeof(real));
-	posix_memalign((void **) &syn1neg, 128, (int) vocab_size * layer1_size_aligned * sizeof(real));
+	this->setCbowArgs();
+
+	// Async averaging needs a snapshot of the epoch while the next one
+	// trains. Otherwise the model is streamed back by requestRows(), or
+	// mapped in place when shared.
+	if (async_average) {
+		syn0 = (float *) allocHost(&h_syn0, (size_t) vocab_size * layer1_size_aligned * sizeof(real));
+		syn1neg = (float *) allocHost(&h_syn1neg, (size_t) vocab_size * layer1_size_aligned * sizeof(real));
+	}
+	if (sync_quantize) {
+		cl_int ret;
+		size_t model = (size_t) vocab_size * layer1_size_aligned * sizeof(real);
+		for (int m = 0; m < (d_syn1neg ? 2 : 1); m++) {
+			d_ref[m] = clCreateBuffer(context, CL_MEM_READ_WRITE, model, NULL, &ret); openclCheck(ret)
+			if (sync_quantize == 2) {
+				d_error[m] = clCreateBuffer(context, CL_MEM_READ_WRITE, model, NULL, &ret); openclCheck(ret)
+			}
+			d_q[m] = clCreateBuffer(context, CL_MEM_READ_WRITE, (size_t) vocab_size * layer1_size, NULL, &ret);
+			openclCheck(ret)
+			d_scale[m] = clCreateBuffer(context, CL_MEM_READ_WRITE, vocab_size * sizeof(float), NULL, &ret);
+			openclCheck(ret)
+		}
+	}
 
 	bitmap.setSize(vocab_size);
 }
 
 void GPUTrainer::setCbowArgs(){
 	cl_int ret;
-	ret  = clSetKernelArg(k_cbow, 1, sizeof(layer1_size), &layer1_size); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 2, sizeof(layer1_size_aligned), &layer1_size_aligned); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 3, sizeof(window), &window); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 4, sizeof(negative), &negative); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 5, sizeof(table_size), &table_size); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 6, sizeof(vocab_size), &vocab_size); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 7, sizeof(d_sen), &d_sen); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 8, sizeof(d_table), &d_table); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 9, sizeof(d_syn0), &d_syn0); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 10, sizeof(d_syn1neg), &d_syn1neg); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 11, sizeof(d_random), &d_random); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 12, sizeof(d_expTable), &d_expTable); openclCheck(ret);
-	ret  = clSetKernelArg(k_cbow, 13, shared_mem_usage , NULL); openclCheck(ret);
+	// f of the reduction, then neu1 and neu1e of the word
+	shared_mem_usage = (geometry.threads_per_word + layer1_size_aligned * 2) * sizeof(real);
+	// The tile kernel adds the running sums of the rows and of their
+	// updates, tile + 2 * window + 1 rows each
+	long long spare = (long long) local_mem_size - shared_mem_usage;
+	int fits = (int) (spare / (long long) (2 * layer1_size_aligned * sizeof(real))) - 2 * window - 1;
+	int old_tile = tile;
+	// Without lockstep wavefronts a tile of one stands in for device_cbow
+	int want = lockstep || cbow_tile > 0 ? cbow_tile : 1;
+	tile = want < fits ? want : fits;
+	if (tile < 0)
+		tile = 0;
+	if (tile != old_tile && tile < want)
+		printf("%s: a cbow tile of %d positions fits local memory, not %d\n", device_name, tile, want);
+	else if (tile != old_tile && !lockstep && cbow_tile == 0 && debug_mode > 0)
+		printf("%s: no lockstep wavefronts, training with tiles of one position\n", device_name);
+	tile_shared_mem_usage = shared_mem_usage + 2 * (tile + 2 * window + 1) * layer1_size_aligned * sizeof(real);
+	cl_kernel kernels[2] = { k_cbow_tile, k_cbow };
+	for (int k = 0; k < (k_cbow ? 2 : 1); k++) {
+		ret  = clSetKernelArg(kernels[k], 2, sizeof(layer1_size), &layer1_size); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 3, sizeof(layer1_size_aligned), &layer1_size_aligned); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 4, sizeof(window), &window); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 5, sizeof(negative), &negative); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 6, sizeof(table_size), &table_size); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 7, sizeof(vocab_size), &vocab_size); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 8, sizeof(d_words), &d_words); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 9, sizeof(d_offsets), &d_offsets); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 10, sizeof(d_count), &d_count); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 11, sizeof(d_table), &d_table); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 12, sizeof(d_syn0), &d_syn0); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 13, sizeof(d_syn1neg), &d_syn1neg); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 14, sizeof(d_random), &d_random); openclCheck(ret);
+		ret  = clSetKernelArg(kernels[k], 15, sizeof(d_expTable), &d_expTable); openclCheck(ret);
+	}
+	if (k_cbow) {
+		ret  = clSetKernelArg(k_cbow, 16, shared_mem_usage , NULL); openclCheck(ret);
+	}
+	ret  = clSetKernelArg(k_cbow_tile, 16, tile_shared_mem_usage, NULL); openclCheck(ret);
+	ret  = clSetKernelArg(k_cbow_tile, 17, sizeof(tile), &tile); openclCheck(ret);
+
+	ret  = clSetKernelArg(k_subsample_count, 2, sizeof(d_keep), &d_keep); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_count, 4, sizeof(d_block_sum), &d_block_sum); openclCheck(ret);
+
+	ret  = clSetKernelArg(k_subsample_scan, 0, sizeof(d_block_sum), &d_block_sum); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_scan, 2, sizeof(d_count), &d_count); openclCheck(ret);
+
+	ret  = clSetKernelArg(k_subsample_compact, 2, sizeof(d_keep), &d_keep); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_compact, 4, sizeof(d_block_sum), &d_block_sum); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_compact, 5, sizeof(d_words), &d_words); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_compact, 6, sizeof(d_position), &d_position); openclCheck(ret);
+
+	ret  = clSetKernelArg(k_subsample_offsets, 3, sizeof(d_position), &d_position); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_offsets, 4, sizeof(d_count), &d_count); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_offsets, 5, sizeof(d_offsets), &d_offsets); openclCheck(ret);
 }
 
 void GPUTrainer::cleanUpGPU(){
+	unmapModel();
+	releaseBatchBuffers();
+	freeHost(&h_syn0, syn0);
+	freeHost(&h_syn1neg, syn1neg);
+	syn0 = syn1neg = NULL;
+	for (int i = 0; i < MAX_READBACK_LANES; i++) {
+		ReadbackLane & l = lanes[i];
+		for (int h = 0; h < 2; h++)
+			if (l.done[h]) {
+				openclCheck(clWaitForEvents(1, &l.done[h]));
+				clReleaseEvent(l.done[h]);
+			}
+		freeHost(&l.h_rows, l.rows);
+	}
+	memset(lanes, 0, sizeof(lanes));
 
 	if (d_syn1neg) openclCheck(clReleaseMemObject(d_syn1neg));
 	if (d_syn0) openclCheck(clReleaseMemObject(d_syn0));
-	if (d_sen) openclCheck(clReleaseMemObject(d_sen));
-	if (d_random) openclCheck(clReleaseMemObject(d_random));
 	if (d_table) openclCheck(clReleaseMemObject(d_table));
+	if (d_keep) openclCheck(clReleaseMemObject(d_keep));
+	if (d_expTable) openclCheck(clReleaseMemObject(d_expTable));
+	if (d_delta) openclCheck(clReleaseMemObject(d_delta));
+	for (int m = 0; m < 2; m++) {
+		if (d_ref[m]) openclCheck(clReleaseMemObject(d_ref[m]));
+		if (d_error[m]) openclCheck(clReleaseMemObject(d_error[m]));
+		if (d_q[m]) openclCheck(clReleaseMemObject(d_q[m]));
+		if (d_scale[m]) openclCheck(clReleaseMemObject(d_scale[m]));
+	}
+}
+
+
+static pthread_t * build_threads;
+static unsigned long long build_start;
 
-	if (sen) free(sen);
-	if (syn0) free(syn0);
-	if (syn1neg) free(syn1neg);
+static void *BuildThread(void *id){
+	GPUTrainer & trainer = gpuTrainers[(long) id];
+	trainer.buildProgram(source_str, source_size);
+	if (!trainer.supportsGeometry(trainer.getGeometry())) {
+		printf("%s cannot run %d threads per word\n", trainer.getDeviceName(),
+				trainer.getGeometry().threads_per_word);
+		exit(1);
+	}
+	return NULL;
+}
+
+// One trainer per device or sub-device, label numbers its lines in the listing
+static void addTrainer(cl_device_id device, int sub_device, int label)
+{
+	GPUTrainer newGPUTrainer(device, gpuTrainers.size());
+	if (sub_device)
+		newGPUTrainer.markSubDevice();
+	profilerSetTrackName(gpuTrainers.size(), newGPUTrainer.getDeviceName());
+	printf("\t\t%d.%d Host memory: %s\n", label, 5, host_memory_names[newGPUTrainer.getHostMemory()]);
+	if (autotune == 1)
+		autotuneLookup(newGPUTrainer);
+	gpuTrainers.push_back(newGPUTrainer);
+}
+
+// Splits the device into sub_devices trainers with equal compute units
+static void addSubDevices(cl_device_id device, cl_uint computeUnits, int label)
+{
+	cl_uint max_sub = 0;
+	clGetDeviceInfo(device, CL_DEVICE_PARTITION_MAX_SUB_DEVICES, sizeof(max_sub), &max_sub, NULL);
+	cl_uint units = computeUnits / sub_devices;
+	if ((int) max_sub < sub_devices || units == 0) {
+		printf("Device %d cannot be split into %d sub-devices (at most %u), try -device-type cpu\n",
+				label, sub_devices, max_sub);
+		exit(1);
+	}
+	// Partitioning equally would make as many sub-devices as the units allow,
+	// counts give exactly the ones asked for and the rest of the units stay idle
+	cl_device_partition_property * properties = (cl_device_partition_property *)
+			malloc((sub_devices + 3) * sizeof(cl_device_partition_property));
+	properties[0] = CL_DEVICE_PARTITION_BY_COUNTS;
+	for (int k = 0; k < sub_devices; k++)
+		properties[k + 1] = (cl_device_partition_property) units;
+	properties[sub_devices + 1] = CL_DEVICE_PARTITION_BY_COUNTS_LIST_END;
+	properties[sub_devices + 2] = 0;
+	cl_device_id * subs = (cl_device_id *) malloc(sub_devices * sizeof(cl_device_id));
+	cl_uint count = 0;
+	cl_int ret = clCreateSubDevices(device, properties, sub_devices, subs, &count);
+	free(properties);
+	if (ret != CL_SUCCESS || (int) count != sub_devices) {
+		printf("Device %d cannot be split into %d sub-devices of %u compute units, OpenCL error %d\n",
+				label, sub_devices, units, ret);
+		exit(1);
+	}
+	printf("\t\t%d.%d %u sub-devices of %u compute units\n", label, 6, count, units);
+	for (cl_uint k = 0; k < count; k++)
+		addTrainer(subs[k], 1, label);
+	free(subs);
+}
+
+static cl_device_type deviceType()
+{
+	if (!strcmp(device_type, "gpu"))
+		return CL_DEVICE_TYPE_GPU;
+	if (!strcmp(device_type, "cpu"))
+		return CL_DEVICE_TYPE_CPU;
+	if (!strcmp(device_type, "accelerator"))
+		return CL_DEVICE_TYPE_ACCELERATOR;
+	if (!strcmp(device_type, "all"))
+		return CL_DEVICE_TYPE_ALL;
+	printf("Unknown device type %s, use gpu, cpu, accelerator or all\n", device_type);
+	exit(1);
 }
 
+// Whether the device numbered label in the listing is in device_list
+static int deviceSelected(int label)
+{
+	if (device_list[0] == 0)
+		return 1;
+	const char * p = device_list;
+	while (*p) {
+		char * next;
+		long n = strtol(p, &next, 10);
+		if (next == p) {
+			printf("Bad device list %s, use numbers separated by commas\n", device_list);
+			exit(1);
+		}
+		if (n == label)
+			return 1;
+		p = *next == ',' ? next + 1 : next;
+	}
+	return 0;
+}
 
+// Enumerates the devices and starts building the program on all of them in
+// background threads. uploadGPUData() waits for the builds to finish.
 void initializeGPU()
 {
 	cl_uint platformCount;
@@ -177,79 +672,96 @@ void initializeGPU()
 	cl_device_id* devices;
 	char* value;
 	size_t valueSize;
-    cl_uint maxComputeUnits = 0;
     cl_int ret;
+	cl_device_type type = deviceType();
+	// Devices are numbered across the platforms, as -devices picks them
+	int label = 0;
+	if (sub_devices < 1)
+		sub_devices = 1;
 	ret = clGetPlatformIDs(0, NULL, &platformCount); openclCheck(ret);
 	platforms = (cl_platform_id*) malloc(sizeof(cl_platform_id) * platformCount);
 	ret = clGetPlatformIDs(platformCount, platforms, NULL);  openclCheck(ret);
 	printf("Detect %d platform available.\n",platformCount);
     for (unsigned int i= 0; i < platformCount; i++) {
         // get all devices
-        ret = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, 0, NULL, &deviceCount);  openclCheck(ret)
-        devices = (cl_device_id*) malloc(sizeof(cl_device_id) * deviceCount);
-        ret = clGetDeviceIDs(platforms[i], CL_DEVICE_TYPE_GPU, deviceCount, devices, NULL); openclCheck(ret)
+        ret = clGetDeviceIDs(platforms[i], type, 0, NULL, &deviceCount);
+        if (ret == CL_DEVICE_NOT_FOUND)
+            deviceCount = 0;
+        else
+            openclCheck(ret)
         printf("Platform %d. %d device available.\n", i+1, deviceCount );
+        if (deviceCount == 0)
+            continue;
+        devices = (cl_device_id*) malloc(sizeof(cl_device_id) * deviceCount);
+        ret = clGetDeviceIDs(platforms[i], type, deviceCount, devices, NULL); openclCheck(ret)
         // for each device print critical attributes
         for (unsigned int j = 0; j < deviceCount; j++) {
+            label++;
+            int selected = deviceSelected(label);
             // print device name
             ret = clGetDeviceInfo(devices[j], CL_DEVICE_NAME, 0, NULL, &valueSize); openclCheck(ret)
             value = (char*) malloc(valueSize);
             ret = clGetDeviceInfo(devices[j], CL_DEVICE_NAME, valueSize, value, NULL); openclCheck(ret)
-            printf("\t%d. Device: %s\n", j+1, value);
+            printf("\t%d. Device: %s%s\n", label, value, selected ? "" : " (not selected)");
             free(value);
+            if (!selected)
+                continue;
 
             // print hardware device version
             ret = clGetDeviceInfo(devices[j], CL_DEVICE_VERSION, 0, NULL, &valueSize); openclCheck(ret)
             value = (char*) malloc(valueSize);
             ret = clGetDeviceInfo(devices[j], CL_DEVICE_VERSION, valueSize, value, NULL); openclCheck(ret)
-            printf("\t\t%d.%d Hardware version: %s\n", j+1, 1, value);
+            printf("\t\t%d.%d Hardware version: %s\n", label, 1, value);
             free(value);
 
             // print software driver version
             ret = clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, 0, NULL, &valueSize); openclCheck(ret)
             value = (char*) malloc(valueSize);
             ret = clGetDeviceInfo(devices[j], CL_DRIVER_VERSION, valueSize, value, NULL); openclCheck(ret)
-            printf("\t\t%d.%d Software version: %s\n", j+1, 2, value);
+            printf("\t\t%d.%d Software version: %s\n", label, 2, value);
             free(value);
 
             // print c version supported by compiler for device
             ret= clGetDeviceInfo(devices[j], CL_DEVICE_OPENCL_C_VERSION, 0, NULL, &valueSize); openclCheck(ret)
             value = (char*) malloc(valueSize);
             ret = clGetDeviceInfo(devices[j], CL_DEVICE_OPENCL_C_VERSION, valueSize, value, NULL); openclCheck(ret)
-            printf("\t\t%d.%d OpenCL C version: %s\n", j+1, 3, value);
+            printf("\t\t%d.%d OpenCL C version: %s\n", label, 3, value);
             free(value);
 
             // print parallel compute units
             cl_uint computeUnits;
             ret = clGetDeviceInfo(devices[j], CL_DEVICE_MAX_COMPUTE_UNITS,
                     sizeof(computeUnits), &computeUnits, NULL); openclCheck(ret)
-            printf("\t\t%d.%d Parallel compute units: %d\n\n", j+1, 4, computeUnits);
-            maxComputeUnits += computeUnits;
-
-            GPUTrainer newGPUTrainer(devices[j]);
-            gpuTrainers.push_back(newGPUTrainer);
+            printf("\t\t%d.%d Parallel compute units: %d\n", label, 4, computeUnits);
 
+            if (sub_devices > 1)
+                addSubDevices(devices[j], computeUnits, label);
+            else
+                addTrainer(devices[j], 0, label);
+            printf("\n");
         }
         free(devices);
     }
-//    printf("Select platform [1-%d]:", platformCount);
-//    int selected_platform;
-//    //scanf("%d", &selected_platform);
-//    selected_platform = 1;
-//
-//    platform_id = platforms[selected_platform -1];
-//    clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, 0, NULL, &deviceCount);
-//    printf("Select device [1-%d]:", deviceCount);
-//    int selected_device;
-//   scanf("%d", &selected_device);
-//    //selected_device = 1;
-//    devices = (cl_device_id*) malloc(sizeof(cl_device_id) * deviceCount);
-//    clGetDeviceIDs(platform_id, CL_DEVICE_TYPE_ALL, deviceCount, devices, NULL);
-//    device_id = devices[selected_device -1];
-//    free(devices);
-//    free(platforms);
-
-	char *source_str;
+    free(platforms);
+    if (gpuTrainers.empty()) {
+        printf("No %s device selected\n", device_type);
+        exit(1);
+    }
+
+	// The CPUs are shared among the tokenizers of all devices, past a few
+	// threads per device the device is the bottleneck
+	if (tokenizer_threads <= 0) {
+		long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		tokenizer_threads = gpuTrainers.size() > 0 ? cpus / (long) gpuTrainers.size() : 1;
+		if (tokenizer_threads > AUTO_TOKENIZER_THREADS)
+			tokenizer_threads = AUTO_TOKENIZER_THREADS;
+	}
+	if (tokenizer_threads < 1)
+		tokenizer_threads = 1;
+	if (tokenizer_threads > MAX_TOKENIZER_THREADS)
+		tokenizer_threads = MAX_TOKENIZER_THREADS;
+	printf("%d tokenizer thread(s) per device\n", tokenizer_threads);
+
 	FILE * fin = fopen("word2vec.cl", "r");
 	if (fin == NULL)
 	{
@@ -257,68 +769,454 @@ void initializeGPU()
 		exit(0);
 	}
 	source_str = (char*) malloc(MAX_SOURCE_SIZE);
-	size_t source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fin);
+	source_size = fread(source_str, 1, MAX_SOURCE_SIZE, fin);
 	fclose(fin);
 	//printf("========SOURCE========\n %s", source_str);
 	//printf("======================\n");
 
-	// Build program for each GPU.
+	// Create contexts and build the program for all GPUs in parallel,
+	// the host keeps initializing the model meanwhile.
+	build_start = monotonicNs();
+	build_threads = (pthread_t *) malloc(gpuTrainers.size() * sizeof(pthread_t));
 	for (unsigned int i = 0 ; i < gpuTrainers.size(); i++)
-	{
-		gpuTrainers[i].initialWithSource(source_str, source_size);
-	}
+		pthread_create(&build_threads[i], NULL, BuildThread, (void *) (long) i);
 
-	free(source_str);
-	// Set working range for each GPUTrainer
-	float start = 0;
+	// Set working range for each GPUTrainer inside the shard of this process
+	double start = clusterShardStart();
+	double shard = clusterShardEnd() - clusterShardStart();
+	int maxComputeUnits = 0;
+	for (unsigned int i = 0 ; i < gpuTrainers.size(); i++)
+		maxComputeUnits += gpuTrainers[i].getComputeUnit();
 	for (unsigned int i = 0 ; i < gpuTrainers.size(); i++)
 	{
 		int computeUnit = gpuTrainers[i].getComputeUnit();
-		float end =(float)( computeUnit / (float) maxComputeUnits);
-		gpuTrainers[i].setWorkingRange(start, start + end);
+		double end = shard * computeUnit / (double) maxComputeUnits;
+		// The last device ends where the shard does, whatever the rounding
+		gpuTrainers[i].setWorkingRange(start, i + 1 == gpuTrainers.size() ? clusterShardEnd() : start + end);
 		start += end;
 	}
 }
 
 
-void GPUTrainer::transferDataToGPU(){
-	cl_int ret = clEnqueueWriteBuffer(command_queue, d_sen, CL_TRUE, 0,
-			(MAX_SENTENCE_NUM * MAX_SENTENCE_LENGTH + MAX_SENTENCE_NUM) * sizeof(int) , sen, 0, NULL, NULL);openclCheck(ret)
-	openclCheck(clFinish(command_queue));
+// Waits for the program builds, then uploads the lookup tables to all
+// devices at once. Needs table (InitUnigramTable) to be ready, frees it after.
+void uploadGPUData()
+{
+	for (unsigned int i = 0 ; i < gpuTrainers.size(); i++)
+		pthread_join(build_threads[i], NULL);
+	free(build_threads);
+	if (debug_mode > 0)
+		printf("Built program for %d device(s) in %.2fs\n", (int) gpuTrainers.size(),
+				(monotonicNs() - build_start) / 1e9);
+
+	real * h_expTable = (real *)malloc((EXP_TABLE_SIZE ) * sizeof(real));
+	for (int i = 0; i < EXP_TABLE_SIZE; i++) {
+		h_expTable[i] = exp((i / (real)EXP_TABLE_SIZE * 2 - 1) * MAX_EXP);
+		h_expTable[i] = h_expTable[i] / (h_expTable[i] + 1);
+	}
+	for (unsigned int i = 0 ; i < gpuTrainers.size(); i++)
+		gpuTrainers[i].startUpload(h_expTable);
+	for (unsigned int i = 0 ; i < gpuTrainers.size(); i++)
+		gpuTrainers[i].finishUpload();
+	free(h_expTable);
+	// Every device holds its own copy of the lookup tables now
+	free(table);
+	free(keep_table);
+	table = NULL;
+	keep_table = NULL;
 }
 
+// Drops the sub-devices created by initializeGPU()
+void releaseGPU()
+{
+	for (unsigned int i = 0; i < gpuTrainers.size(); i++)
+		gpuTrainers[i].releaseDevice();
+}
+
+// Queues the upload of the batch on the transfer queue, only the used part
+// of it crosses the bus. With shared memory the device reads it where the
+// host wrote it.
+void GPUTrainer::transferDataToGPU(BatchSlot & slot, int ntokens, int sentence_num){
+	cl_event ev = NULL;
+	if (host_memory == HOST_MEMORY_SHARED) {
+		unmapBatch(slot);
+		return;
+	}
+	if (slot.ready) {
+		openclCheck(clWaitForEvents(1, &slot.ready));
+		clReleaseEvent(slot.ready);
+		slot.ready = NULL;
+	}
+	size_t bytes = ntokens * sizeof(int);
+	cl_int ret = clEnqueueWriteBuffer(transfer_queue, slot.d_sen, CL_FALSE, 0,
+			bytes , slot.sen, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+	profilerTransferEvent(id, "upload sen", ev, bytes);
+	bytes = (sentence_num + 1) * sizeof(int);
+	ret = clEnqueueWriteBuffer(transfer_queue, slot.d_sen_offsets, CL_FALSE, 0,
+			bytes , slot.sen_offsets, 0, NULL, &slot.ready);openclCheck(ret)
+	if (profiling) {
+		clRetainEvent(slot.ready);
+		profilerTransferEvent(id, "upload offsets", slot.ready, bytes);
+	}
+	openclCheck(clFlush(transfer_queue));
+}
+
+// Adds the corrections ComputeDeltas() left in the host copies of the
+// model to the device model. The queue is in order, so one scratch buffer
+// serves both matrices.
+void GPUTrainer::mergeDelta(){
+	cl_int ret;
+	cl_event ev = NULL;
+	cl_long size = (cl_long) vocab_size * layer1_size_aligned;
+	size_t bytes = (size_t) size * sizeof(real);
+	unmapModel();
+	if (d_delta == NULL) {
+		d_delta = clCreateBuffer(context, CL_MEM_READ_ONLY, bytes, NULL, &ret); openclCheck(ret)
+	}
+	float * host[2] = { syn0, syn1neg };
+	cl_mem model[2] = { d_syn0, d_syn1neg };
+	for (int i = 0; i < 2; i++) {
+		ret = clEnqueueWriteBuffer(command_queue, d_delta, CL_FALSE, 0, bytes, host[i], 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+		profilerDeviceEvent(id, "upload delta", ev, bytes);
+		metricsAddSyncBytes(id, bytes);
+		ret = clSetKernelArg(k_add, 0, sizeof(cl_mem), &model[i]); openclCheck(ret);
+		ret = clSetKernelArg(k_add, 1, sizeof(cl_mem), &d_delta); openclCheck(ret);
+		ret = clSetKernelArg(k_add, 2, sizeof(size), &size); openclCheck(ret);
+		size_t global_size = size;
+		ret =  clEnqueueNDRangeKernel(command_queue, k_add, 1, NULL, &global_size, NULL, 0, NULL, PROFILE_EVENT(ev));
+		openclCheck(ret);
+		profilerDeviceEvent(id, "merge delta", ev, 0);
+	}
+}
+
+// End of an epoch: waits for the device. Only async averaging copies the
+// whole model to the host, a shared model is mapped in place and otherwise
+// the averaging streams it back with requestRows().
 void GPUTrainer::getResultData(){
-	cl_int ret = clEnqueueReadBuffer(command_queue, d_syn0, CL_TRUE, 0,
-			 vocab_size * layer1_size_aligned * sizeof(real) , syn0, 0, NULL, NULL);openclCheck(ret)
+	cl_event ev = NULL;
+	size_t bytes = (size_t) vocab_size * layer1_size_aligned * sizeof(real);
+	cl_int ret;
+	if (sharedModel()) {
+		// Averaging reads the device model in place
+		unmapModel();
+		syn0 = (float *) clEnqueueMapBuffer(command_queue, d_syn0, CL_FALSE, CL_MAP_READ | CL_MAP_WRITE, 0,
+				bytes, 0, NULL, PROFILE_EVENT(ev), &ret);openclCheck(ret)
+		profilerDeviceEvent(id, "map syn0", ev, 0);
+		syn1neg = (float *) clEnqueueMapBuffer(command_queue, d_syn1neg, CL_TRUE, CL_MAP_READ | CL_MAP_WRITE, 0,
+				bytes, 0, NULL, PROFILE_EVENT(ev), &ret);openclCheck(ret)
+		profilerDeviceEvent(id, "map syn1neg", ev, 0);
+		model_mapped = 1;
+	} else if (syn0 != NULL) {
+		ret = clEnqueueReadBuffer(command_queue, d_syn0, CL_FALSE, 0,
+				 bytes , syn0, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+		profilerDeviceEvent(id, "read syn0", ev, bytes);
+		ret = clEnqueueReadBuffer(command_queue, d_syn1neg, CL_FALSE, 0,
+				 bytes , syn1neg, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+		profilerDeviceEvent(id, "read syn1neg", ev, bytes);
+		metricsAddSyncBytes(id, 2 * bytes);
+	}
+	finishQueue();
+	profilerResolve(id);
+}
+
+void GPUTrainer::requestRows(int lane, long long first, long long last){
+	ReadbackLane & l = lanes[lane];
+	int half = l.next;
+	l.next ^= 1;
+	l.first[half] = first;
+	l.done[half] = NULL;
+	// The model is on the host already
+	if (syn0 != NULL)
+		return;
+	cl_int ret;
+	cl_event ev = NULL;
+	size_t chunk = (size_t) READBACK_ROWS * layer1_size_aligned;
+	if (l.rows == NULL)
+		l.rows = (real *) allocHost(&l.h_rows, 4 * chunk * sizeof(real));
+	real * rows = l.rows + half * 2 * chunk;
+	if (sync_quantize) {
+		// The bytes of both matrices, then their scales, in the same half
+		char * base = (char *) rows;
+		size_t q_bytes = (last - first) * layer1_size;
+		size_t s_bytes = (last - first) * sizeof(float);
+		int matrices = d_syn1neg ? 2 : 1;
+		for (int m = 0; m < matrices; m++) {
+			ret = clEnqueueReadBuffer(command_queue, d_q[m], CL_FALSE, first * layer1_size, q_bytes,
+					base + m * chunk, 0, NULL, NULL);openclCheck(ret)
+			ret = clEnqueueReadBuffer(command_queue, d_scale[m], CL_FALSE, first * sizeof(float), s_bytes,
+					base + 2 * chunk + m * READBACK_ROWS * sizeof(float), 0, NULL,
+					m + 1 == matrices ? &l.done[half] : NULL);openclCheck(ret)
+		}
+		metricsAddSyncBytes(id, matrices * (q_bytes + s_bytes));
+		if (profiling) {
+			clRetainEvent(l.done[half]);
+			profilerDeviceEvent(id, "read quantized rows", l.done[half], matrices * (q_bytes + s_bytes));
+		}
+		openclCheck(clFlush(command_queue));
+		return;
+	}
+	size_t offset = first * layer1_size_aligned * sizeof(real);
+	size_t bytes = (last - first) * layer1_size_aligned * sizeof(real);
+	ret = clEnqueueReadBuffer(command_queue, d_syn0, CL_FALSE, offset, bytes, rows, 0, NULL,
+			d_syn1neg ? PROFILE_EVENT(ev) : &l.done[half]);openclCheck(ret)
+	if (d_syn1neg) {
+		profilerDeviceEvent(id, "read syn0 rows", ev, bytes);
+		ret = clEnqueueReadBuffer(command_queue, d_syn1neg, CL_FALSE, offset, bytes, rows + chunk, 0, NULL,
+				&l.done[half]);openclCheck(ret)
+	}
+	if (profiling) {
+		clRetainEvent(l.done[half]);
+		profilerDeviceEvent(id, d_syn1neg ? "read syn1neg rows" : "read syn0 rows", l.done[half], bytes);
+	}
+	metricsAddSyncBytes(id, d_syn1neg ? 2 * bytes : bytes);
+	openclCheck(clFlush(command_queue));
+}
+
+void GPUTrainer::waitRows(int lane, ReadbackRows * rows){
+	ReadbackLane & l = lanes[lane];
+	int half = l.head;
+	l.head ^= 1;
+	memset(rows, 0, sizeof(*rows));
+	if (l.done[half] == NULL) {
+		rows->values[0] = syn0 + l.first[half] * layer1_size_aligned;
+		rows->values[1] = syn1neg ? syn1neg + l.first[half] * layer1_size_aligned : NULL;
+		return;
+	}
+	openclCheck(clWaitForEvents(1, &l.done[half]));
+	clReleaseEvent(l.done[half]);
+	l.done[half] = NULL;
+	size_t chunk = (size_t) READBACK_ROWS * layer1_size_aligned;
+	real * base = l.rows + half * 2 * chunk;
+	int matrices = d_syn1neg ? 2 : 1;
+	for (int m = 0; m < matrices; m++)
+		if (sync_quantize) {
+			rows->q[m] = (signed char *) base + m * chunk;
+			rows->scale[m] = (float *) ((char *) base + 2 * chunk) + m * READBACK_ROWS;
+		} else
+			rows->values[m] = base + m * chunk;
+}
+
+void GPUTrainer::resetReference(){
+	cl_int ret;
+	cl_event ev = NULL;
+	cl_long size = (cl_long) vocab_size * layer1_size_aligned;
+	size_t bytes = (size_t) size * sizeof(real);
+	cl_mem model[2] = { d_syn0, d_syn1neg };
+	for (int m = 0; m < (d_syn1neg ? 2 : 1); m++) {
+		ret = clEnqueueCopyBuffer(command_queue, model[m], d_ref[m], 0, 0, bytes, 0, NULL, PROFILE_EVENT(ev));
+		openclCheck(ret)
+		profilerDeviceEvent(id, "copy reference", ev, 0);
+		if (d_error[m] == NULL)
+			continue;
+		ret = clSetKernelArg(k_memset, 0, sizeof(cl_mem), &d_error[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_memset, 1, sizeof(size), &size); openclCheck(ret);
+		size_t global_size = size;
+		ret = clEnqueueNDRangeKernel(command_queue, k_memset, 1, NULL, &global_size, NULL, 0, NULL, PROFILE_EVENT(ev));
+		openclCheck(ret);
+		profilerDeviceEvent(id, "memset error", ev, 0);
+	}
 	openclCheck(clFinish(command_queue));
+	profilerResolve(id);
+}
 
-	ret = clEnqueueReadBuffer(command_queue, d_syn1neg, CL_TRUE, 0,
-			 vocab_size * layer1_size_aligned * sizeof(real) , syn1neg, 0, NULL, NULL);openclCheck(ret)
+// One work group per row, queued behind the last batch
+void GPUTrainer::quantizeDelta(){
+	cl_int ret;
+	cl_event ev = NULL;
+	cl_mem model[2] = { d_syn0, d_syn1neg };
+	for (int m = 0; m < (d_syn1neg ? 2 : 1); m++) {
+		ret = clSetKernelArg(k_quantize_delta, 0, sizeof(cl_mem), &model[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_quantize_delta, 1, sizeof(cl_mem), &d_ref[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_quantize_delta, 2, sizeof(cl_mem), &d_error[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_quantize_delta, 3, sizeof(layer1_size), &layer1_size); openclCheck(ret);
+		ret = clSetKernelArg(k_quantize_delta, 4, sizeof(layer1_size_aligned), &layer1_size_aligned); openclCheck(ret);
+		ret = clSetKernelArg(k_quantize_delta, 5, sizeof(cl_mem), &d_q[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_quantize_delta, 6, sizeof(cl_mem), &d_scale[m]); openclCheck(ret);
+		size_t local_size = SCAN_BLOCK;
+		size_t global_size = (size_t) vocab_size * SCAN_BLOCK;
+		ret = clEnqueueNDRangeKernel(command_queue, k_quantize_delta, 1, NULL, &global_size, &local_size, 0, NULL,
+				PROFILE_EVENT(ev));
+		openclCheck(ret);
+		profilerDeviceEvent(id, "quantize delta", ev, 0);
+	}
+	openclCheck(clFlush(command_queue));
+}
+
+void GPUTrainer::applyDelta(signed char * const * q, float * const * scale){
+	cl_int ret;
+	cl_event ev = NULL;
+	size_t q_bytes = (size_t) vocab_size * layer1_size;
+	size_t s_bytes = vocab_size * sizeof(float);
+	cl_long size = (cl_long) vocab_size * layer1_size_aligned;
+	cl_mem model[2] = { d_syn0, d_syn1neg };
+	int matrices = d_syn1neg ? 2 : 1;
+	for (int m = 0; m < matrices; m++) {
+		ret = clEnqueueWriteBuffer(command_queue, d_q[m], CL_FALSE, 0, q_bytes, q[m], 0, NULL, PROFILE_EVENT(ev));
+		openclCheck(ret)
+		profilerDeviceEvent(id, "upload quantized delta", ev, q_bytes);
+		ret = clEnqueueWriteBuffer(command_queue, d_scale[m], CL_FALSE, 0, s_bytes, scale[m], 0, NULL, NULL);
+		openclCheck(ret)
+		ret = clSetKernelArg(k_apply_delta, 0, sizeof(cl_mem), &model[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_apply_delta, 1, sizeof(cl_mem), &d_ref[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_apply_delta, 2, sizeof(cl_mem), &d_q[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_apply_delta, 3, sizeof(cl_mem), &d_scale[m]); openclCheck(ret);
+		ret = clSetKernelArg(k_apply_delta, 4, sizeof(layer1_size), &layer1_size); openclCheck(ret);
+		ret = clSetKernelArg(k_apply_delta, 5, sizeof(layer1_size_aligned), &layer1_size_aligned); openclCheck(ret);
+		ret = clSetKernelArg(k_apply_delta, 6, sizeof(size), &size); openclCheck(ret);
+		size_t global_size = size;
+		ret = clEnqueueNDRangeKernel(command_queue, k_apply_delta, 1, NULL, &global_size, NULL, 0, NULL, PROFILE_EVENT(ev));
+		openclCheck(ret);
+		profilerDeviceEvent(id, "apply delta", ev, 0);
+	}
+	metricsAddSyncBytes(id, matrices * (q_bytes + s_bytes));
+	// q and scale are shared by all devices, the host may reuse them after this
 	openclCheck(clFinish(command_queue));
+	profilerResolve(id);
+}
 
+void GPUTrainer::memoryUsage(int lanes, TrainerMemory * m){
+	size_t model = (size_t) vocab_size * layer1_size_aligned * sizeof(real);
+	size_t tokens = geometry.batchTokens();
+	int matrices = negative > 0 ? 2 : 1;
+	memset(m, 0, sizeof(*m));
+	// Per slot: the raw batch and its offsets. Then the compacted batch,
+	// offsets, positions, random seeds, the survivor count and scan sums.
+	size_t slot_bytes = (2 * tokens + 1) * sizeof(int);
+	m->device_batches = slot_count * slot_bytes + (3 * tokens + 1) * sizeof(int) + tokens * sizeof(unsigned int)
+			+ sizeof(int) + (tokens + SCAN_BLOCK - 1) / SCAN_BLOCK * sizeof(int);
+	if (host_memory != HOST_MEMORY_SHARED)
+		m->host_batches = slot_count * slot_bytes;
+	m->device_model = matrices * model;
+	if (async_average) {
+		m->host_model = matrices * model;
+		// Scratch of mergeDelta()
+		m->device_model += model;
+	} else if (!sharedModel())
+		m->host_readback = (size_t) lanes * 4 * READBACK_ROWS * layer1_size_aligned * sizeof(real);
+	// The reference, the rounding errors and the quantized change
+	if (sync_quantize)
+		m->device_model += matrices * ((sync_quantize == 2 ? 2 : 1) * model
+				+ (size_t) vocab_size * (layer1_size + sizeof(float)));
+	m->device_tables = sizeof(real) * EXP_TABLE_SIZE + vocab_size * sizeof(real);
+	if (negative > 0)
+		m->device_tables += table_size * sizeof(int);
 }
 
+// Waits for the training kernel of the batch that used the slot last and
+// accounts its execution time
+void GPUTrainer::waitKernel(BatchSlot & slot){
+	if (slot.kernel == NULL)
+		return;
+	openclCheck(clWaitForEvents(1, &slot.kernel));
+	if (KERNEL_TIMING) {
+		cl_ulong start, end;
+		openclCheck(clGetEventProfilingInfo(slot.kernel, CL_PROFILING_COMMAND_START, sizeof(start), &start, NULL));
+		openclCheck(clGetEventProfilingInfo(slot.kernel, CL_PROFILING_COMMAND_END, sizeof(end), &end, NULL));
+		metricsAddKernelTime(id, end - start);
+	}
+	clReleaseEvent(slot.kernel);
+	slot.kernel = NULL;
+}
 
-void GPUTrainer::trainGPU(int sentence_num) {
-	transferDataToGPU();
-	cl_int ret  = clSetKernelArg(k_cbow, 0, sizeof(sentence_num), &sentence_num); openclCheck(ret);
-	size_t global_workgroup = numBlock * BLOCK_SIZE;
-	size_t local_workgroup = BLOCK_SIZE;
 
-	ret =  clEnqueueNDRangeKernel(command_queue, k_cbow, 1, NULL,&global_workgroup, &local_workgroup, 0, NULL, NULL);
+// Subsamples the raw ids of the batch and compacts the survivors into
+// d_words: count survivors per slice, scan the counts, scatter, then move
+// the sentence offsets to the compacted positions. Starts once the upload
+// on the transfer queue completed.
+void GPUTrainer::subsampleOnGPU(BatchSlot & slot, int ntokens, int sentence_num) {
+	cl_int ret;
+	cl_event ev = NULL;
+	int nblocks = (ntokens + SCAN_BLOCK - 1) / SCAN_BLOCK;
+	subsample_seed = subsample_seed * (unsigned int) 1664525 + 1013904223;
+	ret  = clSetKernelArg(k_subsample_count, 0, sizeof(slot.d_sen), &slot.d_sen); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_compact, 0, sizeof(slot.d_sen), &slot.d_sen); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_offsets, 0, sizeof(slot.d_sen_offsets), &slot.d_sen_offsets); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_count, 1, sizeof(ntokens), &ntokens); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_count, 3, sizeof(subsample_seed), &subsample_seed); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_scan, 1, sizeof(nblocks), &nblocks); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_compact, 1, sizeof(ntokens), &ntokens); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_compact, 3, sizeof(subsample_seed), &subsample_seed); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_offsets, 1, sizeof(sentence_num), &sentence_num); openclCheck(ret);
+	ret  = clSetKernelArg(k_subsample_offsets, 2, sizeof(ntokens), &ntokens); openclCheck(ret);
+
+	size_t local_size = SCAN_BLOCK;
+	size_t global_size = nblocks * SCAN_BLOCK;
+	ret = clEnqueueNDRangeKernel(command_queue, k_subsample_count, 1, NULL, &global_size, &local_size,
+			slot.ready ? 1 : 0, slot.ready ? &slot.ready : NULL, PROFILE_EVENT(ev));
 	openclCheck(ret);
+	profilerDeviceEvent(id, "subsample count", ev, 0);
 
+	global_size = SCAN_BLOCK;
+	ret = clEnqueueNDRangeKernel(command_queue, k_subsample_scan, 1, NULL, &global_size, &local_size, 0, NULL, PROFILE_EVENT(ev));
+	openclCheck(ret);
+	profilerDeviceEvent(id, "subsample scan", ev, 0);
+
+	global_size = nblocks * SCAN_BLOCK;
+	ret = clEnqueueNDRangeKernel(command_queue, k_subsample_compact, 1, NULL, &global_size, &local_size, 0, NULL, PROFILE_EVENT(ev));
+	openclCheck(ret);
+	profilerDeviceEvent(id, "subsample compact", ev, 0);
+
+	global_size = (sentence_num / SCAN_BLOCK + 1) * SCAN_BLOCK;
+	ret = clEnqueueNDRangeKernel(command_queue, k_subsample_offsets, 1, NULL, &global_size, &local_size, 0, NULL, PROFILE_EVENT(ev));
+	openclCheck(ret);
+	profilerDeviceEvent(id, "subsample offsets", ev, 0);
+}
+
+// Trains one CSR batch of ntokens raw ids in sentence_num sentences. The
+// launch covers the raw token count, groups past the number of surviving
+// tokens exit right away. Returns once the batch is queued, the slot may be
+// handed back to the tokenizers right away.
+void GPUTrainer::trainGPU(int index, int ntokens, int sentence_num, real alpha) {
+	unmapModel();
+	if (ntokens == 0)
+		return;
+	BatchSlot & slot = slots[index];
+	// The device buffers of the slot are free once the batch that used them
+	// last was trained
+	waitKernel(slot);
+	transferDataToGPU(slot, ntokens, sentence_num);
+	subsampleOnGPU(slot, ntokens, sentence_num);
+	// The host fills the slot again while the kernel runs
+	if (host_memory == HOST_MEMORY_SHARED)
+		mapBatch(slot);
+	cl_kernel kernel = tile > 0 ? k_cbow_tile : k_cbow;
+	cl_int ret  = clSetKernelArg(kernel, 0, sizeof(sentence_num), &sentence_num); openclCheck(ret);
+	ret  = clSetKernelArg(kernel, 1, sizeof(alpha), &alpha); openclCheck(ret);
+	metricsFirstKernel();
+	numBlock = tile > 0 ? (ntokens + tile - 1) / tile : ntokens;
+	size_t global_workgroup = (size_t) numBlock * geometry.threads_per_word;
+	size_t local_workgroup = geometry.threads_per_word;
+
+	ret =  clEnqueueNDRangeKernel(command_queue, kernel, 1, NULL,&global_workgroup, &local_workgroup, 0, NULL, &slot.kernel);
+	openclCheck(ret);
+	if (profiling) {
+		clRetainEvent(slot.kernel);
+		profilerDeviceEvent(id, "cbow kernel", slot.kernel, 0);
+	}
+	openclCheck(clFlush(command_queue));
+	metricsAddBatch(id);
 }
 
 void GPUTrainer::updateSyn0(float * g_syn0){
+	cl_event ev = NULL;
+	size_t bytes = (size_t) vocab_size * layer1_size_aligned * sizeof(real);
+	unmapModel();
 	cl_int ret = clEnqueueWriteBuffer(command_queue, d_syn0, CL_TRUE, 0,
-			 vocab_size * layer1_size_aligned * sizeof(real) , g_syn0, 0, NULL, NULL);openclCheck(ret)
+			 bytes , g_syn0, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+	profilerDeviceEvent(id, "upload syn0", ev, bytes);
+	metricsAddSyncBytes(id, bytes);
 	openclCheck(clFinish(command_queue));
 }
 
 void GPUTrainer::updateSyn1Neg(float * g_syn1neg){
+	cl_event ev = NULL;
+	size_t bytes = (size_t) vocab_size * layer1_size_aligned * sizeof(real);
+	unmapModel();
 	cl_int ret = clEnqueueWriteBuffer(command_queue, d_syn1neg, CL_TRUE, 0,
-			 vocab_size * layer1_size_aligned * sizeof(real) , g_syn1neg, 0, NULL, NULL);openclCheck(ret)
+			 bytes , g_syn1neg, 0, NULL, PROFILE_EVENT(ev));openclCheck(ret)
+	profilerDeviceEvent(id, "upload syn1neg", ev, bytes);
+	metricsAddSyncBytes(id, bytes);
 	openclCheck(clFinish(command_queue));
+	profilerResolve(id);
 }
 
@@ -11,17 +11,79 @@
 #define MAX_STRING 100
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
-#define MAX_SENTENCE_LENGTH 102400
 #define MAX_CODE_LENGTH 40
-#define MAX_SENTENCE_NUM 6
 #define ALIGNMENT_FACTOR 32
-#define THREADS_PER_WORD 128
-#define BLOCK_SIZE 128
-#define MAX_GPU_SUPPORT 8
+// Work group size of the subsampling scan
+#define SCAN_BLOCK 256
+// Defaults of the batch geometry, see BatchGeometry
+#define DEFAULT_SENTENCE_LENGTH 102400
+#define DEFAULT_SENTENCE_NUM 6
+#define DEFAULT_THREADS_PER_WORD 128
 typedef float real;
 
+// Batch shape and work group size of one device, chosen at runtime.
+// A batch is packed CSR style: up to batchTokens() raw word ids, then the
+// start offset of every sentence followed by the end of the last one.
+// Sentences longer than sentence_length are split. A cbow work group trains
+// one word, so threads_per_word is also the work group size; the kernels get
+// it as the THREADS_PER_WORD / BLOCK_SIZE build options.
+struct BatchGeometry {
+	int sentence_num;
+	int sentence_length;
+	int threads_per_word;
+	int batchTokens() const { return sentence_num * sentence_length; }
+};
+
+extern BatchGeometry default_geometry;
+
+// Where the host side arrays of a device live. Devices sharing memory with
+// the host (CPU runtimes, integrated GPUs) map their buffers and work in
+// place, discrete ones stage transfers through pinned memory.
+#define HOST_MEMORY_COPY 0
+#define HOST_MEMORY_PINNED 1
+#define HOST_MEMORY_SHARED 2
+
+// 0 keeps plain host copies, 1 picks pinned or shared memory per device
+extern int zero_copy;
+
+#define MAX_QUEUE_DEPTH 8
+// Batches in flight per device, see BatchSlot
+extern int queue_depth;
+
+#define MAX_TOKENIZER_THREADS 16
+#define AUTO_TOKENIZER_THREADS 4
+// Threads tokenizing the corpus for each device, 0 picks by CPU count
+extern int tokenizer_threads;
+// Every tokenizer fills a slot of its own while queue_depth batches are in
+// flight: queue_depth + tokenizer_threads - 1 slots
+#define MAX_BATCH_SLOTS (MAX_QUEUE_DEPTH + MAX_TOKENIZER_THREADS - 1)
+
+// Devices to train on: their type (gpu, cpu, accelerator or all), the
+// numbers initializeGPU() lists them by, comma separated or "" for all, and
+// the number of equal sub-devices each one is partitioned into, a trainer
+// each. Sub-devices of one CPU stand in for several GPUs in tests.
+extern char device_type[MAX_STRING];
+extern char device_list[MAX_STRING];
+extern int sub_devices;
+
+// Synchronous averaging moves 0: the whole model, 1: the change since the
+// last sync as 8-bit rows, 2: the same with error feedback, what rounding
+// left out is sent with the next change
+extern int sync_quantize;
+
+// Positions a work group of the cbow kernel trains, reading the syn0 rows
+// of their windows once (device_cbow_tile). 0 trains one position per work
+// group. Devices cut it to what fits their local memory.
+extern int cbow_tile;
+
 #define NUM_ITERATION_DO_SYNC_SYN0 5
 
+// Rows of both matrices read back per step of the averaging, see
+// GPUTrainer::requestRows()
+#define READBACK_ROWS 1024
+// Threads averaging at the same time, one per NUMA node
+#define MAX_READBACK_LANES 64
+
 #ifdef __APPLE__
 #include <OpenCL/opencl.h>
 #else
@@ -38,6 +100,7 @@ public:
 		size = 0;
 	}
 	void setSize(unsigned int num){
+		delete[] bits;
 		size = (num + 31) / 32;
 		bits = new unsigned int[size];
 		for (unsigned int i = 0; i < size; i++)
@@ -47,11 +110,12 @@ public:
 	{
 		delete[] bits;
 	}
+	// Atomic, the tokenizer threads of a device share the bitmap
 	void setBit(unsigned int index){
 		unsigned int i = index / 32;
 		unsigned int flag = 1;
 		flag = flag << (31 - index % 32);
-		bits[i] = bits[i] | flag;
+		__sync_fetch_and_or(&bits[i], flag);
 	}
 	unsigned int getBit(unsigned int index){
 		unsigned int i = index / 32;
@@ -64,57 +128,192 @@ public:
 	}
 };
 
+// Input of one batch in flight. Uploads go through a transfer queue of
+// their own, so the next batches cross the bus while the compute queue
+// trains the current one. ready completes once the host may fill sen and
+// sen_offsets again (upload done, or mapped back with shared memory),
+// kernel is the cbow kernel of the batch that used the slot last.
+struct BatchSlot {
+	cl_mem d_sen;
+	cl_mem d_sen_offsets;
+	// Pinned staging buffer behind sen
+	cl_mem h_batch;
+	int * sen;
+	int * sen_offsets;
+	cl_event ready;
+	cl_event kernel;
+};
+
+// Staging of one averaging thread, two halves of READBACK_ROWS rows of
+// syn0 and syn1neg so the next rows cross the bus while the host averages
+// the current ones
+struct ReadbackLane {
+	cl_mem h_rows;
+	real * rows;
+	cl_event done[2];
+	long long first[2];
+	// Half the next request fills, half the next wait returns
+	int next, head;
+};
+
+// Rows [first, last) of syn0 and syn1neg returned by waitRows(): values,
+// or with sync_quantize the change since the last sync as layer1_size
+// bytes per row times a scale per row
+struct ReadbackRows {
+	real * values[2];
+	signed char * q[2];
+	float * scale[2];
+};
+
+// Bytes a trainer holds, for the memory report at startup
+struct TrainerMemory {
+	size_t host_batches, host_model, host_readback;
+	size_t device_model, device_tables, device_batches;
+};
+
 class GPUTrainer
 {
 	cl_context context;
 	cl_command_queue command_queue;
+	cl_command_queue transfer_queue;
 	cl_program program;
 	cl_device_id device_id;
+	// Set when device_id is a sub-device this trainer created and releases
+	int sub_device;
 	cl_kernel k_memset;
+	cl_kernel k_add;
 	cl_kernel k_cbow;
-	unsigned int wavefront_size;
+	cl_kernel k_cbow_tile;
+	cl_kernel k_subsample_count;
+	cl_kernel k_subsample_scan;
+	cl_kernel k_subsample_compact;
+	cl_kernel k_subsample_offsets;
+	cl_kernel k_quantize_delta;
+	cl_kernel k_apply_delta;
+	size_t wavefront_size;
+	// The reductions of device_cbow / device_cbow64 leave out the barriers
+	// within a wavefront of 32 / 64 threads running in lockstep. CPU
+	// devices and other wavefronts train with device_cbow_tile only.
+	int lockstep;
+	size_t max_work_group;
+	cl_ulong local_mem_size;
 	cl_platform_id platform_id;
+	int id;
+	char device_name[MAX_STRING];
+	// NUMA node of the device, -1 when the host buffers are not placed
+	int numa_node;
+	BatchGeometry geometry;
 
 	//
 	cl_mem d_syn0;
 	cl_mem d_syn1neg;
-	cl_mem d_sen;
+	cl_mem d_words;
+	cl_mem d_offsets;
+	cl_mem d_position;
+	cl_mem d_count;
+	cl_mem d_block_sum;
+	cl_mem d_keep;
 	cl_mem d_random;
 	cl_mem d_table;
 	cl_mem d_expTable;
+	cl_mem d_delta;
+	// sync_quantize: the model as of the last sync, the rounding error of
+	// each matrix with error feedback, and the quantized change
+	cl_mem d_ref[2];
+	cl_mem d_error[2];
+	cl_mem d_q[2];
+	cl_mem d_scale[2];
+	unsigned int * h_random;
+	unsigned int subsample_seed;
 
 	int numBlock;
 	int shared_mem_usage;
+	// Positions per work group of k_cbow_tile, 0 when k_cbow trains
+	int tile;
+	int tile_shared_mem_usage;
 
-	int * sen;
+	BatchSlot slots[MAX_BATCH_SLOTS];
+	int slot_count;
 	float * syn0;
 	float * syn1neg;
+	int host_memory;
+	ReadbackLane lanes[MAX_READBACK_LANES];
+	// Pinned staging buffers behind syn0 and syn1neg, mapped for their
+	// whole life. Only async averaging keeps such a host copy of the model.
+	cl_mem h_syn0;
+	cl_mem h_syn1neg;
+	// Shared memory: whether syn0 / syn1neg currently map the device model
+	int model_mapped;
 	int ComputeUnits;
-	float startOffset;
-	float endOffset;
+	// Fractions of the tokens of the corpus the device trains on
+	double startOffset;
+	double endOffset;
 	void setCbowArgs();
-	void transferDataToGPU();
+	void allocBatchBuffers();
+	void releaseBatchBuffers();
+	void transferDataToGPU(BatchSlot & slot, int ntokens, int sentence_num);
+	void subsampleOnGPU(BatchSlot & slot, int ntokens, int sentence_num);
+	void waitKernel(BatchSlot & slot);
+	int sharedModel();
+	void * allocHost(cl_mem * staging, size_t bytes);
+	void freeHost(cl_mem * staging, void * ptr);
+	void mapBatch(BatchSlot & slot);
+	void unmapBatch(BatchSlot & slot);
+	void unmapModel();
 
 public:
 	MyBitMap bitmap;
 	int getComputeUnit() {  return ComputeUnits;}
-	int * getSentencePtr() { return sen;}
-	GPUTrainer(cl_device_id device);
-	void initialWithSource(const char * src, size_t size);
+	// Slots of batches a device takes, filled by one thread at a time. Call
+	// beginBatch() before filling the sentence and offsets arrays.
+	int getSlotCount() { return slot_count;}
+	void beginBatch(int slot);
+	int * getSentencePtr(int slot) { return slots[slot].sen;}
+	int * getOffsetsPtr(int slot) { return slots[slot].sen_offsets;}
+	int getHostMemory() { return host_memory;}
+	const BatchGeometry & getGeometry() { return geometry;}
+	void setGeometry(const BatchGeometry & g) { geometry = g;}
+	const char * getDeviceName() { return device_name;}
+	void markSubDevice();
+	int getNumaNode() { return numa_node;}
+	GPUTrainer(cl_device_id device, int id);
+	void buildProgram(const char * src, size_t size);
+	int supportsGeometry(const BatchGeometry & g);
+	int applyGeometry(const BatchGeometry & g);
+	void finishQueue();
+	void startUpload(const real * h_expTable);
+	void finishUpload();
 	void cleanUpGPU();
-	void trainGPU(int sentence_num);
+	void releaseDevice();
+	void trainGPU(int slot, int ntokens, int sentence_num, real alpha);
 	void getResultData();
+	// Reads rows [first, last) of the model into the staging of the lane
+	// without waiting, at most READBACK_ROWS of them and two requests of a
+	// lane in flight. waitRows() returns them in request order, in place
+	// when the model is on the host.
+	void requestRows(int lane, long long first, long long last);
+	void waitRows(int lane, ReadbackRows * rows);
+	// sync_quantize: the devices start from the same model, remembered as
+	// the reference. quantizeDelta() turns their change since into the
+	// rows requestRows() reads, applyDelta() adds the averaged change.
+	void resetReference();
+	void quantizeDelta();
+	void applyDelta(signed char * const * q, float * const * scale);
+	void memoryUsage(int lanes, TrainerMemory * m);
+	void mergeDelta();
 	void updateSyn0(float * g_syn0);
 	float * getSyn0() { return syn0;}
 	void updateSyn1Neg(float * g_syn1neg);
 	float * getSyn1Neg() { return syn1neg;}
-	void setWorkingRange(float start, float end) { startOffset = start; endOffset = end;}
-	float getStart() { return startOffset;}
-	float getEnd() { return endOffset;}
+	void setWorkingRange(double start, double end) { startOffset = start; endOffset = end;}
+	double getStart() { return startOffset;}
+	double getEnd() { return endOffset;}
 };
 
 
 void initializeGPU();
+void uploadGPUData();
+void releaseGPU();
 
 
 #endif /* CBOW_H_ */
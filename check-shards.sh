@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# check-shards.sh
+#
+#  Builds a sparse file of more than 4GB with text written at scattered
+#  offsets past 2^31 and 2^32, and checks with -check-shards that every part
+#  reads the same tokens as the whole file. Each zero byte is an empty token,
+#  so the file also holds more than 2^32 tokens. Lines straddle the 1MB read
+#  blocks: a token cut by the block edge, an end of line as the last byte of
+#  a block and as the first byte of the next one, and an overlong token.
+#  The zeros take minutes to tokenize, build with -O2 first (see makefile).
+#
+#  usage: check-shards.sh [word2vec binary] [parts]
+
+BIN=${1:-./word2vec}
+PARTS=${2:-7}
+FILE=${TMPDIR:-/tmp}/w2v-check-shards.txt
+MB=1048576
+G2=2147483648
+G4=4294967296
+SIZE=4600000000
+
+# put <offset> <text>: writes text at the offset without extending the file
+put() {
+	printf "$2" | dd of="$FILE" bs=1 seek="$1" conv=notrunc status=none || exit 1
+}
+
+rm -f "$FILE"
+truncate -s $SIZE "$FILE" || exit 1
+trap 'rm -f "$FILE"' EXIT
+
+# A line across 2^31, which is also a block edge
+put $((G2 - 9)) "across 2G line\n"
+# The end of line is the last byte of a block
+put $((G2 + MB - 5)) "edge\n"
+# The end of line is the first byte of the next block
+put $((G2 + 3 * MB - 4)) "word\nnext line\n"
+# Windows line ending across 2^32
+put $((G4 - 7)) "past 4G\r\nline\r\n"
+put $((G4 + 12345)) "the quick brown fox jumps over the lazy dog\n"
+# A token of 3000 bytes across a block edge, longer than MAX_STRING
+put $((G4 + 5 * MB - 1500)) "before $(head -c 3000 /dev/zero | tr '\0' x) after\n"
+# Tokens across the edges of the blocks around 4.2GB and 4.4GB
+for block in 4000 4200; do
+	put $((block * MB - 20)) "one two three four five six seven\n"
+done
+# No end of line at the end of the file
+put $((SIZE - 10)) "last words"
+
+OUT=$("$BIN" -train "$FILE" -check-shards $PARTS) || { echo "$OUT"; exit 1; }
+echo "$OUT"
+# "Indexed <tokens> tokens in <bytes> bytes of ...": both past 32 bits
+echo "$OUT" | awk -v g4=$G4 '/^Indexed/ { seen = 1; if ($2 + 0 <= g4 || $5 + 0 <= g4) bad = 1 }
+	END { if (!seen || bad) { print "Tokens and offsets do not pass 2^32"; exit 1 } }' || exit 1
+echo "$OUT" | grep -q "^Shards agree" || exit 1
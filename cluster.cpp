@@ -0,0 +1,370 @@
+#include "cluster.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <vector>
+#include <string>
+
+extern int vocab_size, layer1_size_aligned;
+extern int debug_mode;
+
+char cluster_file[MAX_STRING];
+int cluster_rank = 0;
+int cluster_size = 1;
+
+// Seconds a rank keeps retrying to reach its successor
+#define CLUSTER_CONNECT_TIMEOUT 120
+
+static int next_fd = -1, prev_fd = -1;
+static unsigned long long wait_ns = 0, bytes_sent = 0;
+
+static void sendAll(int fd, const void * data, size_t size) {
+	const char * p = (const char *) data;
+	while (size > 0) {
+		ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			perror("cluster send");
+			exit(1);
+		}
+		p += n;
+		size -= n;
+	}
+}
+
+static void recvAll(int fd, void * data, size_t size) {
+	char * p = (char *) data;
+	while (size > 0) {
+		ssize_t n = recv(fd, p, size, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0) {
+			if (n == 0)
+				printf("cluster: peer closed the connection\n");
+			else
+				perror("cluster recv");
+			exit(1);
+		}
+		p += n;
+		size -= n;
+	}
+}
+
+static int listenOn(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM, 0);
+	int one = 1;
+	setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(fd, 1) < 0) {
+		perror("cluster listen");
+		exit(1);
+	}
+	return fd;
+}
+
+// The successor may not be listening yet, so keep trying for a while
+static int connectTo(const char * host, int port) {
+	char service[16];
+	snprintf(service, sizeof(service), "%d", port);
+	struct addrinfo hints, * res;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(host, service, &hints, &res) != 0) {
+		printf("cluster: cannot resolve %s\n", host);
+		exit(1);
+	}
+	for (int tries = 0; tries < CLUSTER_CONNECT_TIMEOUT * 10; tries++) {
+		int fd = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+		if (connect(fd, res->ai_addr, res->ai_addrlen) == 0) {
+			freeaddrinfo(res);
+			return fd;
+		}
+		close(fd);
+		usleep(100000);
+	}
+	printf("cluster: cannot connect to %s:%d\n", host, port);
+	exit(1);
+}
+
+void clusterInit() {
+	if (cluster_file[0] == 0)
+		return;
+	FILE * fi = fopen(cluster_file, "rb");
+	if (fi == NULL) {
+		printf("Cannot open cluster file %s\n", cluster_file);
+		exit(1);
+	}
+	std::vector<std::string> hosts;
+	std::vector<int> ports;
+	char line[MAX_STRING * 2], host[MAX_STRING * 2];
+	int port;
+	while (fgets(line, sizeof(line), fi))
+		if (sscanf(line, "%s %d", host, &port) == 2) {
+			hosts.push_back(host);
+			ports.push_back(port);
+		}
+	fclose(fi);
+	cluster_size = hosts.size();
+	if (cluster_rank < 0 || cluster_rank >= cluster_size) {
+		printf("Rank %d is not in %s (%d ranks)\n", cluster_rank, cluster_file, cluster_size);
+		exit(1);
+	}
+	if (cluster_size == 1)
+		return;
+
+	// Everybody listens before connecting, so the connects cannot deadlock
+	int next = (cluster_rank + 1) % cluster_size;
+	int prev = (cluster_rank + cluster_size - 1) % cluster_size;
+	int listen_fd = listenOn(ports[cluster_rank]);
+	next_fd = connectTo(hosts[next].c_str(), ports[next]);
+	prev_fd = accept(listen_fd, NULL, NULL);
+	if (prev_fd < 0) {
+		perror("cluster accept");
+		exit(1);
+	}
+	close(listen_fd);
+
+	// Neighbours must have the same rank layout and model shape, around the
+	// ring this checks all processes
+	int mine[4] = { cluster_rank, cluster_size, vocab_size, layer1_size_aligned };
+	int theirs[4];
+	sendAll(next_fd, mine, sizeof(mine));
+	recvAll(prev_fd, theirs, sizeof(theirs));
+	if (theirs[0] != prev || theirs[1] != cluster_size || theirs[2] != vocab_size
+			|| theirs[3] != layer1_size_aligned) {
+		printf("cluster: rank %d disagrees (rank %d of %d, vocab %d, size %d)\n", prev,
+				theirs[0], theirs[1], theirs[2], theirs[3]);
+		exit(1);
+	}
+	if (debug_mode > 0)
+		printf("Cluster rank %d of %d connected\n", cluster_rank, cluster_size);
+}
+
+double clusterShardStart() {
+	return cluster_rank / (double) cluster_size;
+}
+
+double clusterShardEnd() {
+	return (cluster_rank + 1) / (double) cluster_size;
+}
+
+void clusterClose() {
+	if (next_fd >= 0)
+		close(next_fd);
+	if (prev_fd >= 0)
+		close(prev_fd);
+	next_fd = prev_fd = -1;
+}
+
+// State of one allreduce. Segment s holds rows [rows * s / N, rows * (s + 1) / N).
+// Steps 0 .. N-2 reduce-scatter, steps N-1 .. 2N-3 allgather; at every step
+// the segment sent is the one received at the previous step.
+static struct {
+	real ** arrays;
+	int narrays;
+	int rows;
+	int row_len;
+	long long produced;
+	std::vector<int> step_done;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t sender, receiver;
+	unsigned long long begin_ns;
+} ex = { NULL, 0, 0, 0, 0, std::vector<int>(), PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+static int mod(int a) {
+	return ((a % cluster_size) + cluster_size) % cluster_size;
+}
+
+static int segFirst(int s) {
+	return (int) ((long long) ex.rows * s / cluster_size);
+}
+
+static int sendSegment(int step) {
+	return step < cluster_size - 1 ? mod(cluster_rank - step) : mod(cluster_rank + 1 - (step - cluster_size + 1));
+}
+
+static int recvSegment(int step) {
+	return sendSegment(step + 1);
+}
+
+static int segLast(int s) {
+	return segFirst(s + 1);
+}
+
+// Local rows of segment s up to row last are averaged once this many rows
+// were produced; segments are produced starting with the own one
+static long long producedNeeded(int s, int last) {
+	long long needed = 0;
+	for (int k = 0; mod(cluster_rank - k) != s; k++)
+		needed += segLast(mod(cluster_rank - k)) - segFirst(mod(cluster_rank - k));
+	return needed + last - segFirst(s);
+}
+
+static void waitProduced(long long needed) {
+	pthread_mutex_lock(&ex.mutex);
+	while (ex.produced < needed)
+		pthread_cond_wait(&ex.cond, &ex.mutex);
+	pthread_mutex_unlock(&ex.mutex);
+}
+
+static void *SenderThread(void *) {
+	int steps = 2 * (cluster_size - 1);
+	for (int step = 0; step < steps; step++) {
+		int s = sendSegment(step);
+		int chunk = 0;
+		for (int first = segFirst(s); first < segLast(s); first += CLUSTER_CHUNK_ROWS, chunk++) {
+			int last = first + CLUSTER_CHUNK_ROWS < segLast(s) ? first + CLUSTER_CHUNK_ROWS : segLast(s);
+			if (step == 0)
+				waitProduced(producedNeeded(s, last));
+			else {
+				pthread_mutex_lock(&ex.mutex);
+				while (ex.step_done[step - 1] <= chunk)
+					pthread_cond_wait(&ex.cond, &ex.mutex);
+				pthread_mutex_unlock(&ex.mutex);
+			}
+			for (int i = 0; i < ex.narrays; i++) {
+				size_t size = (size_t) (last - first) * ex.row_len * sizeof(real);
+				sendAll(next_fd, ex.arrays[i] + (size_t) first * ex.row_len, size);
+				bytes_sent += size;
+			}
+		}
+	}
+	return NULL;
+}
+
+static void *ReceiverThread(void *) {
+	int steps = 2 * (cluster_size - 1);
+	std::vector<real> tmp((size_t) CLUSTER_CHUNK_ROWS * ex.row_len);
+	for (int step = 0; step < steps; step++) {
+		int s = recvSegment(step);
+		int reduce = step < cluster_size - 1;
+		for (int first = segFirst(s); first < segLast(s); first += CLUSTER_CHUNK_ROWS) {
+			int last = first + CLUSTER_CHUNK_ROWS < segLast(s) ? first + CLUSTER_CHUNK_ROWS : segLast(s);
+			size_t count = (size_t) (last - first) * ex.row_len;
+			// Rows of a segment are overwritten or summed only once produced locally
+			waitProduced(producedNeeded(s, last));
+			for (int i = 0; i < ex.narrays; i++) {
+				real * dst = ex.arrays[i] + (size_t) first * ex.row_len;
+				if (!reduce) {
+					recvAll(prev_fd, dst, count * sizeof(real));
+					continue;
+				}
+				recvAll(prev_fd, &tmp[0], count * sizeof(real));
+				if (step == cluster_size - 2)
+					for (size_t j = 0; j < count; j++)
+						dst[j] = (dst[j] + tmp[j]) / cluster_size;
+				else
+					for (size_t j = 0; j < count; j++)
+						dst[j] += tmp[j];
+			}
+			pthread_mutex_lock(&ex.mutex);
+			ex.step_done[step]++;
+			pthread_cond_broadcast(&ex.cond);
+			pthread_mutex_unlock(&ex.mutex);
+		}
+	}
+	return NULL;
+}
+
+void clusterAverageBegin(real ** arrays, int narrays, int rows, int row_len) {
+	if (cluster_size == 1)
+		return;
+	ex.arrays = arrays;
+	ex.narrays = narrays;
+	ex.rows = rows;
+	ex.row_len = row_len;
+	ex.produced = 0;
+	ex.step_done.assign(2 * (cluster_size - 1), 0);
+	ex.begin_ns = monotonicNs();
+	pthread_create(&ex.sender, NULL, SenderThread, NULL);
+	pthread_create(&ex.receiver, NULL, ReceiverThread, NULL);
+}
+
+int clusterSegmentCount() {
+	return cluster_size;
+}
+
+// k-th segment to produce: the own segment first, then the ones the ring
+// forwards next
+void clusterSegmentRows(int k, int * first, int * last) {
+	if (cluster_size == 1) {
+		*first = 0;
+		*last = vocab_size;
+		return;
+	}
+	int s = mod(cluster_rank - k);
+	*first = segFirst(s);
+	*last = segLast(s);
+}
+
+void clusterRowsReady(long long rows) {
+	if (cluster_size == 1)
+		return;
+	pthread_mutex_lock(&ex.mutex);
+	ex.produced = rows;
+	pthread_cond_broadcast(&ex.cond);
+	pthread_mutex_unlock(&ex.mutex);
+}
+
+// Waits for the rest of the exchange, only this part stalls training
+void clusterAverageEnd() {
+	if (cluster_size == 1)
+		return;
+	unsigned long long start = monotonicNs();
+	pthread_join(ex.sender, NULL);
+	pthread_join(ex.receiver, NULL);
+	unsigned long long end = monotonicNs();
+	wait_ns += end - start;
+	profilerHostSpan(HOST_TRACK, "cluster exchange", ex.begin_ns, end);
+}
+
+// Sums v over all ranks: one pass around the ring accumulates, a second
+// one hands the total to everybody
+static void sumOverRanks(double * v, int n) {
+	std::vector<double> in(n);
+	if (cluster_rank == 0) {
+		sendAll(next_fd, v, n * sizeof(double));
+		recvAll(prev_fd, v, n * sizeof(double));
+		sendAll(next_fd, v, n * sizeof(double));
+		return;
+	}
+	recvAll(prev_fd, &in[0], n * sizeof(double));
+	for (int i = 0; i < n; i++)
+		in[i] += v[i];
+	sendAll(next_fd, &in[0], n * sizeof(double));
+	recvAll(prev_fd, v, n * sizeof(double));
+	if (cluster_rank != cluster_size - 1)
+		sendAll(next_fd, v, n * sizeof(double));
+}
+
+// Scaling efficiency: the aggregate rate over the rate every process
+// would reach if the exchange did not stall it
+void clusterReport(unsigned long long words, double elapsed) {
+	if (cluster_size == 1)
+		return;
+	double wait = wait_ns / 1e9;
+	double v[4] = { words / elapsed, words / (elapsed > wait ? elapsed - wait : elapsed), wait,
+			bytes_sent / elapsed };
+	sumOverRanks(v, 4);
+	if (cluster_rank != 0)
+		return;
+	printf("Cluster of %d processes: %.2fk words/sec, %.2fk per process, %.2fs exchange stall per process,"
+			" %.2f MB/s sent per process, scaling efficiency %.1f%%\n", cluster_size, v[0] / 1000,
+			v[0] / cluster_size / 1000, v[2] / cluster_size, v[3] / cluster_size / 1e6, v[0] / v[1] * 100);
+	fflush(stdout);
+}
@@ -0,0 +1,40 @@
+/*
+ * cluster.h
+ *
+ *  Data parallel training across processes. Every process trains its own
+ *  shard of the corpus on its local devices, the models are averaged with
+ *  a ring allreduce over TCP. The ring is described by a file with one
+ *  "host port" line per rank, so it also runs over localhost.
+ */
+
+#ifndef CLUSTER_H_
+#define CLUSTER_H_
+
+#include "cbow.h"
+
+extern char cluster_file[MAX_STRING];
+extern int cluster_rank;
+extern int cluster_size;
+
+// Rows sent per message of the allreduce
+#define CLUSTER_CHUNK_ROWS 1024
+
+// Connects the ring, the vocabulary must be known to check the peers agree
+void clusterInit();
+double clusterShardStart();
+double clusterShardEnd();
+
+// Averages the rows of all arrays over the processes. The caller produces
+// the local rows segment by segment, in the order given by
+// clusterSegmentRows(), and reports progress with clusterRowsReady() so the
+// exchange of finished rows overlaps with the rest of the local work.
+void clusterAverageBegin(real ** arrays, int narrays, int rows, int row_len);
+int clusterSegmentCount();
+void clusterSegmentRows(int k, int * first, int * last);
+void clusterRowsReady(long long rows);
+void clusterAverageEnd();
+
+void clusterReport(unsigned long long words, double elapsed);
+void clusterClose();
+
+#endif /* CLUSTER_H_ */
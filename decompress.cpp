@@ -0,0 +1,204 @@
+#include "decompress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+// Input handed to zlib at once, its counters are 32 bit
+#define INFLATE_CHUNK (1 << 30)
+
+struct Decompressor {
+	int format;
+	const unsigned char * map;
+	size_t map_size;
+	// Decoding runs from the member / frame at start to the one at end
+	size_t start, end, pos;
+	int done;
+	z_stream zs;
+#ifdef HAVE_ZSTD
+	ZSTD_DStream * ds;
+	ZSTD_inBuffer in;
+#endif
+};
+
+static int endsWith(const char * s, const char * suffix) {
+	size_t n = strlen(s), m = strlen(suffix);
+	return n >= m && !strcmp(s + n - m, suffix);
+}
+
+int inputFormat(const char * path) {
+	if (endsWith(path, ".gz"))
+		return FORMAT_GZIP;
+	if (endsWith(path, ".zst")) {
+#ifndef HAVE_ZSTD
+		printf("%s: built without zstd support (make ZSTD=1)\n", path);
+		exit(1);
+#endif
+		return FORMAT_ZSTD;
+	}
+	return FORMAT_PLAIN;
+}
+
+// A gzip member header at pos that really starts a deflate stream
+static int isGzipMember(const unsigned char * p, size_t avail) {
+	if (avail < 18 || p[0] != 0x1f || p[1] != 0x8b || p[2] != 8 || (p[3] & 0xe0))
+		return 0;
+	unsigned char out[1 << 14];
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	if (inflateInit2(&zs, 16 + MAX_WBITS) != Z_OK)
+		return 0;
+	zs.next_in = (Bytef *) p;
+	zs.avail_in = avail < (1 << 16) ? avail : (1 << 16);
+	zs.next_out = out;
+	zs.avail_out = sizeof(out);
+	int ret = inflate(&zs, Z_NO_FLUSH);
+	inflateEnd(&zs);
+	return ret == Z_OK || ret == Z_STREAM_END || ret == Z_BUF_ERROR;
+}
+
+// First member / frame at or after target, map_size if there is none
+static size_t findStart(const Decompressor * d, size_t target) {
+	if (target == 0)
+		return 0;
+	if (d->format == FORMAT_GZIP) {
+		for (size_t pos = target; pos + 18 <= d->map_size; pos++) {
+			const void * hit = memchr(d->map + pos, 0x1f, d->map_size - pos);
+			if (hit == NULL)
+				break;
+			pos = (const unsigned char *) hit - d->map;
+			if (isGzipMember(d->map + pos, d->map_size - pos))
+				return pos;
+		}
+		return d->map_size;
+	}
+#ifdef HAVE_ZSTD
+	// Frame sizes come from the frame and block headers, nothing is decoded
+	size_t pos = 0;
+	while (pos < target && pos < d->map_size) {
+		size_t n = ZSTD_findFrameCompressedSize(d->map + pos, d->map_size - pos);
+		if (ZSTD_isError(n))
+			return d->map_size;
+		pos += n;
+	}
+	return pos;
+#else
+	return d->map_size;
+#endif
+}
+
+// Concatenated members are decoded one after the other
+static ssize_t inflateInput(Decompressor * d, char * dst, size_t size) {
+	d->zs.next_out = (Bytef *) dst;
+	d->zs.avail_out = size;
+	while (d->zs.avail_out == size && !d->done) {
+		if (d->zs.avail_in == 0 && d->pos < d->end) {
+			d->zs.next_in = (Bytef *) d->map + d->pos;
+			d->zs.avail_in = d->end - d->pos < INFLATE_CHUNK ? d->end - d->pos : INFLATE_CHUNK;
+			d->pos += d->zs.avail_in;
+		}
+		int ret = inflate(&d->zs, Z_NO_FLUSH);
+		if (ret == Z_STREAM_END) {
+			if (d->zs.avail_in == 0 && d->pos >= d->end)
+				d->done = 1;
+			else
+				inflateReset(&d->zs);
+		} else if (ret == Z_BUF_ERROR && d->zs.avail_in == 0 && d->pos >= d->end) {
+			printf("Warning: compressed input is truncated\n");
+			d->done = 1;
+		} else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+			printf("Warning: stopped decompressing at a corrupt gzip member (%s)\n", d->zs.msg ? d->zs.msg : "");
+			d->done = 1;
+		}
+	}
+	return size - d->zs.avail_out;
+}
+
+#ifdef HAVE_ZSTD
+static ssize_t decompressZstd(Decompressor * d, char * dst, size_t size) {
+	ZSTD_outBuffer out = { dst, size, 0 };
+	while (out.pos == 0 && !d->done) {
+		size_t ret = ZSTD_decompressStream(d->ds, &out, &d->in);
+		if (ZSTD_isError(ret)) {
+			printf("Warning: stopped decompressing at a corrupt zstd frame (%s)\n", ZSTD_getErrorName(ret));
+			d->done = 1;
+		} else if (d->in.pos == d->in.size && out.pos < out.size) {
+			// All input consumed and nothing is left in the decoder
+			if (ret != 0)
+				printf("Warning: compressed input is truncated\n");
+			d->done = 1;
+		}
+	}
+	return out.pos;
+}
+#endif
+
+Decompressor * decompressorOpen(int fd, int format, double offset, double end) {
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror("fstat");
+		exit(1);
+	}
+	Decompressor * d = new Decompressor;
+	d->format = format;
+	d->map_size = st.st_size;
+	d->map = NULL;
+	if (d->map_size > 0) {
+		d->map = (const unsigned char *) mmap(NULL, d->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (d->map == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+	}
+	d->start = findStart(d, (size_t) (d->map_size * offset));
+	// The next range starts at the same member / frame, with a single one the
+	// first range reads the whole input
+	d->end = end >= 1 ? d->map_size : findStart(d, (size_t) (d->map_size * end));
+	if (offset > 0 && d->start == d->map_size)
+		printf("Warning: no independent compressed frame after %.0f%% of the input, an earlier range reads"
+				" this part; compress with several frames (bgzip, pzstd) to read it in parallel\n", offset * 100);
+	d->pos = d->start;
+	d->done = d->start >= d->end;
+	memset(&d->zs, 0, sizeof(d->zs));
+	if (format == FORMAT_GZIP)
+		inflateInit2(&d->zs, 16 + MAX_WBITS);
+#ifdef HAVE_ZSTD
+	d->ds = NULL;
+	if (format == FORMAT_ZSTD) {
+		d->ds = ZSTD_createDStream();
+		ZSTD_initDStream(d->ds);
+		d->in.src = d->map + d->start;
+		d->in.size = d->end > d->start ? d->end - d->start : 0;
+		d->in.pos = 0;
+	}
+#endif
+	return d;
+}
+
+ssize_t decompressorRead(Decompressor * d, char * dst, size_t size) {
+	if (d->done || size == 0)
+		return 0;
+#ifdef HAVE_ZSTD
+	if (d->format == FORMAT_ZSTD)
+		return decompressZstd(d, dst, size);
+#endif
+	return inflateInput(d, dst, size);
+}
+
+void decompressorClose(Decompressor * d) {
+	if (d->format == FORMAT_GZIP)
+		inflateEnd(&d->zs);
+#ifdef HAVE_ZSTD
+	if (d->ds)
+		ZSTD_freeDStream(d->ds);
+#endif
+	if (d->map)
+		munmap((void *) d->map, d->map_size);
+	delete d;
+}
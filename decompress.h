@@ -0,0 +1,29 @@
+/*
+ * decompress.h
+ *
+ *  Compressed training files (.gz, .zst) decoded as a stream, driven by the
+ *  read-ahead thread of a reader. A reader that starts in the middle of the
+ *  file begins at the next independent gzip member or zstd frame, so several
+ *  readers can start in parallel.
+ */
+
+#ifndef DECOMPRESS_H_
+#define DECOMPRESS_H_
+
+#include <sys/types.h>
+
+#define FORMAT_PLAIN 0
+#define FORMAT_GZIP 1
+#define FORMAT_ZSTD 2
+
+struct Decompressor;
+
+int inputFormat(const char * path);
+// Decompresses fd from the first member / frame at or after offset * file
+// size up to the first one at or after end * file size
+Decompressor * decompressorOpen(int fd, int format, double offset, double end);
+// Decodes up to size bytes, returns 0 once the input is exhausted
+ssize_t decompressorRead(Decompressor * d, char * dst, size_t size);
+void decompressorClose(Decompressor * d);
+
+#endif /* DECOMPRESS_H_ */
@@ -0,0 +1,392 @@
+#include "eval.h"
+#include "profiler.h"
+#include "simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <unordered_map>
+
+extern int debug_mode;
+
+char eval_analogy_file[MAX_STRING] = "";
+char eval_similarity_file[MAX_STRING] = "";
+char eval_model_file[MAX_STRING] = "";
+int eval_vocab = 30000;
+int eval_sync = 0;
+
+// Unit length copy of the model, rows padded with zeros to 8 floats
+struct EvalMatrix {
+	float * m;
+	long long rows;
+	int dim, stride;
+};
+
+struct Question {
+	int a, b, c, d;
+	int syntactic;
+};
+
+// Lookup of the words, kept while the vocabulary stays the same
+static std::unordered_map<std::string, int> word_index;
+static char ** indexed_words = NULL;
+static long long indexed_rows = 0;
+
+static int evalThreads() {
+	int n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n < 1 ? 1 : n;
+}
+
+static int allocMatrix(EvalMatrix * e, long long rows, int dim) {
+	e->rows = rows;
+	e->dim = dim;
+	e->stride = (dim + 7) / 8 * 8;
+	return posix_memalign((void **) &e->m, 32, rows * e->stride * sizeof(float)) == 0;
+}
+
+struct NormalizeJob {
+	EvalMatrix * e;
+	long long first, last;
+};
+
+static void *NormalizeThread(void * arg) {
+	NormalizeJob * job = (NormalizeJob *) arg;
+	EvalMatrix * e = job->e;
+	for (long long r = job->first; r < job->last; r++) {
+		float * row = e->m + r * e->stride;
+		double len = 0;
+		for (int i = 0; i < e->dim; i++)
+			len += row[i] * row[i];
+		len = sqrt(len);
+		for (int i = 0; i < e->stride; i++)
+			row[i] = i < e->dim && len > 0 ? row[i] / len : 0;
+	}
+	return NULL;
+}
+
+static void normalizeMatrix(EvalMatrix * e) {
+	int n = evalThreads();
+	std::vector<pthread_t> pt(n);
+	std::vector<NormalizeJob> jobs(n);
+	for (int t = 0; t < n; t++) {
+		jobs[t].e = e;
+		jobs[t].first = e->rows * t / n;
+		jobs[t].last = e->rows * (t + 1) / n;
+		pthread_create(&pt[t], NULL, NormalizeThread, &jobs[t]);
+	}
+	for (int t = 0; t < n; t++)
+		pthread_join(pt[t], NULL);
+}
+
+struct AnalogyJob {
+	const EvalMatrix * e;
+	const std::vector<Question> * questions;
+	long long candidates;
+	int next_block;
+	char * add_hit, * mul_hit;
+};
+
+// Every block of questions is answered with one pass over the candidates:
+// their dot products with the a, b and c rows of the block are one tile of
+// a matrix product, 3CosAdd and 3CosMul both follow from them.
+static void *AnalogyThread(void * arg) {
+	AnalogyJob * job = (AnalogyJob *) arg;
+	const EvalMatrix * e = job->e;
+	const std::vector<Question> & questions = *job->questions;
+	int nq = questions.size(), stride = e->stride;
+	float * q;
+	if (posix_memalign((void **) &q, 32, 3 * EVAL_QUERY_BLOCK * stride * sizeof(float)) != 0)
+		return NULL;
+	float sims[3 * EVAL_QUERY_BLOCK];
+	float best_add[EVAL_QUERY_BLOCK], best_mul[EVAL_QUERY_BLOCK];
+	int arg_add[EVAL_QUERY_BLOCK], arg_mul[EVAL_QUERY_BLOCK];
+	int block;
+	while ((block = __sync_fetch_and_add(&job->next_block, 1)) * EVAL_QUERY_BLOCK < nq) {
+		int first = block * EVAL_QUERY_BLOCK;
+		int n = nq - first < EVAL_QUERY_BLOCK ? nq - first : EVAL_QUERY_BLOCK;
+		memset(q, 0, 3 * EVAL_QUERY_BLOCK * stride * sizeof(float));
+		for (int j = 0; j < n; j++) {
+			const Question & x = questions[first + j];
+			memcpy(q + (3 * j) * stride, e->m + (long long) x.a * stride, stride * sizeof(float));
+			memcpy(q + (3 * j + 1) * stride, e->m + (long long) x.b * stride, stride * sizeof(float));
+			memcpy(q + (3 * j + 2) * stride, e->m + (long long) x.c * stride, stride * sizeof(float));
+			best_add[j] = best_mul[j] = -1e30;
+			arg_add[j] = arg_mul[j] = -1;
+		}
+		for (long long w = 0; w < job->candidates; w++) {
+			const float * row = e->m + w * stride;
+			for (int k = 0; k < 3 * n; k += 4)
+				simdDot4(row, q + k * stride, stride, stride, sims + k);
+			for (int j = 0; j < n; j++) {
+				const Question & x = questions[first + j];
+				if (w == x.a || w == x.b || w == x.c)
+					continue;
+				float ca = sims[3 * j], cb = sims[3 * j + 1], cc = sims[3 * j + 2];
+				float add = cb - ca + cc;
+				// Cosines shifted to [0, 1] as in Levy and Goldberg
+				float mul = (cb + 1) * (cc + 1) / 2 / ((ca + 1) / 2 + 0.001f);
+				if (add > best_add[j]) {
+					best_add[j] = add;
+					arg_add[j] = w;
+				}
+				if (mul > best_mul[j]) {
+					best_mul[j] = mul;
+					arg_mul[j] = w;
+				}
+			}
+		}
+		for (int j = 0; j < n; j++) {
+			job->add_hit[first + j] = arg_add[j] == questions[first + j].d;
+			job->mul_hit[first + j] = arg_mul[j] == questions[first + j].d;
+		}
+	}
+	free(q);
+	return NULL;
+}
+
+static void buildIndex(char ** words, long long rows) {
+	if (indexed_words == words && indexed_rows == rows)
+		return;
+	word_index.clear();
+	word_index.reserve(rows);
+	for (long long r = 0; r < rows; r++)
+		word_index.emplace(words[r], r);
+	indexed_words = words;
+	indexed_rows = rows;
+}
+
+// Row of the word, its lower case form is tried too, -1 if unknown
+static int lookup(const char * word, long long limit) {
+	std::unordered_map<std::string, int>::const_iterator it = word_index.find(word);
+	if (it == word_index.end() || it->second >= limit) {
+		std::string lower(word);
+		for (unsigned int i = 0; i < lower.size(); i++)
+			lower[i] = tolower(lower[i]);
+		it = word_index.find(lower);
+		if (it == word_index.end() || it->second >= limit)
+			return -1;
+	}
+	return it->second;
+}
+
+// Google analogy format: ": section" headers, then "a b c d" per line
+static void evalAnalogy(const EvalMatrix * e, char * result, size_t size) {
+	FILE * f = fopen(eval_analogy_file, "rb");
+	if (f == NULL) {
+		snprintf(result, size, "analogy file %s not found", eval_analogy_file);
+		return;
+	}
+	long long candidates = e->rows < eval_vocab ? e->rows : eval_vocab;
+	std::vector<Question> questions;
+	char line[MAX_STRING * 5], w[4][MAX_STRING];
+	int syntactic = 0, total = 0;
+	while (fgets(line, sizeof(line), f)) {
+		if (line[0] == ':') {
+			syntactic = strstr(line, "gram") != NULL;
+			continue;
+		}
+		if (sscanf(line, "%99s %99s %99s %99s", w[0], w[1], w[2], w[3]) != 4)
+			continue;
+		total++;
+		Question x;
+		x.a = lookup(w[0], candidates);
+		x.b = lookup(w[1], candidates);
+		x.c = lookup(w[2], candidates);
+		x.d = lookup(w[3], candidates);
+		x.syntactic = syntactic;
+		if (x.a >= 0 && x.b >= 0 && x.c >= 0 && x.d >= 0)
+			questions.push_back(x);
+	}
+	fclose(f);
+
+	int nq = questions.size();
+	std::vector<char> add_hit(nq + 1), mul_hit(nq + 1);
+	AnalogyJob job;
+	job.e = e;
+	job.questions = &questions;
+	job.candidates = candidates;
+	job.next_block = 0;
+	job.add_hit = &add_hit[0];
+	job.mul_hit = &mul_hit[0];
+	int n = evalThreads();
+	std::vector<pthread_t> pt(n);
+	for (int t = 0; t < n; t++)
+		pthread_create(&pt[t], NULL, AnalogyThread, &job);
+	for (int t = 0; t < n; t++)
+		pthread_join(pt[t], NULL);
+
+	int add = 0, mul = 0, sem = 0, sem_add = 0, syn = 0, syn_add = 0;
+	for (int i = 0; i < nq; i++) {
+		add += add_hit[i];
+		mul += mul_hit[i];
+		if (questions[i].syntactic) {
+			syn++;
+			syn_add += add_hit[i];
+		} else {
+			sem++;
+			sem_add += add_hit[i];
+		}
+	}
+	snprintf(result, size, "analogy 3CosAdd %.2f%% (semantic %.2f%%, syntactic %.2f%%) 3CosMul %.2f%%"
+			" on %d of %d questions", nq ? 100.0 * add / nq : 0, sem ? 100.0 * sem_add / sem : 0,
+			syn ? 100.0 * syn_add / syn : 0, nq ? 100.0 * mul / nq : 0, nq, total);
+}
+
+// Ranks starting at 1, ties get their average rank
+static std::vector<double> ranks(const std::vector<double> & v) {
+	std::vector<int> order(v.size());
+	for (unsigned int i = 0; i < v.size(); i++)
+		order[i] = i;
+	std::sort(order.begin(), order.end(), [&v](int x, int y) { return v[x] < v[y]; });
+	std::vector<double> r(v.size());
+	for (unsigned int i = 0; i < order.size();) {
+		unsigned int j = i;
+		while (j + 1 < order.size() && v[order[j + 1]] == v[order[i]])
+			j++;
+		for (unsigned int k = i; k <= j; k++)
+			r[order[k]] = (i + j) / 2.0 + 1;
+		i = j + 1;
+	}
+	return r;
+}
+
+static double spearman(const std::vector<double> & x, const std::vector<double> & y) {
+	std::vector<double> rx = ranks(x), ry = ranks(y);
+	double n = x.size(), mx = 0, my = 0, sxy = 0, sxx = 0, syy = 0;
+	for (unsigned int i = 0; i < x.size(); i++) {
+		mx += rx[i] / n;
+		my += ry[i] / n;
+	}
+	for (unsigned int i = 0; i < x.size(); i++) {
+		sxy += (rx[i] - mx) * (ry[i] - my);
+		sxx += (rx[i] - mx) * (rx[i] - mx);
+		syy += (ry[i] - my) * (ry[i] - my);
+	}
+	return sxx > 0 && syy > 0 ? sxy / sqrt(sxx * syy) : 0;
+}
+
+// "word1 word2 score" per line, separated by blanks or commas, lines that
+// do not parse (headers, comments) are skipped
+static void evalSimilarity(const EvalMatrix * e, char * result, size_t size) {
+	FILE * f = fopen(eval_similarity_file, "rb");
+	if (f == NULL) {
+		snprintf(result, size, "similarity file %s not found", eval_similarity_file);
+		return;
+	}
+	std::vector<double> human, model;
+	char line[MAX_STRING * 5], w1[MAX_STRING], w2[MAX_STRING];
+	double score;
+	int total = 0;
+	while (fgets(line, sizeof(line), f)) {
+		for (char * p = line; *p; p++)
+			if (*p == ',')
+				*p = ' ';
+		if (line[0] == '#' || sscanf(line, "%99s %99s %lf", w1, w2, &score) != 3)
+			continue;
+		total++;
+		int a = lookup(w1, e->rows), b = lookup(w2, e->rows);
+		if (a < 0 || b < 0)
+			continue;
+		human.push_back(score);
+		model.push_back(simdDot(e->m + (long long) a * e->stride, e->m + (long long) b * e->stride, e->dim));
+	}
+	fclose(f);
+	snprintf(result, size, "similarity Spearman %.4f on %d of %d pairs", spearman(human, model),
+			(int) human.size(), total);
+}
+
+static void evaluate(EvalMatrix * e, char ** words, const char * label) {
+	unsigned long long start = monotonicNs();
+	normalizeMatrix(e);
+	buildIndex(words, e->rows);
+	char analogy[MAX_STRING * 4] = "", similarity[MAX_STRING * 4] = "";
+	if (eval_analogy_file[0])
+		evalAnalogy(e, analogy, sizeof(analogy));
+	if (eval_similarity_file[0])
+		evalSimilarity(e, similarity, sizeof(similarity));
+	printf("Eval %s: %s%s%s (%.2fs)\n", label, analogy, analogy[0] && similarity[0] ? ", " : "",
+			similarity, (monotonicNs() - start) / 1e9);
+	fflush(stdout);
+}
+
+int evalEnabled() {
+	return eval_analogy_file[0] || eval_similarity_file[0];
+}
+
+void evalModel(char ** words, const real * vectors, int rows, int dim, int stride, const char * label) {
+	EvalMatrix e;
+	if (!allocMatrix(&e, rows, dim)) {
+		printf("Not enough memory to evaluate the model\n");
+		return;
+	}
+	for (long long r = 0; r < rows; r++)
+		memcpy(e.m + r * e.stride, vectors + r * stride, dim * sizeof(float));
+	evaluate(&e, words, label);
+	free(e.m);
+}
+
+// Reads the format written by -output: "rows dim" then per row the word, a
+// space and the vector as text or binary floats
+void evalModelFile(const char * path, int binary) {
+	int fd = open(path, O_RDONLY);
+	struct stat st;
+	if (fd == -1 || fstat(fd, &st) != 0) {
+		printf("Cannot open model %s\n", path);
+		exit(1);
+	}
+	char * data = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (data == MAP_FAILED) {
+		perror("mmap");
+		exit(1);
+	}
+	char * p = data, * end = data + st.st_size;
+	long long rows = strtoll(p, &p, 10);
+	int dim = strtol(p, &p, 10);
+	EvalMatrix e;
+	if (rows <= 0 || dim <= 0 || !allocMatrix(&e, rows, dim)) {
+		printf("Cannot read model %s\n", path);
+		exit(1);
+	}
+	char ** words = (char **) malloc(rows * sizeof(char *));
+	long long r;
+	for (r = 0; r < rows && p < end; r++) {
+		while (p < end && isspace(*p))
+			p++;
+		char * word = p;
+		while (p < end && *p != ' ')
+			p++;
+		words[r] = strndup(word, p - word);
+		p++;
+		float * row = e.m + r * e.stride;
+		if (binary) {
+			if (p + dim * sizeof(float) > end) {
+				free(words[r]);
+				break;
+			}
+			memcpy(row, p, dim * sizeof(float));
+			p += dim * sizeof(float);
+		} else
+			for (int i = 0; i < dim && p < end; i++)
+				row[i] = strtof(p, &p);
+	}
+	munmap(data, st.st_size);
+	close(fd);
+	if (r < rows) {
+		printf("Model %s is truncated after %lld of %lld rows\n", path, r, rows);
+		e.rows = rows = r;
+	}
+	evaluate(&e, words, path);
+	for (long long i = 0; i < rows; i++)
+		free(words[i]);
+	free(words);
+	free(e.m);
+}
@@ -0,0 +1,32 @@
+/*
+ * eval.h
+ *
+ *  Built-in quality evaluation: word analogies (3CosAdd and 3CosMul over
+ *  the most frequent words) and word similarity (Spearman correlation).
+ *  The queries are scored in blocks against the normalized model on all
+ *  cores, on the model in memory or on a saved one.
+ */
+
+#ifndef EVAL_H_
+#define EVAL_H_
+
+#include "cbow.h"
+
+extern char eval_analogy_file[MAX_STRING];
+extern char eval_similarity_file[MAX_STRING];
+extern char eval_model_file[MAX_STRING];
+// Candidates of the analogy search, the most frequent words
+extern int eval_vocab;
+// Also evaluate at every model average, not only at the end
+extern int eval_sync;
+
+// Questions scored against the same pass over the candidates
+#define EVAL_QUERY_BLOCK 16
+
+int evalEnabled();
+// Rows are in vocabulary order, words[i] is the word of row i
+void evalModel(char ** words, const real * vectors, int rows, int dim, int stride, const char * label);
+// Evaluates a model saved by -output, the file is mapped not read
+void evalModelFile(const char * path, int binary);
+
+#endif /* EVAL_H_ */
@@ -0,0 +1,305 @@
+#include "kmeans.h"
+#include "profiler.h"
+#include "simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+
+struct KmeansState {
+	const float * points;
+	long long n;
+	int dim, stride, k;
+	float * centroids;
+	// ||c||^2 of every centroid
+	float * norms;
+	int * assign;
+	// Points ordered by cluster, start[c] is the first of cluster c
+	long long * order, * start;
+	unsigned long long seed;
+	// Seeding: squared distance of every point to its closest centroid so
+	// far, ||x||^2 of the points, and the workers stepping with the caller
+	float * closest, * point_norms;
+	pthread_barrier_t ready, done;
+};
+
+struct KmeansJob {
+	KmeansState * s;
+	long long first, last;
+	double error;
+	long long changed;
+};
+
+static unsigned long long nextRandom(unsigned long long * x) {
+	unsigned long long z = (*x += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+static int threadCount(long long work) {
+	long long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > work)
+		n = work;
+	return n < 1 ? 1 : n;
+}
+
+static void startJobs(void *(*fn)(void *), KmeansState * s, long long work, std::vector<KmeansJob> & jobs,
+		std::vector<pthread_t> & pt) {
+	int n = threadCount(work);
+	pt.resize(n);
+	jobs.resize(n);
+	for (int t = 0; t < n; t++) {
+		jobs[t].s = s;
+		jobs[t].first = work * t / n;
+		jobs[t].last = work * (t + 1) / n;
+		jobs[t].error = 0;
+		jobs[t].changed = 0;
+		pthread_create(&pt[t], NULL, fn, &jobs[t]);
+	}
+}
+
+static void runJobs(void *(*fn)(void *), KmeansState * s, long long work, std::vector<KmeansJob> & jobs) {
+	std::vector<pthread_t> pt;
+	startJobs(fn, s, work, jobs, pt);
+	for (unsigned int t = 0; t < pt.size(); t++)
+		pthread_join(pt[t], NULL);
+}
+
+static void setCentroid(KmeansState * s, int c, long long p) {
+	float * centroid = s->centroids + (long long) c * s->dim;
+	memcpy(centroid, s->points + p * s->stride, s->dim * sizeof(float));
+	s->norms[c] = simdDot(centroid, centroid, s->dim);
+}
+
+// k-means++ distance updates: after every centroid the caller adds, the
+// closest distances of points first..last are lowered and their sum is
+// left in error for the caller to sample the next centroid from
+static void *SeedThread(void * arg) {
+	KmeansJob * job = (KmeansJob *) arg;
+	KmeansState * s = job->s;
+	for (long long p = job->first; p < job->last; p++) {
+		const float * x = s->points + p * s->stride;
+		s->point_norms[p] = simdDot(x, x, s->dim);
+	}
+	for (int c = 0; c < s->k; c++) {
+		pthread_barrier_wait(&s->ready);
+		const float * centroid = s->centroids + (long long) c * s->dim;
+		double sum = 0;
+		for (long long p = job->first; p < job->last; p++) {
+			float d = s->point_norms[p] - 2 * simdDot(s->points + p * s->stride, centroid, s->dim) + s->norms[c];
+			if (d < 0)
+				d = 0;
+			if (c == 0 || d < s->closest[p])
+				s->closest[p] = d;
+			sum += s->closest[p];
+		}
+		job->error = sum;
+		pthread_barrier_wait(&s->done);
+	}
+	return NULL;
+}
+
+// Picks the centroids one by one, each point with a probability
+// proportional to its squared distance to the closest centroid so far
+static void seedCentroids(KmeansState * s, unsigned long long * random) {
+	std::vector<KmeansJob> jobs;
+	std::vector<pthread_t> pt;
+	std::vector<float> closest(s->n), point_norms(s->n);
+	s->closest = &closest[0];
+	s->point_norms = &point_norms[0];
+	int n = threadCount(s->n);
+	pthread_barrier_init(&s->ready, NULL, n + 1);
+	pthread_barrier_init(&s->done, NULL, n + 1);
+	startJobs(SeedThread, s, s->n, jobs, pt);
+	setCentroid(s, 0, nextRandom(random) % s->n);
+	for (int c = 1; c <= s->k; c++) {
+		pthread_barrier_wait(&s->ready);
+		pthread_barrier_wait(&s->done);
+		if (c == s->k)
+			break;
+		double total = 0;
+		for (int t = 0; t < n; t++)
+			total += jobs[t].error;
+		long long p = nextRandom(random) % s->n;
+		if (total > 0) {
+			double target = (nextRandom(random) >> 11) * (1.0 / 9007199254740992.0) * total;
+			int t = 0;
+			for (; t < n - 1 && target >= jobs[t].error; t++)
+				target -= jobs[t].error;
+			for (p = jobs[t].first; p < jobs[t].last - 1; p++) {
+				target -= closest[p];
+				if (target < 0)
+					break;
+			}
+		}
+		setCentroid(s, c, p);
+	}
+	for (int t = 0; t < n; t++)
+		pthread_join(pt[t], NULL);
+	pthread_barrier_destroy(&s->ready);
+	pthread_barrier_destroy(&s->done);
+}
+
+// Nearest centroid by ||c||^2 - 2 x.c. Blocks of points are run against
+// tiles of centroids that stay in cache, four centroids per pass over x.
+static void *AssignThread(void * arg) {
+	KmeansJob * job = (KmeansJob *) arg;
+	KmeansState * s = job->s;
+	int tile = KMEANS_TILE_FLOATS / s->dim / 4 * 4;
+	if (tile < 4)
+		tile = 4;
+	float dots[4], best[KMEANS_POINT_BLOCK];
+	int arg_best[KMEANS_POINT_BLOCK];
+	for (long long p0 = job->first; p0 < job->last; p0 += KMEANS_POINT_BLOCK) {
+		int block = job->last - p0 < KMEANS_POINT_BLOCK ? job->last - p0 : KMEANS_POINT_BLOCK;
+		for (int j = 0; j < block; j++) {
+			best[j] = 1e30;
+			arg_best[j] = 0;
+		}
+		for (int c0 = 0; c0 < s->k; c0 += tile) {
+			int c1 = c0 + tile < s->k ? c0 + tile : s->k;
+			for (int j = 0; j < block; j++) {
+				const float * x = s->points + (p0 + j) * s->stride;
+				int c = c0;
+				for (; c + 4 <= c1; c += 4) {
+					simdDot4(x, s->centroids + (long long) c * s->dim, s->dim, s->dim, dots);
+					for (int i = 0; i < 4; i++)
+						if (s->norms[c + i] - 2 * dots[i] < best[j]) {
+							best[j] = s->norms[c + i] - 2 * dots[i];
+							arg_best[j] = c + i;
+						}
+				}
+				for (; c < c1; c++) {
+					float d = s->norms[c] - 2 * simdDot(x, s->centroids + (long long) c * s->dim, s->dim);
+					if (d < best[j]) {
+						best[j] = d;
+						arg_best[j] = c;
+					}
+				}
+			}
+		}
+		for (int j = 0; j < block; j++) {
+			long long p = p0 + j;
+			const float * x = s->points + p * s->stride;
+			job->error += best[j] + simdDot(x, x, s->dim);
+			job->changed += s->assign[p] != arg_best[j];
+			s->assign[p] = arg_best[j];
+		}
+	}
+	return NULL;
+}
+
+// Means of the clusters first..last, empty clusters restart at a random point
+static void *UpdateThread(void * arg) {
+	KmeansJob * job = (KmeansJob *) arg;
+	KmeansState * s = job->s;
+	std::vector<double> sum(s->dim);
+	unsigned long long random = s->seed + job->first;
+	for (long long c = job->first; c < job->last; c++) {
+		float * centroid = s->centroids + c * s->dim;
+		long long count = s->start[c + 1] - s->start[c];
+		if (count == 0) {
+			long long p = nextRandom(&random) % s->n;
+			memcpy(centroid, s->points + p * s->stride, s->dim * sizeof(float));
+		} else {
+			for (int i = 0; i < s->dim; i++)
+				sum[i] = 0;
+			for (long long j = s->start[c]; j < s->start[c + 1]; j++) {
+				const float * x = s->points + s->order[j] * s->stride;
+				for (int i = 0; i < s->dim; i++)
+					sum[i] += x[i];
+			}
+			for (int i = 0; i < s->dim; i++)
+				centroid[i] = sum[i] / count;
+		}
+		s->norms[c] = simdDot(centroid, centroid, s->dim);
+	}
+	return NULL;
+}
+
+double kmeans(const float * points, long long n, int dim, int stride, int k, int iterations,
+		unsigned long long seed, float * centroids, int * assign, KmeansStats * stats) {
+	unsigned long long start_ns = monotonicNs();
+	KmeansState s;
+	s.points = points;
+	s.n = n;
+	s.dim = dim;
+	s.stride = stride;
+	s.k = k;
+	s.centroids = centroids;
+	s.seed = seed;
+	std::vector<float> norms(k);
+	std::vector<int> own_assign(assign ? 0 : n);
+	std::vector<long long> order(n), start(k + 1);
+	s.norms = &norms[0];
+	s.assign = assign ? assign : &own_assign[0];
+	s.order = &order[0];
+	s.start = &start[0];
+	for (long long p = 0; p < n; p++)
+		s.assign[p] = -1;
+
+	unsigned long long random = seed;
+	seedCentroids(&s, &random);
+	if (stats) {
+		stats->seed_ns = monotonicNs() - start_ns;
+		stats->iterations = 0;
+	}
+
+	double error = 0;
+	std::vector<KmeansJob> jobs;
+	if (iterations < 1)
+		iterations = 1;
+	for (int it = 0; it < iterations; it++) {
+		runJobs(AssignThread, &s, n, jobs);
+		long long changed = 0;
+		error = 0;
+		for (unsigned int t = 0; t < jobs.size(); t++) {
+			changed += jobs[t].changed;
+			error += jobs[t].error;
+		}
+		error /= n;
+		if (stats)
+			stats->iterations = it + 1;
+		// The assignment always belongs to the centroids returned
+		if (changed == 0 || it == iterations - 1)
+			break;
+		// Counting sort of the points by cluster
+		for (int c = 0; c <= k; c++)
+			start[c] = 0;
+		for (long long p = 0; p < n; p++)
+			start[s.assign[p] + 1]++;
+		for (int c = 0; c < k; c++)
+			start[c + 1] += start[c];
+		std::vector<long long> fill(start.begin(), start.end() - 1);
+		for (long long p = 0; p < n; p++)
+			order[fill[s.assign[p]]++] = p;
+		s.seed = nextRandom(&random);
+		runJobs(UpdateThread, &s, k, jobs);
+	}
+	if (stats)
+		stats->total_ns = monotonicNs() - start_ns;
+	return error;
+}
+
+void kmeansBenchmark(long long max_rows, int dim) {
+	int iterations = 3;
+	std::vector<float> points(max_rows * dim);
+	unsigned long long random = 1;
+	for (long long i = 0; i < max_rows * dim; i++)
+		points[i] = (nextRandom(&random) >> 40) * (1.0 / 16777216.0) - 0.5;
+	printf("k-means benchmark, %d dimensions, %d threads, %d iterations\n", dim, threadCount(max_rows),
+			iterations);
+	printf("%10s %8s %10s %14s %10s\n", "words", "k", "seeding", "per iteration", "error");
+	for (long long rows = 10000; rows <= max_rows; rows *= 10)
+		for (int k = 100; k <= rows / 10; k *= 10) {
+			std::vector<float> centroids((long long) k * dim);
+			KmeansStats stats;
+			double error = kmeans(&points[0], rows, dim, dim, k, iterations, 1, &centroids[0], NULL, &stats);
+			printf("%10lld %8d %9.2fs %13.3fs %10.4f\n", rows, k, stats.seed_ns / 1e9,
+					(stats.total_ns - stats.seed_ns) / 1e9 / (stats.iterations > 0 ? stats.iterations : 1), error);
+			fflush(stdout);
+		}
+}
@@ -0,0 +1,33 @@
+/*
+ * kmeans.h
+ *
+ *  Multi-threaded k-means on float rows with k-means++ seeding, used for
+ *  the -classes output and the product quantization codebooks.
+ */
+
+#ifndef KMEANS_H_
+#define KMEANS_H_
+
+// Floats of the centroid tile kept in cache while a block of points is
+// assigned (256 KB)
+#define KMEANS_TILE_FLOATS 65536
+#define KMEANS_POINT_BLOCK 64
+
+struct KmeansStats {
+	int iterations;
+	unsigned long long seed_ns, total_ns;
+};
+
+// Clusters n points of dim floats, stride floats apart. Writes k centroids
+// of dim floats and the cluster of every point (assign may be NULL), stats
+// may be NULL. Returns the mean squared distance of the points to their
+// centroids. At least one iteration runs, so every point is assigned.
+double kmeans(const float * points, long long n, int dim, int stride, int k, int iterations,
+		unsigned long long seed, float * centroids, int * assign, KmeansStats * stats);
+
+// Times seeding and iterations on random vectors of dim floats, for
+// vocabularies of 10000 up to max_rows words and 100 up to a tenth as many
+// clusters
+void kmeansBenchmark(long long max_rows, int dim);
+
+#endif /* KMEANS_H_ */
@@ -0,0 +1,197 @@
+#include "metrics.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <vector>
+
+extern unsigned long long train_words;
+extern unsigned int iter;
+extern unsigned long long word_count_actual;
+
+char metrics_file[MAX_STRING];
+int metrics_interval = 10;
+
+struct DeviceCounters {
+	volatile unsigned long long words;
+	volatile unsigned long long batches;
+	volatile unsigned long long kernel_ns;
+	volatile unsigned long long sync_ns;
+	volatile unsigned long long sync_bytes;
+	DeviceCounters() : words(0), batches(0), kernel_ns(0), sync_ns(0), sync_bytes(0) {}
+};
+
+// Index 0 is the main thread (HOST_TRACK), devices follow
+static std::vector<DeviceCounters> counters;
+static unsigned long long start_ns = 0;
+static unsigned long long launch_ns = 0;
+static volatile int first_kernel_seen = 0;
+
+static pthread_t writer;
+static pthread_mutex_t writer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_cond = PTHREAD_COND_INITIALIZER;
+static int writer_running = 0;
+
+void metricsMarkLaunch() {
+	launch_ns = monotonicNs();
+}
+
+// Reports the startup latency once, when the first training kernel is queued
+void metricsFirstKernel() {
+	if (first_kernel_seen || !__sync_bool_compare_and_swap(&first_kernel_seen, 0, 1))
+		return;
+	printf("Time from launch to first kernel: %.2fs\n", (monotonicNs() - launch_ns) / 1e9);
+	fflush(stdout);
+}
+
+void metricsInit(int num_devices) {
+	counters.assign(num_devices + 1, DeviceCounters());
+}
+
+void metricsAddWords(int device, unsigned long long words) {
+	__sync_fetch_and_add(&counters[device + 1].words, words);
+}
+
+void metricsAddBatch(int device) {
+	__sync_fetch_and_add(&counters[device + 1].batches, 1ULL);
+}
+
+void metricsAddKernelTime(int device, unsigned long long ns) {
+	__sync_fetch_and_add(&counters[device + 1].kernel_ns, ns);
+}
+
+void metricsAddSyncTime(int device, unsigned long long ns) {
+	__sync_fetch_and_add(&counters[device + 1].sync_ns, ns);
+}
+
+void metricsAddSyncBytes(int device, unsigned long long bytes) {
+	__sync_fetch_and_add(&counters[device + 1].sync_bytes, bytes);
+}
+
+unsigned long long metricsSyncBytes() {
+	unsigned long long total = 0;
+	for (unsigned int i = 1; i < counters.size(); i++)
+		total += counters[i].sync_bytes;
+	return total;
+}
+
+double metricsElapsed() {
+	return (monotonicNs() - start_ns) / 1e9;
+}
+
+unsigned long long metricsTotalWords() {
+	unsigned long long total = 0;
+	for (unsigned int i = 1; i < counters.size(); i++)
+		total += counters[i].words;
+	return total;
+}
+
+double metricsWordsPerSec(int device) {
+	double elapsed = metricsElapsed();
+	if (elapsed <= 0)
+		return 0;
+	if (device == HOST_TRACK)
+		return metricsTotalWords() / elapsed;
+	return counters[device + 1].words / elapsed;
+}
+
+// Fraction of wall time the device spent executing training kernels
+static double occupancy(int device) {
+	double elapsed = metricsElapsed();
+	return elapsed > 0 ? counters[device + 1].kernel_ns / 1e9 / elapsed : 0;
+}
+
+void metricsPrintSummary() {
+	int num_devices = counters.size() - 1;
+	printf("\n%-8s %14s %10s %12s %10s %10s %10s\n", "Device", "Words", "Batches",
+			"Words/sec", "Kernel", "Sync(s)", "Sync(MB)");
+	for (int i = 0; i < num_devices; i++) {
+		printf("%-8d %14llu %10llu %11.2fk ", i, counters[i + 1].words,
+				counters[i + 1].batches, metricsWordsPerSec(i) / 1000);
+		if (KERNEL_TIMING)
+			printf("%9.1f%% ", occupancy(i) * 100);
+		else
+			printf("%10s ", "-");
+		printf("%10.2f %10.1f\n", counters[i + 1].sync_ns / 1e9, counters[i + 1].sync_bytes / 1048576.0);
+	}
+	printf("%-8s %14llu %10s %11.2fk %10s %10.2f %10.1f\n", "all", metricsTotalWords(), "",
+			metricsWordsPerSec(HOST_TRACK) / 1000, "", counters[0].sync_ns / 1e9, metricsSyncBytes() / 1048576.0);
+	fflush(stdout);
+}
+
+static void writeMetricsFile() {
+	char tmp_file[MAX_STRING + 8];
+	snprintf(tmp_file, sizeof(tmp_file), "%s.tmp", metrics_file);
+	FILE * fo = fopen(tmp_file, "wb");
+	if (fo == NULL) {
+		perror("metrics");
+		return;
+	}
+	int num_devices = counters.size() - 1;
+	fprintf(fo, "# HELP word2vec_words_total Training words consumed.\n");
+	fprintf(fo, "# TYPE word2vec_words_total counter\n");
+	for (int i = 0; i < num_devices; i++)
+		fprintf(fo, "word2vec_words_total{device=\"%d\"} %llu\n", i, counters[i + 1].words);
+	fprintf(fo, "# HELP word2vec_batches_total Kernel launches.\n");
+	fprintf(fo, "# TYPE word2vec_batches_total counter\n");
+	for (int i = 0; i < num_devices; i++)
+		fprintf(fo, "word2vec_batches_total{device=\"%d\"} %llu\n", i, counters[i + 1].batches);
+	fprintf(fo, "# HELP word2vec_words_per_second Words per second of wall time since training started.\n");
+	fprintf(fo, "# TYPE word2vec_words_per_second gauge\n");
+	for (int i = 0; i < num_devices; i++)
+		fprintf(fo, "word2vec_words_per_second{device=\"%d\"} %.1f\n", i, metricsWordsPerSec(i));
+	fprintf(fo, "word2vec_words_per_second{device=\"all\"} %.1f\n", metricsWordsPerSec(HOST_TRACK));
+	if (KERNEL_TIMING) {
+		fprintf(fo, "# HELP word2vec_kernel_occupancy Fraction of wall time spent in training kernels.\n");
+		fprintf(fo, "# TYPE word2vec_kernel_occupancy gauge\n");
+		for (int i = 0; i < num_devices; i++)
+			fprintf(fo, "word2vec_kernel_occupancy{device=\"%d\"} %.4f\n", i, occupancy(i));
+	}
+	fprintf(fo, "# HELP word2vec_sync_seconds_total Time spent reading back, averaging and distributing the model.\n");
+	fprintf(fo, "# TYPE word2vec_sync_seconds_total counter\n");
+	fprintf(fo, "word2vec_sync_seconds_total{device=\"host\"} %.3f\n", counters[0].sync_ns / 1e9);
+	for (int i = 0; i < num_devices; i++)
+		fprintf(fo, "word2vec_sync_seconds_total{device=\"%d\"} %.3f\n", i, counters[i + 1].sync_ns / 1e9);
+	fprintf(fo, "# HELP word2vec_sync_bytes_total Model bytes moved between host and device for syncs.\n");
+	fprintf(fo, "# TYPE word2vec_sync_bytes_total counter\n");
+	for (int i = 0; i < num_devices; i++)
+		fprintf(fo, "word2vec_sync_bytes_total{device=\"%d\"} %llu\n", i, counters[i + 1].sync_bytes);
+	fprintf(fo, "# HELP word2vec_progress_ratio Fraction of all training words processed.\n");
+	fprintf(fo, "# TYPE word2vec_progress_ratio gauge\n");
+	fprintf(fo, "word2vec_progress_ratio %.6f\n", word_count_actual / (double) ((double) iter * train_words + 1));
+	fclose(fo);
+	if (rename(tmp_file, metrics_file) != 0)
+		perror("rename");
+}
+
+static void *metricsWriterThread(void *) {
+	pthread_mutex_lock(&writer_mutex);
+	while (writer_running) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += metrics_interval;
+		pthread_cond_timedwait(&writer_cond, &writer_mutex, &deadline);
+		writeMetricsFile();
+	}
+	pthread_mutex_unlock(&writer_mutex);
+	return NULL;
+}
+
+void metricsStart() {
+	start_ns = monotonicNs();
+	if (metrics_file[0] == 0)
+		return;
+	writer_running = 1;
+	pthread_create(&writer, NULL, metricsWriterThread, NULL);
+}
+
+// Stops the writer thread, which writes the final values on its way out
+void metricsStop() {
+	if (!writer_running)
+		return;
+	pthread_mutex_lock(&writer_mutex);
+	writer_running = 0;
+	pthread_cond_signal(&writer_cond);
+	pthread_mutex_unlock(&writer_mutex);
+	pthread_join(writer, NULL);
+}
@@ -0,0 +1,41 @@
+/*
+ * metrics.h
+ *
+ *  Per-device throughput counters. Updated lock free from the trainer
+ *  threads, summarized on stdout and optionally exported periodically in
+ *  Prometheus text format.
+ */
+
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include "cbow.h"
+#include "profiler.h"
+
+extern char metrics_file[MAX_STRING];
+extern int metrics_interval;
+
+// Kernel events are only timed when someone consumes them
+#define KERNEL_TIMING (profiling || metrics_file[0])
+
+void metricsMarkLaunch();
+void metricsFirstKernel();
+void metricsInit(int num_devices);
+void metricsStart();
+void metricsStop();
+
+void metricsAddWords(int device, unsigned long long words);
+void metricsAddBatch(int device);
+void metricsAddKernelTime(int device, unsigned long long ns);
+// device = HOST_TRACK accounts time spent by the main thread
+void metricsAddSyncTime(int device, unsigned long long ns);
+// Model bytes a device moved over the bus for syncs, both directions
+void metricsAddSyncBytes(int device, unsigned long long bytes);
+unsigned long long metricsSyncBytes();
+
+unsigned long long metricsTotalWords();
+double metricsElapsed();
+double metricsWordsPerSec(int device);
+void metricsPrintSummary();
+
+#endif /* METRICS_H_ */
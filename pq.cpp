@@ -0,0 +1,316 @@
+#include "pq.h"
+#include "kmeans.h"
+#include "profiler.h"
+#include "simd.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <vector>
+
+char pq_output_file[MAX_STRING] = "";
+int pq_subspaces = 0;
+int pq_train_rows = 32768;
+
+static int pqThreads(long long work) {
+	long long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > work)
+		n = work;
+	return n < 1 ? 1 : n;
+}
+
+static float * codebook(const PQModel * pq, int m) {
+	return pq->codebooks + (long long) m * PQ_CENTROIDS * pq->subspace_dim;
+}
+
+// Unit length copy of a row, zero padded to the subspaces
+static void normalizeRow(const PQModel * pq, const real * v, float * out) {
+	float len = sqrt(simdDot(v, v, pq->dim));
+	if (len == 0)
+		len = 1;
+	for (int i = 0; i < pq->dim; i++)
+		out[i] = v[i] / len;
+	for (int i = pq->dim; i < pq->subspaces * pq->subspace_dim; i++)
+		out[i] = 0;
+}
+
+void pqTrain(PQModel * pq, const real * vectors, long long rows, int dim, int stride) {
+	pq->rows = rows;
+	pq->dim = dim;
+	pq->subspaces = pq_subspaces > 0 ? pq_subspaces : (dim + 3) / 4;
+	if (pq->subspaces > dim)
+		pq->subspaces = dim;
+	pq->subspace_dim = (dim + pq->subspaces - 1) / pq->subspaces;
+	pq->codebooks = (float *) malloc((long long) pq->subspaces * PQ_CENTROIDS * pq->subspace_dim * sizeof(float));
+	pq->codes = (unsigned char *) malloc(rows * pq->subspaces);
+	if (pq->codebooks == NULL || pq->codes == NULL) {
+		printf("Not enough memory to quantize the model\n");
+		exit(1);
+	}
+
+	// Training rows are spread evenly over the frequency sorted vocabulary
+	long long n = rows < pq_train_rows ? rows : pq_train_rows;
+	int padded = pq->subspaces * pq->subspace_dim;
+	std::vector<float> train(n * padded);
+	for (long long p = 0; p < n; p++)
+		normalizeRow(pq, vectors + p * rows / n * stride, &train[p * padded]);
+	for (int m = 0; m < pq->subspaces; m++)
+		kmeans(&train[m * pq->subspace_dim], n, pq->subspace_dim, padded, PQ_CENTROIDS,
+				PQ_KMEANS_ITERATIONS, m + 1, codebook(pq, m), NULL, NULL);
+}
+
+struct EncodeJob {
+	PQModel * pq;
+	const real * vectors;
+	int stride;
+	const float * norms;
+	long long first, last;
+};
+
+static void *EncodeThread(void * arg) {
+	EncodeJob * job = (EncodeJob *) arg;
+	PQModel * pq = job->pq;
+	int dsub = pq->subspace_dim;
+	std::vector<float> x(pq->subspaces * dsub);
+	float dots[4];
+	for (long long r = job->first; r < job->last; r++) {
+		normalizeRow(pq, job->vectors + r * job->stride, &x[0]);
+		for (int m = 0; m < pq->subspaces; m++) {
+			const float * c = codebook(pq, m), * norms = job->norms + m * PQ_CENTROIDS;
+			float best = 1e30;
+			int arg_best = 0;
+			for (int k = 0; k < PQ_CENTROIDS; k += 4) {
+				simdDot4(&x[m * dsub], c + k * dsub, dsub, dsub, dots);
+				for (int j = 0; j < 4; j++)
+					if (norms[k + j] - 2 * dots[j] < best) {
+						best = norms[k + j] - 2 * dots[j];
+						arg_best = k + j;
+					}
+			}
+			pq->codes[r * pq->subspaces + m] = arg_best;
+		}
+	}
+	return NULL;
+}
+
+void pqEncode(PQModel * pq, const real * vectors, int stride) {
+	int dsub = pq->subspace_dim;
+	std::vector<float> norms(pq->subspaces * PQ_CENTROIDS);
+	for (int m = 0; m < pq->subspaces; m++)
+		for (int k = 0; k < PQ_CENTROIDS; k++) {
+			const float * c = codebook(pq, m) + k * dsub;
+			norms[m * PQ_CENTROIDS + k] = simdDot(c, c, dsub);
+		}
+	int n = pqThreads(pq->rows);
+	std::vector<pthread_t> pt(n);
+	std::vector<EncodeJob> jobs(n);
+	for (int t = 0; t < n; t++) {
+		jobs[t].pq = pq;
+		jobs[t].vectors = vectors;
+		jobs[t].stride = stride;
+		jobs[t].norms = &norms[0];
+		jobs[t].first = pq->rows * t / n;
+		jobs[t].last = pq->rows * (t + 1) / n;
+		pthread_create(&pt[t], NULL, EncodeThread, &jobs[t]);
+	}
+	for (int t = 0; t < n; t++)
+		pthread_join(pt[t], NULL);
+}
+
+void pqSave(const PQModel * pq, char ** words, const char * path) {
+	FILE * fo = fopen(path, "wb");
+	if (fo == NULL) {
+		printf("Cannot open %s for writing\n", path);
+		exit(1);
+	}
+	fprintf(fo, "%lld %d %d %d\n", pq->rows, pq->dim, pq->subspaces, pq->subspace_dim);
+	fwrite(pq->codebooks, sizeof(float), (long long) pq->subspaces * PQ_CENTROIDS * pq->subspace_dim, fo);
+	for (long long r = 0; r < pq->rows; r++) {
+		fprintf(fo, "%s ", words[r]);
+		fwrite(pq->codes + r * pq->subspaces, 1, pq->subspaces, fo);
+		fprintf(fo, "\n");
+	}
+	fclose(fo);
+}
+
+// Keeps the best top scores in descending order
+static void insertTop(int top, int id, float score, int * ids, float * scores) {
+	if (score <= scores[top - 1])
+		return;
+	int j = top - 1;
+	for (; j > 0 && scores[j - 1] < score; j--) {
+		scores[j] = scores[j - 1];
+		ids[j] = ids[j - 1];
+	}
+	scores[j] = score;
+	ids[j] = id;
+}
+
+// Asymmetric distance scan: the score of a row is the sum of its table
+// entries. AVX2 gathers the entries of eight rows at once.
+static void scanCodes(const PQModel * pq, const float * table, long long limit, int top, int * ids, float * scores) {
+	int M = pq->subspaces;
+	long long r = 0;
+#ifdef __AVX2__
+	float block[8];
+	for (; r + 8 <= limit; r += 8) {
+		const unsigned char * c = pq->codes + r * M;
+		__m256 sum = _mm256_setzero_ps();
+		for (int m = 0; m < M; m++) {
+			__m256i idx = _mm256_setr_epi32(c[m], c[M + m], c[2 * M + m], c[3 * M + m],
+					c[4 * M + m], c[5 * M + m], c[6 * M + m], c[7 * M + m]);
+			sum = _mm256_add_ps(sum, _mm256_i32gather_ps(table + m * PQ_CENTROIDS, idx, 4));
+		}
+		_mm256_storeu_ps(block, sum);
+		for (int j = 0; j < 8; j++)
+			insertTop(top, r + j, block[j], ids, scores);
+	}
+#endif
+	for (; r < limit; r++) {
+		const unsigned char * c = pq->codes + r * M;
+		float sum = 0;
+		for (int m = 0; m < M; m++)
+			sum += table[m * PQ_CENTROIDS + c[m]];
+		insertTop(top, r, sum, ids, scores);
+	}
+}
+
+void pqNearest(const PQModel * pq, const float * query, long long limit, int top, int * ids, float * scores) {
+	int dsub = pq->subspace_dim;
+	std::vector<float> q(pq->subspaces * dsub), table(pq->subspaces * PQ_CENTROIDS);
+	normalizeRow(pq, query, &q[0]);
+	for (int m = 0; m < pq->subspaces; m++)
+		for (int k = 0; k < PQ_CENTROIDS; k += 4)
+			simdDot4(&q[m * dsub], codebook(pq, m) + k * dsub, dsub, dsub, &table[m * PQ_CENTROIDS + k]);
+	for (int j = 0; j < top; j++) {
+		ids[j] = -1;
+		scores[j] = -1e30;
+	}
+	if (limit > pq->rows)
+		limit = pq->rows;
+	scanCodes(pq, &table[0], limit, top, ids, scores);
+}
+
+void pqFree(PQModel * pq) {
+	free(pq->codebooks);
+	free(pq->codes);
+}
+
+struct RecallJob {
+	const PQModel * pq;
+	const real * vectors;
+	int stride;
+	const float * norms;
+	long long limit, first, last, queries;
+	long long hits;
+	unsigned long long exact_ns, pq_ns;
+};
+
+// Exact and quantized neighbours of the queries first..last, the query row
+// itself is left out of both
+static void *RecallThread(void * arg) {
+	RecallJob * job = (RecallJob *) arg;
+	const PQModel * pq = job->pq;
+	int top = PQ_RECALL_TOP + 1;
+	int exact_ids[PQ_RECALL_TOP + 1], pq_ids[PQ_RECALL_TOP + 1];
+	float exact_scores[PQ_RECALL_TOP + 1], pq_scores[PQ_RECALL_TOP + 1], dots[4];
+	for (long long i = job->first; i < job->last; i++) {
+		long long query = i * job->limit / job->queries;
+		const real * q = job->vectors + query * job->stride;
+		unsigned long long start = monotonicNs();
+		for (int j = 0; j < top; j++) {
+			exact_ids[j] = -1;
+			exact_scores[j] = -1e30;
+		}
+		long long r = 0;
+		for (; r + 4 <= job->limit; r += 4) {
+			simdDot4(q, job->vectors + r * job->stride, job->stride, pq->dim, dots);
+			for (int j = 0; j < 4; j++)
+				insertTop(top, r + j, dots[j] * job->norms[r + j], exact_ids, exact_scores);
+		}
+		for (; r < job->limit; r++)
+			insertTop(top, r, simdDot(q, job->vectors + r * job->stride, pq->dim) * job->norms[r],
+					exact_ids, exact_scores);
+		unsigned long long middle = monotonicNs();
+		pqNearest(pq, q, job->limit, top, pq_ids, pq_scores);
+		job->pq_ns += monotonicNs() - middle;
+		job->exact_ns += middle - start;
+		for (int a = 0, na = 0; a < top && na < PQ_RECALL_TOP; a++) {
+			if (exact_ids[a] == query)
+				continue;
+			na++;
+			for (int b = 0, nb = 0; b < top && nb < PQ_RECALL_TOP; b++) {
+				if (pq_ids[b] == query)
+					continue;
+				nb++;
+				if (pq_ids[b] == exact_ids[a]) {
+					job->hits++;
+					break;
+				}
+			}
+		}
+	}
+	return NULL;
+}
+
+void pqExport(char ** words, const real * vectors, long long rows, int dim, int stride) {
+	PQModel pq;
+	unsigned long long start = monotonicNs();
+	pqTrain(&pq, vectors, rows, dim, stride);
+	unsigned long long trained = monotonicNs();
+	pqEncode(&pq, vectors, stride);
+	unsigned long long encoded = monotonicNs();
+	pqSave(&pq, words, pq_output_file);
+
+	double full = (double) rows * dim * sizeof(float) / 1048576;
+	double compact = ((double) rows * pq.subspaces
+			+ (double) pq.subspaces * PQ_CENTROIDS * pq.subspace_dim * sizeof(float)) / 1048576;
+	printf("PQ: %d subspaces x %d centroids, %d bytes per vector, %.1f MB -> %.1f MB (%.1fx)\n",
+			pq.subspaces, PQ_CENTROIDS, pq.subspaces, full, compact, full / compact);
+	printf("PQ: trained in %.2fs, encoded %lld vectors in %.2fs (%.0fk/s)\n", (trained - start) / 1e9,
+			rows, (encoded - trained) / 1e9, rows / ((encoded - trained) / 1e9 + 1e-9) / 1000);
+
+	// Recall of the quantized top list against the exact one, among the
+	// most frequent words
+	long long limit = rows < PQ_RECALL_ROWS ? rows : PQ_RECALL_ROWS;
+	long long queries = limit < PQ_RECALL_QUERIES ? limit : PQ_RECALL_QUERIES;
+	if (limit <= PQ_RECALL_TOP) {
+		pqFree(&pq);
+		return;
+	}
+	std::vector<float> norms(limit);
+	for (long long r = 0; r < limit; r++) {
+		float len = sqrt(simdDot(vectors + r * stride, vectors + r * stride, dim));
+		norms[r] = len > 0 ? 1 / len : 0;
+	}
+	int n = pqThreads(queries);
+	std::vector<pthread_t> pt(n);
+	std::vector<RecallJob> jobs(n);
+	for (int t = 0; t < n; t++) {
+		jobs[t].pq = &pq;
+		jobs[t].vectors = vectors;
+		jobs[t].stride = stride;
+		jobs[t].norms = &norms[0];
+		jobs[t].limit = limit;
+		jobs[t].queries = queries;
+		jobs[t].first = queries * t / n;
+		jobs[t].last = queries * (t + 1) / n;
+		jobs[t].hits = 0;
+		jobs[t].exact_ns = jobs[t].pq_ns = 0;
+		pthread_create(&pt[t], NULL, RecallThread, &jobs[t]);
+	}
+	long long hits = 0;
+	unsigned long long exact_ns = 0, pq_ns = 0;
+	for (int t = 0; t < n; t++) {
+		pthread_join(pt[t], NULL);
+		hits += jobs[t].hits;
+		exact_ns += jobs[t].exact_ns;
+		pq_ns += jobs[t].pq_ns;
+	}
+	printf("PQ: recall@%d %.3f over %lld queries in %lld vectors, %.2f ms per query (exact %.2f ms)\n",
+			PQ_RECALL_TOP, (double) hits / (queries * PQ_RECALL_TOP), queries, limit,
+			pq_ns / 1e6 / queries, exact_ns / 1e6 / queries);
+	pqFree(&pq);
+}
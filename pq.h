@@ -0,0 +1,49 @@
+/*
+ * pq.h
+ *
+ *  Product quantization of the trained vectors for compact serving. The
+ *  unit length vectors are cut into subspaces, each gets a codebook of 256
+ *  centroids and every vector is stored as one byte per subspace. Queries
+ *  are scored with asymmetric distance tables: the full precision query
+ *  against the codes.
+ *
+ *  File format: "rows dim subspaces subspace_dim\n", the codebooks as
+ *  floats (subspace major, 256 centroids each), then per row the word, a
+ *  space, the code bytes and a newline.
+ */
+
+#ifndef PQ_H_
+#define PQ_H_
+
+#include "cbow.h"
+
+#define PQ_CENTROIDS 256
+#define PQ_KMEANS_ITERATIONS 25
+// Database and queries of the recall check
+#define PQ_RECALL_ROWS 100000
+#define PQ_RECALL_QUERIES 1000
+#define PQ_RECALL_TOP 10
+
+extern char pq_output_file[MAX_STRING];
+extern int pq_subspaces;
+extern int pq_train_rows;
+
+struct PQModel {
+	long long rows;
+	int dim, subspaces, subspace_dim;
+	float * codebooks;
+	unsigned char * codes;
+};
+
+void pqTrain(PQModel * pq, const real * vectors, long long rows, int dim, int stride);
+void pqEncode(PQModel * pq, const real * vectors, int stride);
+void pqSave(const PQModel * pq, char ** words, const char * path);
+// The top rows among the first limit ones for a query of dim floats,
+// best first
+void pqNearest(const PQModel * pq, const float * query, long long limit, int top, int * ids, float * scores);
+void pqFree(PQModel * pq);
+
+// Trains, encodes and saves the model, then reports size, time and recall
+void pqExport(char ** words, const real * vectors, long long rows, int dim, int stride);
+
+#endif /* PQ_H_ */
@@ -0,0 +1,269 @@
+#include "profiler.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+int profiling = 0;
+char profile_file[MAX_STRING];
+
+// Chrome trace lanes inside one device track
+#define LANE_HOST 0
+#define LANE_DEVICE 1
+#define LANE_TRANSFER 2
+
+struct PendingEvent {
+	const char * name;
+	int lane;
+	cl_event event;
+	unsigned long long host_ns;
+	size_t bytes;
+};
+
+struct TraceRecord {
+	const char * name;
+	int lane;
+	unsigned long long start, end;
+	unsigned long long queued, submit;
+	size_t bytes;
+};
+
+struct Track {
+	std::string name;
+	std::vector<PendingEvent> pending;
+	std::vector<TraceRecord> records;
+	// device clock -> host monotonic clock, fixed by the first resolved batch
+	long long clock_offset;
+	int calibrated;
+	Track() : clock_offset(0), calibrated(0) {}
+};
+
+static std::vector<Track> tracks;
+static pthread_mutex_t profiler_mutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long long trace_origin = 0;
+
+unsigned long long monotonicNs() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (unsigned long long) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+// Caller holds profiler_mutex. Track HOST_TRACK lives at index 0.
+static Track & getTrack(int track) {
+	unsigned int index = track + 1;
+	if (index >= tracks.size())
+		tracks.resize(index + 1);
+	return tracks[index];
+}
+
+void profilerInit() {
+	if (!profiling)
+		return;
+	trace_origin = monotonicNs();
+	pthread_mutex_lock(&profiler_mutex);
+	getTrack(HOST_TRACK).name = "Host";
+	pthread_mutex_unlock(&profiler_mutex);
+}
+
+void profilerSetTrackName(int track, const char * name) {
+	if (!profiling)
+		return;
+	pthread_mutex_lock(&profiler_mutex);
+	getTrack(track).name = name;
+	pthread_mutex_unlock(&profiler_mutex);
+}
+
+void profilerHostSpan(int track, const char * name, unsigned long long start, unsigned long long end) {
+	if (!profiling)
+		return;
+	TraceRecord r;
+	r.name = name;
+	r.lane = LANE_HOST;
+	r.start = start;
+	r.end = end;
+	r.queued = r.submit = 0;
+	r.bytes = 0;
+	pthread_mutex_lock(&profiler_mutex);
+	getTrack(track).records.push_back(r);
+	pthread_mutex_unlock(&profiler_mutex);
+}
+
+static void addDeviceEvent(int track, int lane, const char * name, cl_event event, size_t bytes) {
+	PendingEvent p;
+	p.name = name;
+	p.lane = lane;
+	p.event = event;
+	p.host_ns = monotonicNs();
+	p.bytes = bytes;
+	pthread_mutex_lock(&profiler_mutex);
+	getTrack(track).pending.push_back(p);
+	pthread_mutex_unlock(&profiler_mutex);
+}
+
+void profilerDeviceEvent(int track, const char * name, cl_event event, size_t bytes) {
+	if (profiling)
+		addDeviceEvent(track, LANE_DEVICE, name, event, bytes);
+}
+
+void profilerTransferEvent(int track, const char * name, cl_event event, size_t bytes) {
+	if (profiling)
+		addDeviceEvent(track, LANE_TRANSFER, name, event, bytes);
+}
+
+// Collects the timestamps of all pending events of a track. Must be called
+// once the owning command queue has drained (after clFinish).
+void profilerResolve(int track) {
+	if (!profiling)
+		return;
+	pthread_mutex_lock(&profiler_mutex);
+	Track & t = getTrack(track);
+	size_t n = t.pending.size();
+	std::vector<cl_ulong> stamps(n * 4);
+	for (size_t i = 0; i < n; i++) {
+		cl_event ev = t.pending[i].event;
+		clWaitForEvents(1, &ev);
+		clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_QUEUED, sizeof(cl_ulong), &stamps[i * 4 + 0], NULL);
+		clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_SUBMIT, sizeof(cl_ulong), &stamps[i * 4 + 1], NULL);
+		clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_START, sizeof(cl_ulong), &stamps[i * 4 + 2], NULL);
+		clGetEventProfilingInfo(ev, CL_PROFILING_COMMAND_END, sizeof(cl_ulong), &stamps[i * 4 + 3], NULL);
+		clReleaseEvent(ev);
+	}
+	// The host timestamp is taken right after clEnqueue* returned, so the
+	// smallest (host - queued) difference is the best estimate of the offset
+	// between both clocks; blocking calls only ever overestimate it.
+	if (!t.calibrated && n > 0) {
+		long long best = (long long) (t.pending[0].host_ns - stamps[0]);
+		for (size_t i = 1; i < n; i++) {
+			long long d = (long long) (t.pending[i].host_ns - stamps[i * 4]);
+			if (d < best)
+				best = d;
+		}
+		t.clock_offset = best;
+		t.calibrated = 1;
+	}
+	for (size_t i = 0; i < n; i++) {
+		TraceRecord r;
+		r.name = t.pending[i].name;
+		r.lane = t.pending[i].lane;
+		r.queued = stamps[i * 4 + 0] + t.clock_offset;
+		r.submit = stamps[i * 4 + 1] + t.clock_offset;
+		r.start = stamps[i * 4 + 2] + t.clock_offset;
+		r.end = stamps[i * 4 + 3] + t.clock_offset;
+		r.bytes = t.pending[i].bytes;
+		t.records.push_back(r);
+	}
+	t.pending.clear();
+	pthread_mutex_unlock(&profiler_mutex);
+}
+
+static double traceUs(unsigned long long ns) {
+	return ns > trace_origin ? (ns - trace_origin) / 1000.0 : 0;
+}
+
+// Time of the transfer queue spent while the compute queue was busy too,
+// confirms that uploads hide behind the kernels
+static void reportOverlap(unsigned int index, Track & t) {
+	std::vector<std::pair<unsigned long long, unsigned long long> > compute, transfer;
+	for (unsigned int j = 0; j < t.records.size(); j++) {
+		TraceRecord & r = t.records[j];
+		if (r.lane == LANE_DEVICE)
+			compute.push_back(std::make_pair(r.start, r.end));
+		else if (r.lane == LANE_TRANSFER)
+			transfer.push_back(std::make_pair(r.start, r.end));
+	}
+	if (transfer.empty())
+		return;
+	std::sort(compute.begin(), compute.end());
+	std::sort(transfer.begin(), transfer.end());
+	unsigned long long total = 0, hidden = 0;
+	unsigned int c = 0;
+	for (unsigned int j = 0; j < transfer.size(); j++) {
+		unsigned long long start = transfer[j].first, end = transfer[j].second;
+		if (end <= start)
+			continue;
+		total += end - start;
+		// Compute spans are back to back on an in-order queue, skip the
+		// ones ending before this transfer
+		while (c < compute.size() && compute[c].second <= start)
+			c++;
+		for (unsigned int k = c; k < compute.size() && compute[k].first < end; k++) {
+			unsigned long long a = std::max(start, compute[k].first), b = std::min(end, compute[k].second);
+			if (b > a)
+				hidden += b - a;
+		}
+	}
+	printf("GPU %u: %.2f ms of uploads, %.2f ms (%.0f%%) overlapped with the compute queue\n", index - 1,
+			total / 1e6, hidden / 1e6, total ? 100.0 * hidden / total : 0);
+}
+
+// Device and event names go into JSON strings
+static std::string jsonEscape(const char * s) {
+	std::string out;
+	for (; *s; s++) {
+		unsigned char c = *s;
+		if (c == '"' || c == '\\') {
+			out += '\\';
+			out += c;
+		} else if (c < 0x20) {
+			char code[8];
+			snprintf(code, sizeof(code), "\\u%04x", c);
+			out += code;
+		} else
+			out += c;
+	}
+	return out;
+}
+
+void profilerWrite() {
+	if (!profiling)
+		return;
+	for (int i = 0; i + 1 < (int) tracks.size(); i++)
+		profilerResolve(i);
+	FILE * fo = fopen(profile_file, "wb");
+	if (fo == NULL) {
+		printf("Cannot open profile output %s\n", profile_file);
+		return;
+	}
+	pthread_mutex_lock(&profiler_mutex);
+	size_t total = 0;
+	fprintf(fo, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	int first = 1;
+	for (unsigned int i = 0; i < tracks.size(); i++) {
+		Track & t = tracks[i];
+		if (t.name.empty() && t.records.empty())
+			continue;
+		std::string name = jsonEscape(t.name.empty() ? "Device" : t.name.c_str());
+		// One trace process per device: lane 0 = host feeder, lane 1 = queue
+		if (i == 0)
+			fprintf(fo, "%s{\"ph\":\"M\",\"pid\":0,\"name\":\"process_name\",\"args\":{\"name\":\"%s\"}}",
+					first ? "" : ",\n", name.c_str());
+		else
+			fprintf(fo, "%s{\"ph\":\"M\",\"pid\":%u,\"name\":\"process_name\",\"args\":{\"name\":\"GPU %u: %s\"}}",
+					first ? "" : ",\n", i, i - 1, name.c_str());
+		first = 0;
+		fprintf(fo, ",\n{\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"host\"}}", i, LANE_HOST);
+		if (i > 0) {
+			fprintf(fo, ",\n{\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"command queue\"}}", i, LANE_DEVICE);
+			fprintf(fo, ",\n{\"ph\":\"M\",\"pid\":%u,\"tid\":%d,\"name\":\"thread_name\",\"args\":{\"name\":\"transfer queue\"}}", i, LANE_TRANSFER);
+			reportOverlap(i, t);
+		}
+		for (unsigned int j = 0; j < t.records.size(); j++) {
+			TraceRecord & r = t.records[j];
+			fprintf(fo, ",\n{\"ph\":\"X\",\"pid\":%u,\"tid\":%d,\"name\":\"%s\",\"cat\":\"%s\",\"ts\":%.3f,\"dur\":%.3f",
+					i, r.lane, jsonEscape(r.name).c_str(), r.lane == LANE_HOST ? "host" : "device",
+					traceUs(r.start), r.end > r.start ? (r.end - r.start) / 1000.0 : 0);
+			if (r.lane != LANE_HOST)
+				fprintf(fo, ",\"args\":{\"queued_us\":%.3f,\"submit_us\":%.3f,\"bytes\":%lu}",
+						traceUs(r.queued), traceUs(r.submit), (unsigned long) r.bytes);
+			fprintf(fo, "}");
+			total++;
+		}
+	}
+	fprintf(fo, "\n]}\n");
+	fclose(fo);
+	pthread_mutex_unlock(&profiler_mutex);
+	printf("Wrote %lu trace events to %s\n", (unsigned long) total, profile_file);
+}
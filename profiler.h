@@ -0,0 +1,34 @@
+/*
+ * profiler.h
+ *
+ *  Opt-in timeline profiling. OpenCL events of every transfer and kernel
+ *  plus host spans are collected per device and written as a Chrome /
+ *  Perfetto trace (chrome://tracing, ui.perfetto.dev).
+ */
+
+#ifndef PROFILER_H_
+#define PROFILER_H_
+
+#include "cbow.h"
+
+// Track used for spans recorded by the main thread (sync, averaging)
+#define HOST_TRACK -1
+
+extern int profiling;
+extern char profile_file[MAX_STRING];
+
+// Event out-parameter for clEnqueue* calls, only requested while profiling
+#define PROFILE_EVENT(ev) (profiling ? &(ev) : NULL)
+
+unsigned long long monotonicNs();
+
+void profilerInit();
+void profilerSetTrackName(int track, const char * name);
+void profilerHostSpan(int track, const char * name, unsigned long long start, unsigned long long end);
+void profilerDeviceEvent(int track, const char * name, cl_event event, size_t bytes);
+// Same for commands of the transfer queue, drawn in a lane of their own
+void profilerTransferEvent(int track, const char * name, cl_event event, size_t bytes);
+void profilerResolve(int track);
+void profilerWrite();
+
+#endif /* PROFILER_H_ */
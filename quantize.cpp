@@ -0,0 +1,17 @@
+#include "quantize.h"
+#include <math.h>
+
+float quantizeRow(const float * values, int n, signed char * q, float * residual) {
+	float largest = 0;
+	for (int b = 0; b < n; b++)
+		if (fabsf(values[b]) > largest)
+			largest = fabsf(values[b]);
+	float scale = largest / 127;
+	for (int b = 0; b < n; b++) {
+		signed char v = scale > 0 ? (signed char) rintf(values[b] / scale) : 0;
+		q[b] = v;
+		if (residual)
+			residual[b] = values[b] - v * scale;
+	}
+	return scale;
+}
@@ -0,0 +1,16 @@
+/*
+ * quantize.h
+ *
+ *  8-bit rows for -sync-quantize. A row of changes to the model travels as
+ *  signed bytes times one scale, its largest magnitude / 127, rounded the
+ *  way device_quantize_delta in word2vec.cl does on the devices.
+ */
+
+#ifndef QUANTIZE_H_
+#define QUANTIZE_H_
+
+// Quantizes n values into q and returns the scale, 0 for a row that did
+// not change. With residual, what the rounding left out is stored there.
+float quantizeRow(const float * values, int n, signed char * q, float * residual);
+
+#endif /* QUANTIZE_H_ */
@@ -0,0 +1,554 @@
+#include "reader.h"
+#include "decompress.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// Waits for free space in the ring and returns the contiguous part of it
+static size_t ringFree(Reader * r, char ** dst) {
+	pthread_mutex_lock(&r->mutex);
+	while (!r->stop && r->head - r->tail == READ_AHEAD_SIZE)
+		pthread_cond_wait(&r->cond, &r->mutex);
+	size_t used = r->head - r->tail;
+	int stop = r->stop;
+	pthread_mutex_unlock(&r->mutex);
+	if (stop)
+		return 0;
+	size_t at = r->head % READ_AHEAD_SIZE;
+	size_t size = READ_AHEAD_SIZE - used;
+	if (size > READ_AHEAD_SIZE - at)
+		size = READ_AHEAD_SIZE - at;
+	if (size > READ_CHUNK_SIZE)
+		size = READ_CHUNK_SIZE;
+	*dst = r->ring + at;
+	return size;
+}
+
+static void ringCommit(Reader * r, size_t size) {
+	pthread_mutex_lock(&r->mutex);
+	r->head += size;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+}
+
+// Same semantics as read(), a short count only happens at the end
+static ssize_t ringRead(Reader * r, char * dst, size_t size) {
+	size_t done = 0;
+	pthread_mutex_lock(&r->mutex);
+	while (done < size) {
+		while (r->head == r->tail && !r->eof)
+			pthread_cond_wait(&r->cond, &r->mutex);
+		size_t avail = r->head - r->tail;
+		if (avail == 0)
+			break;
+		size_t at = r->tail % READ_AHEAD_SIZE;
+		size_t n = size - done;
+		if (n > avail)
+			n = avail;
+		if (n > READ_AHEAD_SIZE - at)
+			n = READ_AHEAD_SIZE - at;
+		pthread_mutex_unlock(&r->mutex);
+		memcpy(dst + done, r->ring + at, n);
+		pthread_mutex_lock(&r->mutex);
+		r->tail += n;
+		done += n;
+		pthread_cond_broadcast(&r->cond);
+	}
+	pthread_mutex_unlock(&r->mutex);
+	return done;
+}
+
+static void *ReadAheadThread(void * arg) {
+	Reader * r = (Reader *) arg;
+	while (1) {
+		char * dst;
+		size_t size = ringFree(r, &dst);
+		if (size == 0)
+			break;
+		ssize_t rd;
+		if (r->decoder != NULL)
+			rd = decompressorRead(r->decoder, dst, size);
+		else while ((rd = read(r->fd, dst, size)) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("read");
+			abort();
+		}
+		if (rd == 0)
+			break;
+		ringCommit(r, rd);
+	}
+	pthread_mutex_lock(&r->mutex);
+	r->eof = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+	return NULL;
+}
+
+// Refills the block from cur_pos on
+static void fillBuffer(Reader * r) {
+	ssize_t rd = ringRead(r, &(r->buf[r->cur_pos]), READ_BLOCK_SIZE - r->cur_pos);
+	r->cur_end = r->cur_pos + rd;
+	if (rd != READ_BLOCK_SIZE - r->cur_pos)
+		r->buf[r->cur_pos + rd] = '\0';
+}
+
+// Either the byte offset (at >= 0) or the fraction of the file, compressed
+// files end at the member / frame at the end fraction
+static Reader * openReader(const char * path, double fraction, double end, long long at) {
+	Reader * r = new Reader;
+	r->fd = open(path, O_RDONLY);
+	if (r->fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	int format = inputFormat(path);
+	r->decoder = NULL;
+	r->block_start = 0;
+	if (format != FORMAT_PLAIN) {
+		// Compressed streams cannot seek, decoding starts at the next frame
+		if (at >= 0) {
+			printf("%s is compressed, it cannot be read from a byte offset\n", path);
+			exit(1);
+		}
+		r->decoder = decompressorOpen(r->fd, format, fraction, end);
+	} else {
+		off_t size = lseek(r->fd, 0, SEEK_END);
+		off_t start = at >= 0 ? (off_t) at : (off_t) (size * fraction);
+		if (lseek(r->fd, start, SEEK_SET) < 0)
+			perror("lseek");
+		posix_fadvise(r->fd, start, 0, POSIX_FADV_SEQUENTIAL);
+		r->block_start = start;
+	}
+
+	if (posix_memalign((void**) &r->buf, 4096, READ_BLOCK_SIZE + READ_BLOCK_PADDING) != 0
+			|| posix_memalign((void**) &r->ring, 4096, READ_AHEAD_SIZE) != 0) {
+		perror("posix_memalign");
+		exit(1);
+	}
+	memset(r->buf + READ_BLOCK_SIZE, 0, READ_BLOCK_PADDING);
+	r->head = r->tail = 0;
+	r->eof = r->stop = 0;
+	pthread_mutex_init(&r->mutex, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	pthread_create(&r->thread, NULL, ReadAheadThread, r);
+
+	r->end_flag = 0;
+	r->pending_eol = 0;
+	r->cur_pos = 0;
+	r->cur_end = 0;
+	r->scalar = 0;
+	r->word[0] = 0;
+	r->hash = 0;
+	r->length = 0;
+	r->tokens = 0;
+	r->token_limit = ~0ULL;
+	fillBuffer(r);
+	return r;
+}
+
+Reader * readerOpen(const char * path, double offset) {
+	return openReader(path, offset, 1, -1);
+}
+
+Reader * readerOpenRange(const char * path, double first, double last) {
+	return openReader(path, first, last, -1);
+}
+
+Reader * readerOpenAt(const char * path, unsigned long long offset, unsigned long long token_limit) {
+	Reader * r = openReader(path, 0, 1, offset);
+	r->token_limit = token_limit;
+	return r;
+}
+
+// A token cut at the block end leaves cur_pos one past it
+unsigned long long readerOffset(Reader * r) {
+	return r->block_start + (r->cur_pos < READ_BLOCK_SIZE ? r->cur_pos : READ_BLOCK_SIZE);
+}
+
+void readerClose(Reader * r) {
+	pthread_mutex_lock(&r->mutex);
+	r->stop = 1;
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->mutex);
+	pthread_join(r->thread, NULL);
+	if (r->decoder != NULL)
+		decompressorClose(r->decoder);
+	close(r->fd);
+	pthread_mutex_destroy(&r->mutex);
+	pthread_cond_destroy(&r->cond);
+	free(r->ring);
+	free(r->buf);
+	delete r;
+}
+
+#define isdelim(c) (((c) == ' ')  | ((c) == '\t') | ((c) == '\n') | ((c) == '\r'))
+
+// Position of the first delimiter or NUL at or after pos. The zero padding
+// after the block stops the scan at READ_BLOCK_SIZE at the latest.
+static inline ssize_t scanToken(const char * buf, ssize_t pos) {
+#if defined(__AVX2__)
+	const __m256i space = _mm256_set1_epi8(' '), tab = _mm256_set1_epi8('\t');
+	const __m256i nl = _mm256_set1_epi8('\n'), cr = _mm256_set1_epi8('\r');
+	const __m256i zero = _mm256_setzero_si256();
+	while (1) {
+		__m256i v = _mm256_loadu_si256((const __m256i *) (buf + pos));
+		__m256i hit = _mm256_or_si256(
+				_mm256_or_si256(_mm256_cmpeq_epi8(v, space), _mm256_cmpeq_epi8(v, tab)),
+				_mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(v, nl), _mm256_cmpeq_epi8(v, cr)),
+						_mm256_cmpeq_epi8(v, zero)));
+		unsigned int mask = _mm256_movemask_epi8(hit);
+		if (mask)
+			return pos + __builtin_ctz(mask);
+		pos += 32;
+	}
+#elif defined(__SSE2__)
+	const __m128i space = _mm_set1_epi8(' '), tab = _mm_set1_epi8('\t');
+	const __m128i nl = _mm_set1_epi8('\n'), cr = _mm_set1_epi8('\r');
+	const __m128i zero = _mm_setzero_si128();
+	while (1) {
+		__m128i v = _mm_loadu_si128((const __m128i *) (buf + pos));
+		__m128i hit = _mm_or_si128(
+				_mm_or_si128(_mm_cmpeq_epi8(v, space), _mm_cmpeq_epi8(v, tab)),
+				_mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, nl), _mm_cmpeq_epi8(v, cr)),
+						_mm_cmpeq_epi8(v, zero)));
+		unsigned int mask = _mm_movemask_epi8(hit);
+		if (mask)
+			return pos + __builtin_ctz(mask);
+		pos += 16;
+	}
+#else
+	while (!isdelim(buf[pos]) && buf[pos])
+		pos++;
+	return pos;
+#endif
+}
+
+static void endOfSentence(Reader * r) {
+	strcpy(r->word, "</s>");
+	r->hash = 0;
+	for (r->length = 0; r->word[r->length]; r->length++)
+		r->hash = r->hash * 257 + r->word[r->length];
+}
+
+void readerReadWord(Reader * r) {
+	char * buf = r->buf;
+
+	if (r->tokens == r->token_limit) {
+		r->end_flag = 1;
+		return;
+	}
+	if (r->pending_eol) {
+		r->pending_eol = 0;
+		endOfSentence(r);
+		r->tokens++;
+		return;
+	}
+
+	if (r->cur_pos >= READ_BLOCK_SIZE) {
+		r->cur_pos = 0;
+		r->block_start += READ_BLOCK_SIZE;
+		fillBuffer(r);
+	} else if (r->cur_pos >= r->cur_end) { // EOF
+		r->end_flag = 1;
+		return;
+	}
+
+	// look for start of token (first non-whitespace character)
+	while (isdelim(buf[r->cur_pos]) && buf[r->cur_pos]) {
+		int eol = buf[r->cur_pos] == '\n';
+		r->cur_pos++;
+		if (r->cur_pos >= READ_BLOCK_SIZE) {
+			r->cur_pos = 0;
+			r->block_start += READ_BLOCK_SIZE;
+			fillBuffer(r);
+		}
+		if (eol) {
+			endOfSentence(r);
+			r->tokens++;
+			return;
+		}
+	}
+
+	ssize_t ptmp = r->cur_pos; // need to rember start of token
+
+	while (1) { // scan for end of token
+		if (r->scalar) {
+			while (!isdelim(buf[r->cur_pos]) && buf[r->cur_pos])
+				r->cur_pos++;
+		} else
+			r->cur_pos = scanToken(buf, r->cur_pos);
+		// A token filling the whole block is cut
+		if (r->cur_pos < READ_BLOCK_SIZE || ptmp == 0)
+			break;
+		// copy already looked at part to begining
+		// should never overlap, at least for tokens shorter than READ_BLOCK_SIZE/2
+		memcpy(buf, &(buf[ptmp]), sizeof(char) * (READ_BLOCK_SIZE - ptmp));
+
+		r->cur_pos = READ_BLOCK_SIZE - ptmp;
+		r->block_start += ptmp;
+		ptmp = 0;
+		fillBuffer(r);
+	}
+
+	ssize_t wordlen = (r->cur_pos - ptmp);
+	if (wordlen >= MAX_STRING)
+		wordlen = MAX_STRING - 1;
+
+	r->pending_eol = buf[r->cur_pos] == '\n';
+	buf[r->cur_pos] = '\0'; // replace space with null
+	// The hash is computed while copying, lookups do not walk the word again
+	unsigned int hash = 0;
+	for (ssize_t a = 0; a < wordlen; a++) {
+		char c = buf[ptmp + a];
+		r->word[a] = c;
+		hash = hash * 257 + c;
+	}
+	r->word[wordlen] = '\0';
+	r->hash = hash;
+	r->length = wordlen;
+	r->cur_pos++;
+	r->tokens++;
+}
+
+// The tokenizer of the original port, buffered_readWord() with the </s> of
+// newlines, kept as the reference of readerReadWord(). It moves a token cut
+// by the block end with memcpy and cannot read one longer than its block,
+// the block is far longer than the tokens of the fixtures.
+#define REFERENCE_BLOCK_SIZE 65536
+
+struct ReferenceTokenizer {
+	int fd;
+	char * buf;
+	ssize_t cur_pos, cur_end;
+	int end_flag;
+	int pending_eol;
+	char word[MAX_STRING];
+};
+
+static void referenceFill(ReferenceTokenizer * t) {
+	ssize_t rd = 0;
+	while ((rd = read(t->fd, &(t->buf[t->cur_pos]), REFERENCE_BLOCK_SIZE - t->cur_pos)) < 0) {
+		if (errno == EINTR)
+			continue;
+		perror("read");
+		abort();
+	}
+	t->cur_end = t->cur_pos + rd;
+	if (rd != REFERENCE_BLOCK_SIZE - t->cur_pos)
+		t->buf[t->cur_pos + rd] = '\0';
+}
+
+static void referenceReadWord(ReferenceTokenizer * t) {
+	char * buf = t->buf;
+
+	if (t->pending_eol) {
+		t->pending_eol = 0;
+		strcpy(t->word, "</s>");
+		return;
+	}
+
+	if (t->cur_pos >= REFERENCE_BLOCK_SIZE) {
+		t->cur_pos = 0;
+		referenceFill(t);
+	} else if (t->cur_pos >= t->cur_end) { // EOF
+		t->end_flag = 1;
+		return;
+	}
+
+	// look for start of token (first non-whitespace character)
+	while (isdelim(buf[t->cur_pos]) && buf[t->cur_pos]) {
+		int eol = buf[t->cur_pos] == '\n';
+		t->cur_pos++;
+		if (t->cur_pos >= REFERENCE_BLOCK_SIZE) {
+			t->cur_pos = 0;
+			referenceFill(t);
+		}
+		if (eol) {
+			strcpy(t->word, "</s>");
+			return;
+		}
+	}
+
+	ssize_t ptmp = t->cur_pos; // need to rember start of token
+
+	while (!isdelim(buf[t->cur_pos]) && buf[t->cur_pos]) { // scan for end of token
+		t->cur_pos++;
+		if (t->cur_pos >= REFERENCE_BLOCK_SIZE) {
+			// copy already looked at part to begining
+			memcpy(buf, &(buf[ptmp]), sizeof(char) * (REFERENCE_BLOCK_SIZE - ptmp));
+			t->cur_pos = REFERENCE_BLOCK_SIZE - ptmp;
+			ptmp = 0;
+			referenceFill(t);
+		}
+	}
+
+	ssize_t wordlen = (t->cur_pos - ptmp);
+	if (wordlen >= MAX_STRING)
+		wordlen = MAX_STRING - 1;
+
+	t->pending_eol = buf[t->cur_pos] == '\n';
+	buf[t->cur_pos] = '\0'; // replace space with null
+	memcpy(t->word, &(buf[ptmp]), wordlen);
+	t->word[wordlen] = '\0';
+	t->cur_pos++;
+}
+
+static ReferenceTokenizer * referenceOpen(const char * path) {
+	ReferenceTokenizer * t = new ReferenceTokenizer;
+	t->fd = open(path, O_RDONLY);
+	if (t->fd == -1) {
+		perror("open");
+		exit(1);
+	}
+	t->buf = (char *) malloc(REFERENCE_BLOCK_SIZE);
+	t->cur_pos = t->cur_end = 0;
+	t->end_flag = t->pending_eol = 0;
+	t->word[0] = 0;
+	referenceFill(t);
+	return t;
+}
+
+static void referenceClose(ReferenceTokenizer * t) {
+	close(t->fd);
+	free(t->buf);
+	delete t;
+}
+
+// The hash and length the reader returned belong to its word
+static int readerConsistent(const Reader * r) {
+	unsigned int hash = 0;
+	int length = strlen(r->word);
+	for (int a = 0; a < length; a++)
+		hash = hash * 257 + r->word[a];
+	return r->hash == hash && r->length == length;
+}
+
+// Tokenizes the file with the vector and the scalar scanner and, if given the
+// expected tokens or asked to, the reference tokenizer. Returns 0 if all agree.
+static int compareTokenizers(const char * path, const char * name, int reference,
+		const std::vector<std::string> * expected) {
+	Reader * vector = readerOpen(path, 0);
+	Reader * scalar = readerOpen(path, 0);
+	scalar->scalar = 1;
+	ReferenceTokenizer * ref = reference ? referenceOpen(path) : NULL;
+	long long tokens = 0;
+	int bad = 0;
+	const char * want = NULL;
+	while (!bad) {
+		readerReadWord(vector);
+		readerReadWord(scalar);
+		int want_end = 0;
+		if (ref != NULL) {
+			referenceReadWord(ref);
+			want_end = ref->end_flag;
+			want = ref->word;
+		} else if (expected != NULL) {
+			want_end = tokens >= (long long) expected->size();
+			want = want_end ? NULL : (*expected)[tokens].c_str();
+		} else {
+			want_end = scalar->end_flag;
+			want = scalar->word;
+		}
+		if (vector->end_flag || scalar->end_flag || want_end) {
+			bad = vector->end_flag != want_end || scalar->end_flag != want_end;
+			break;
+		}
+		bad = strcmp(vector->word, want) || strcmp(scalar->word, want) || !readerConsistent(vector)
+				|| !readerConsistent(scalar);
+		tokens++;
+	}
+	if (bad)
+		printf("Tokenizer mismatch in %s at token %lld: \"%.40s\" (hash %u) and \"%.40s\" (hash %u) instead of \"%.40s\"\n",
+				name, tokens, vector->end_flag ? "<eof>" : vector->word, vector->hash,
+				scalar->end_flag ? "<eof>" : scalar->word, scalar->hash, want == NULL ? "<eof>" : want);
+	else
+		printf("Tokenizers agree on %lld tokens of %s\n", tokens, name);
+	readerClose(vector);
+	readerClose(scalar);
+	if (ref != NULL)
+		referenceClose(ref);
+	return bad;
+}
+
+// Appends words and spaces up to the given length
+static void fillText(std::string * text, size_t length) {
+	static const char * words[] = { "a", "of", "the", "word", "vector", "sentence", "tokenizer" };
+	for (int w = 0; text->size() < length; w = (w + 1) % 7) {
+		text->append(words[w]);
+		text->append(w == 6 ? "\n" : " ");
+	}
+	text->resize(length, ' ');
+}
+
+static int checkFixture(const char * name, const std::string & text,
+		const std::vector<std::string> * expected) {
+	char path[] = "/tmp/w2v-tokenizer-XXXXXX";
+	int fd = mkstemp(path);
+	if (fd == -1 || write(fd, text.data(), text.size()) != (ssize_t) text.size()) {
+		perror("fixture");
+		exit(1);
+	}
+	close(fd);
+	int bad = compareTokenizers(path, name, expected == NULL, expected);
+	unlink(path);
+	return bad;
+}
+
+// Fixtures for the corners of the block handling, compared with the reference
+static int checkFixtures() {
+	int bad = 0;
+	std::string text;
+	bad |= checkFixture("plain lines", "the quick brown fox\njumps over the lazy dog\n", NULL);
+	bad |= checkFixture("leading blank lines", "\n\n  \n\tword one\n", NULL);
+	bad |= checkFixture("\\r\\n line ends", "first line\r\nsecond line\r\n\r\nthird", NULL);
+	bad |= checkFixture("embedded NUL", std::string("a\0b c\0\0d\n\0", 10), NULL);
+	bad |= checkFixture("no trailing newline", "the last line ends without one", NULL);
+	bad |= checkFixture("trailing blanks", "words then blanks \t  ", NULL);
+	text = "short " + std::string(MAX_STRING - 1, 'y') + " " + std::string(MAX_STRING, 'y') + " "
+			+ std::string(3000, 'z') + "\nend\n";
+	bad |= checkFixture("overlong tokens", text, NULL);
+
+	// A token across the first block end, an end of line as the last byte of
+	// the second block and as the first byte of the third one, an overlong
+	// token across the fourth block end
+	text.clear();
+	fillText(&text, READ_BLOCK_SIZE - 4);
+	text += "crossing the edge\n";
+	fillText(&text, 2 * READ_BLOCK_SIZE - 5);
+	text += "last\n";
+	fillText(&text, 3 * READ_BLOCK_SIZE - 6);
+	text += " first\nline\n";
+	fillText(&text, 4 * READ_BLOCK_SIZE - 1000);
+	text += std::string(2000, 'o') + "\r\n";
+	fillText(&text, 4 * READ_BLOCK_SIZE + 5000);
+	bad |= checkFixture("block edges", text, NULL);
+
+	// A token filling a whole block is cut there, the rest is the next token.
+	// The reference cannot read it, the tokens are pinned instead.
+	std::vector<std::string> expected;
+	expected.push_back("a");
+	expected.push_back(std::string(MAX_STRING - 1, 'x'));
+	expected.push_back(std::string(10, 'x'));
+	expected.push_back("b");
+	expected.push_back("</s>");
+	text = "a " + std::string(READ_BLOCK_SIZE + 10, 'x') + " b\n";
+	bad |= checkFixture("token longer than a block", text, &expected);
+	return bad;
+}
+
+int readerSelfCheck(const char * path) {
+	int bad = checkFixtures();
+	if (path[0])
+		bad |= compareTokenizers(path, path, 0, NULL);
+	printf("%s\n", bad ? "Tokenizers differ" : "Tokenizers agree");
+	return bad;
+}
@@ -0,0 +1,75 @@
+/*
+ * reader.h
+ *
+ *  Tokenizer over the training file. Every reader owns an I/O thread that
+ *  reads (or decompresses) the file in large chunks into a read-ahead ring,
+ *  so the thread feeding a device only tokenizes data already in memory.
+ */
+
+#ifndef READER_H_
+#define READER_H_
+
+#include <pthread.h>
+#include <sys/types.h>
+#include "cbow.h"
+
+// Block the tokenizer scans, tokens longer than half of it are cut
+#define READ_BLOCK_SIZE (1 << 20)
+// Data the I/O thread keeps ahead of the tokenizer
+#define READ_AHEAD_SIZE (16 << 20)
+// Largest single read() of the I/O thread
+#define READ_CHUNK_SIZE (4 << 20)
+// Zero bytes after the block, vector loads of the scanner may run into them
+#define READ_BLOCK_PADDING 64
+
+struct Decompressor;
+
+struct Reader {
+	int fd;
+	Decompressor * decoder;
+
+	// Read-ahead ring, head and tail count bytes since the start
+	char * ring;
+	unsigned long long head, tail;
+	int eof, stop;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_t thread;
+
+	// Tokenizer state. block_start is the file offset of buf[0] (for plain
+	// files), tokens counts the tokens returned so far.
+	char * buf;
+	ssize_t cur_pos, cur_end;
+	unsigned long long block_start;
+	unsigned long long tokens, token_limit;
+	int end_flag;
+	// The last token ended at a newline, </s> is returned next
+	int pending_eol;
+	// Byte by byte scanning, the reference of the vector scanner
+	int scalar;
+	char word[MAX_STRING];
+	// hash * 257 + c over the bytes of word, see GetWordHash()
+	unsigned int hash;
+	int length;
+};
+
+// Starts reading at offset * file size, compressed files at the next frame
+Reader * readerOpen(const char * path, double offset);
+// Compressed files: reads the frames from first * file size up to the frame
+// at last * file size, all of them if there is no frame after the start.
+// Plain files are read from first on to the end, as by readerOpen().
+Reader * readerOpenRange(const char * path, double first, double last);
+// Plain files: starts at the byte offset and ends after token_limit tokens
+Reader * readerOpenAt(const char * path, unsigned long long offset, unsigned long long token_limit);
+// File offset of the next byte the tokenizer looks at
+unsigned long long readerOffset(Reader * reader);
+void readerClose(Reader * reader);
+// Next token into reader->word with its hash and length, newlines are
+// returned as </s>. Sets reader->end_flag at the end of the file.
+void readerReadWord(Reader * reader);
+// Compares the vector and the scalar scanner with the original tokenizer on
+// fixtures for the block handling, then with each other on the file if the
+// path is not empty. Returns 0 if they agree.
+int readerSelfCheck(const char * path);
+
+#endif /* READER_H_ */
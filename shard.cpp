@@ -0,0 +1,165 @@
+#include "shard.h"
+#include "profiler.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+static std::vector<ShardPoint> points;
+static int indexing = 0;
+// Tokens between points, and at which the next point is due
+static unsigned long long spacing, next_point;
+
+void shardIndexBegin(Reader * reader) {
+	points.clear();
+	indexing = reader->decoder == NULL;
+	if (!indexing)
+		return;
+	ShardPoint p = { readerOffset(reader), reader->tokens };
+	points.push_back(p);
+	spacing = SHARD_INDEX_TOKENS;
+	next_point = p.tokens + spacing;
+}
+
+// After a word followed by a newline the reader still owes the </s>, a
+// reader started behind the newline would skip it
+void shardIndexNote(Reader * reader) {
+	if (reader->tokens < next_point || !indexing || reader->pending_eol)
+		return;
+	ShardPoint p = { readerOffset(reader), reader->tokens };
+	points.push_back(p);
+	if (points.size() == SHARD_INDEX_POINTS) {
+		for (size_t i = 0; 2 * i < points.size(); i++)
+			points[i] = points[2 * i];
+		points.resize((points.size() + 1) / 2);
+		spacing *= 2;
+	}
+	next_point = points.back().tokens + spacing;
+}
+
+void shardIndexEnd(Reader * reader) {
+	if (!indexing)
+		return;
+	if (points.back().tokens < reader->tokens) {
+		ShardPoint p = { readerOffset(reader), reader->tokens };
+		points.push_back(p);
+	}
+	indexing = 0;
+}
+
+int shardIndexReady() {
+	return points.size() >= 2;
+}
+
+unsigned long long shardIndexSize() {
+	return points.size();
+}
+
+const ShardPoint * shardIndexPoints() {
+	return points.empty() ? NULL : &points[0];
+}
+
+void shardIndexLoad(const ShardPoint * p, unsigned long long n) {
+	points.assign(p, p + n);
+}
+
+// The point closest to the fraction of the tokens
+static ShardPoint snap(double fraction) {
+	unsigned long long total = points.back().tokens;
+	if (fraction <= 0)
+		return points.front();
+	if (fraction >= 1)
+		return points.back();
+	unsigned long long target = (unsigned long long) (fraction * total + 0.5);
+	size_t lo = 0, hi = points.size() - 1;
+	// points[lo].tokens <= target < points[hi].tokens
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+		if (points[mid].tokens <= target)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return target - points[lo].tokens <= points[hi].tokens - target ? points[lo] : points[hi];
+}
+
+int shardRange(double first, double last, ShardRange * range) {
+	if (!shardIndexReady())
+		return 0;
+	range->first = snap(first);
+	range->last = snap(last);
+	if (range->last.tokens < range->first.tokens)
+		range->last = range->first;
+	return 1;
+}
+
+Reader * shardOpen(const char * path, const ShardRange * range) {
+	return readerOpenAt(path, range->first.offset, range->last.tokens - range->first.tokens);
+}
+
+static unsigned long long mixToken(unsigned long long sum, const Reader * reader) {
+	return (sum ^ reader->hash ^ ((unsigned long long) reader->length << 32)) * 0x100000001B3ULL;
+}
+
+int shardSelfCheck(const char * path, int parts) {
+	unsigned long long start = monotonicNs();
+	Reader * reader = readerOpen(path, 0);
+	if (reader->decoder != NULL) {
+		printf("%s is compressed, only plain files are indexed\n", path);
+		readerClose(reader);
+		return 1;
+	}
+	shardIndexBegin(reader);
+	while (1) {
+		readerReadWord(reader);
+		if (reader->end_flag)
+			break;
+		shardIndexNote(reader);
+	}
+	shardIndexEnd(reader);
+	readerClose(reader);
+	if (!shardIndexReady()) {
+		printf("%s has no tokens\n", path);
+		return 1;
+	}
+	printf("Indexed %llu tokens in %llu bytes of %s: %llu points in %.2fs\n", points.back().tokens,
+			points.back().offset, path, (unsigned long long) points.size(), (monotonicNs() - start) / 1e9);
+
+	// Checksums of the parts from one pass over the whole file
+	std::vector<ShardRange> ranges(parts);
+	std::vector<unsigned long long> sums(parts, 0), counts(parts, 0);
+	for (int p = 0; p < parts; p++)
+		shardRange(p / (double) parts, (p + 1) / (double) parts, &ranges[p]);
+	reader = readerOpen(path, 0);
+	int p = 0;
+	while (1) {
+		readerReadWord(reader);
+		if (reader->end_flag)
+			break;
+		while (p < parts - 1 && reader->tokens > ranges[p].last.tokens)
+			p++;
+		sums[p] = mixToken(sums[p], reader);
+		counts[p]++;
+	}
+	readerClose(reader);
+
+	int bad = 0;
+	for (p = 0; p < parts; p++) {
+		unsigned long long sum = 0, count = 0;
+		reader = shardOpen(path, &ranges[p]);
+		while (1) {
+			readerReadWord(reader);
+			if (reader->end_flag)
+				break;
+			sum = mixToken(sum, reader);
+			count++;
+		}
+		readerClose(reader);
+		int ok = sum == sums[p] && count == counts[p];
+		printf("\tpart %d: bytes %llu-%llu, tokens %llu-%llu: %llu tokens %s\n", p, ranges[p].first.offset,
+				ranges[p].last.offset, ranges[p].first.tokens, ranges[p].last.tokens, count,
+				ok ? "agree" : "DIFFER from the whole file");
+		bad |= !ok;
+	}
+	printf("%s\n", bad ? "Shards differ from the whole file" : "Shards agree with the whole file");
+	return bad;
+}
@@ -0,0 +1,56 @@
+/*
+ * shard.h
+ *
+ *  Token aligned index of the training file. While the vocabulary is
+ *  counted, restart points (byte offset, tokens before it) are noted where
+ *  a reader can start and return exactly the tokens a pass over the whole
+ *  file would from there. They start SHARD_INDEX_TOKENS apart; once there
+ *  are SHARD_INDEX_POINTS of them every other one is dropped and the
+ *  spacing doubles, so any corpus gets evenly spread points. Process,
+ *  device and tokenizer shards then start at such points and end after an
+ *  exact number of tokens, with no gap or overlap between neighbours.
+ *
+ *  Only plain files are indexed, compressed ones are split by byte
+ *  fraction at their frames and stop after their share of the words.
+ */
+
+#ifndef SHARD_H_
+#define SHARD_H_
+
+#include "reader.h"
+
+#define SHARD_INDEX_TOKENS 4096
+#define SHARD_INDEX_POINTS 65536
+
+struct ShardPoint {
+	unsigned long long offset, tokens;
+};
+
+// Tokens [first.tokens, last.tokens) of the file, starting at byte
+// first.offset
+struct ShardRange {
+	ShardPoint first, last;
+};
+
+// Building, with the reader that counts the vocabulary. shardIndexNote()
+// is called after every token, shardIndexEnd() at the end of the file.
+void shardIndexBegin(Reader * reader);
+void shardIndexNote(Reader * reader);
+void shardIndexEnd(Reader * reader);
+int shardIndexReady();
+// The points, to save them with the vocabulary and load them back
+unsigned long long shardIndexSize();
+const ShardPoint * shardIndexPoints();
+void shardIndexLoad(const ShardPoint * points, unsigned long long n);
+
+// Fractions [first, last) of the tokens of the file, snapped to the
+// points. Returns 0 without an index.
+int shardRange(double first, double last, ShardRange * range);
+// Reader over the range, end_flag is set after its last token
+Reader * shardOpen(const char * path, const ShardRange * range);
+
+// Indexes the file, then tokenizes it in parts from the points and
+// compares them with one pass over the whole file. Returns 0 if they agree.
+int shardSelfCheck(const char * path, int parts);
+
+#endif /* SHARD_H_ */
@@ -0,0 +1,93 @@
+/*
+ * simd.h
+ *
+ *  Dot product kernels of the host side vector math (evaluation, k-means,
+ *  product quantization). Any length and alignment, AVX or SSE2 with a
+ *  scalar tail.
+ */
+
+#ifndef SIMD_H_
+#define SIMD_H_
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+#ifdef __AVX__
+static inline float simdSum(__m256 v) {
+	__m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+#elif defined(__SSE2__)
+static inline float simdSum(__m128 s) {
+	s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+	s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+	return _mm_cvtss_f32(s);
+}
+#endif
+
+static inline float simdDot(const float * a, const float * b, int n) {
+	int i = 0;
+	float sum = 0;
+#if defined(__AVX__)
+	__m256 s = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8)
+		s = _mm256_add_ps(s, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+	sum = simdSum(s);
+#elif defined(__SSE2__)
+	__m128 s = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4)
+		s = _mm_add_ps(s, _mm_mul_ps(_mm_loadu_ps(a + i), _mm_loadu_ps(b + i)));
+	sum = simdSum(s);
+#endif
+	for (; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+
+// Dot products of w with four rows of q, stride floats apart. Each load of
+// w serves four products, the tile of a blocked matrix product.
+static inline void simdDot4(const float * w, const float * q, int stride, int n, float * out) {
+	const float * q0 = q, * q1 = q + stride, * q2 = q + 2 * stride, * q3 = q + 3 * stride;
+	int i = 0;
+	out[0] = out[1] = out[2] = out[3] = 0;
+#if defined(__AVX__)
+	__m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+	__m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+	for (; i + 8 <= n; i += 8) {
+		__m256 x = _mm256_loadu_ps(w + i);
+		s0 = _mm256_add_ps(s0, _mm256_mul_ps(x, _mm256_loadu_ps(q0 + i)));
+		s1 = _mm256_add_ps(s1, _mm256_mul_ps(x, _mm256_loadu_ps(q1 + i)));
+		s2 = _mm256_add_ps(s2, _mm256_mul_ps(x, _mm256_loadu_ps(q2 + i)));
+		s3 = _mm256_add_ps(s3, _mm256_mul_ps(x, _mm256_loadu_ps(q3 + i)));
+	}
+	out[0] = simdSum(s0);
+	out[1] = simdSum(s1);
+	out[2] = simdSum(s2);
+	out[3] = simdSum(s3);
+#elif defined(__SSE2__)
+	__m128 s0 = _mm_setzero_ps(), s1 = _mm_setzero_ps();
+	__m128 s2 = _mm_setzero_ps(), s3 = _mm_setzero_ps();
+	for (; i + 4 <= n; i += 4) {
+		__m128 x = _mm_loadu_ps(w + i);
+		s0 = _mm_add_ps(s0, _mm_mul_ps(x, _mm_loadu_ps(q0 + i)));
+		s1 = _mm_add_ps(s1, _mm_mul_ps(x, _mm_loadu_ps(q1 + i)));
+		s2 = _mm_add_ps(s2, _mm_mul_ps(x, _mm_loadu_ps(q2 + i)));
+		s3 = _mm_add_ps(s3, _mm_mul_ps(x, _mm_loadu_ps(q3 + i)));
+	}
+	out[0] = simdSum(s0);
+	out[1] = simdSum(s1);
+	out[2] = simdSum(s2);
+	out[3] = simdSum(s3);
+#endif
+	for (; i < n; i++) {
+		out[0] += w[i] * q0[i];
+		out[1] += w[i] * q1[i];
+		out[2] += w[i] * q2[i];
+		out[3] += w[i] * q3[i];
+	}
+}
+
+#endif /* SIMD_H_ */
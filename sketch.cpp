@@ -0,0 +1,72 @@
+#include "sketch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+void sketchInit(CountMinSketch * s, unsigned long long bytes) {
+	s->width = 1;
+	while (s->width * 2 * SKETCH_DEPTH * sizeof(unsigned int) <= bytes)
+		s->width *= 2;
+	s->counters = (unsigned int *) calloc(s->width * SKETCH_DEPTH, sizeof(unsigned int));
+	if (s->counters == NULL) {
+		printf("Memory allocation failed\n");
+		exit(1);
+	}
+	s->tokens = 0;
+}
+
+void sketchFree(CountMinSketch * s) {
+	free(s->counters);
+	s->counters = NULL;
+}
+
+// Cells of the word, one per row, from two halves of a 64 bit FNV-1a hash
+static void sketchCells(const CountMinSketch * s, const char * word, int length,
+		unsigned long long * cells) {
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	for (int a = 0; a < length; a++)
+		h = (h ^ (unsigned char) word[a]) * 0x100000001b3ULL;
+	unsigned long long h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+	for (int r = 0; r < SKETCH_DEPTH; r++)
+		cells[r] = r * s->width + ((h1 + r * h2) & (s->width - 1));
+}
+
+// Conservative update: only the smallest counters grow
+unsigned int sketchAdd(CountMinSketch * s, const char * word, int length) {
+	unsigned long long cells[SKETCH_DEPTH];
+	sketchCells(s, word, length, cells);
+	unsigned int estimate = s->counters[cells[0]];
+	for (int r = 1; r < SKETCH_DEPTH; r++)
+		if (s->counters[cells[r]] < estimate)
+			estimate = s->counters[cells[r]];
+	if (estimate != SKETCH_MAX_COUNT)
+		estimate++;
+	for (int r = 0; r < SKETCH_DEPTH; r++)
+		if (s->counters[cells[r]] < estimate)
+			s->counters[cells[r]] = estimate;
+	s->tokens++;
+	return estimate;
+}
+
+void sketchRaise(CountMinSketch * s, const char * word, int length, unsigned int count) {
+	unsigned long long cells[SKETCH_DEPTH];
+	sketchCells(s, word, length, cells);
+	unsigned int estimate = s->counters[cells[0]];
+	for (int r = 0; r < SKETCH_DEPTH; r++) {
+		if (s->counters[cells[r]] < estimate)
+			estimate = s->counters[cells[r]];
+		if (s->counters[cells[r]] < count)
+			s->counters[cells[r]] = count;
+	}
+	// The occurrences counted exactly meanwhile join the sketch's stream
+	if (count > estimate)
+		s->tokens += count - estimate;
+}
+
+double sketchErrorBound(const CountMinSketch * s) {
+	return M_E / s->width * s->tokens;
+}
+
+double sketchConfidence() {
+	return 1 - exp(-SKETCH_DEPTH);
+}
@@ -0,0 +1,37 @@
+/*
+ * sketch.h
+ *
+ *  Count-min sketch with conservative update, counts the long tail of the
+ *  vocabulary in fixed memory. Estimates never undercount; with d rows of
+ *  w counters they overcount by at most e / w * tokens with probability
+ *  1 - e^-d.
+ */
+
+#ifndef SKETCH_H_
+#define SKETCH_H_
+
+#define SKETCH_DEPTH 4
+// Counters are 32 bits and saturate here. Only words below the promotion bar
+// live in the sketch, the exact table counts in 64 bits, so the cap is only
+// reached if that bar itself grows past 4G occurrences.
+#define SKETCH_MAX_COUNT 0xffffffffu
+
+struct CountMinSketch {
+	unsigned int * counters;
+	// Power of two
+	unsigned long long width;
+	unsigned long long tokens;
+};
+
+// Uses at most the given number of bytes
+void sketchInit(CountMinSketch * s, unsigned long long bytes);
+void sketchFree(CountMinSketch * s);
+// Counts one occurrence and returns the new estimate
+unsigned int sketchAdd(CountMinSketch * s, const char * word, int length);
+// Raises the estimate of the word to at least count, used when a counted
+// word leaves the exact table
+void sketchRaise(CountMinSketch * s, const char * word, int length, unsigned int count);
+double sketchErrorBound(const CountMinSketch * s);
+double sketchConfidence();
+
+#endif /* SKETCH_H_ */
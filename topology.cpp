@@ -0,0 +1,191 @@
+#include "topology.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include <vector>
+
+extern std::vector<GPUTrainer> gpuTrainers;
+extern int debug_mode;
+
+int numa = 1;
+
+// PCI address queries of the vendor extensions, the headers may lack them
+#ifndef CL_DEVICE_PCI_BUS_INFO_KHR
+#define CL_DEVICE_PCI_BUS_INFO_KHR 0x410F
+#endif
+#ifndef CL_DEVICE_PCI_BUS_ID_NV
+#define CL_DEVICE_PCI_BUS_ID_NV 0x4008
+#endif
+#ifndef CL_DEVICE_PCI_SLOT_ID_NV
+#define CL_DEVICE_PCI_SLOT_ID_NV 0x4009
+#endif
+#ifndef CL_DEVICE_PCI_DOMAIN_ID_NV
+#define CL_DEVICE_PCI_DOMAIN_ID_NV 0x400A
+#endif
+#ifndef CL_DEVICE_TOPOLOGY_AMD
+#define CL_DEVICE_TOPOLOGY_AMD 0x4037
+#endif
+
+struct PciBusInfo {
+	cl_uint domain, bus, device, function;
+};
+
+union AmdTopology {
+	struct { cl_uint type; cl_uint data[5]; } raw;
+	struct { cl_uint type; unsigned char unused[17]; unsigned char bus, device, function; } pcie;
+};
+
+static int num_nodes = -1;
+static cpu_set_t node_cpus[MAX_NUMA_NODES];
+static int place_failed = 0;
+
+// Reads the CPU lists of the nodes once, "0-7,16-23" style
+static int nodeCount() {
+	if (num_nodes >= 0)
+		return num_nodes;
+	num_nodes = 0;
+	for (int n = 0; n < MAX_NUMA_NODES; n++) {
+		char path[MAX_STRING], list[4096];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", n);
+		FILE * f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		CPU_ZERO(&node_cpus[n]);
+		if (fgets(list, sizeof(list), f)) {
+			char * p = list;
+			while (*p && *p != '\n') {
+				int first = strtol(p, &p, 10), last = first;
+				if (*p == '-')
+					last = strtol(p + 1, &p, 10);
+				for (int c = first; c <= last && c < CPU_SETSIZE; c++)
+					CPU_SET(c, &node_cpus[n]);
+				if (*p == ',')
+					p++;
+			}
+		}
+		fclose(f);
+		num_nodes = n + 1;
+	}
+	return num_nodes;
+}
+
+static int pciAddress(cl_device_id device, PciBusInfo * pci) {
+	if (clGetDeviceInfo(device, CL_DEVICE_PCI_BUS_INFO_KHR, sizeof(*pci), pci, NULL) == CL_SUCCESS)
+		return 1;
+	cl_uint bus, slot, domain = 0;
+	if (clGetDeviceInfo(device, CL_DEVICE_PCI_BUS_ID_NV, sizeof(bus), &bus, NULL) == CL_SUCCESS
+			&& clGetDeviceInfo(device, CL_DEVICE_PCI_SLOT_ID_NV, sizeof(slot), &slot, NULL) == CL_SUCCESS) {
+		clGetDeviceInfo(device, CL_DEVICE_PCI_DOMAIN_ID_NV, sizeof(domain), &domain, NULL);
+		pci->domain = domain;
+		pci->bus = bus;
+		pci->device = slot >> 3;
+		pci->function = slot & 7;
+		return 1;
+	}
+	AmdTopology topology;
+	if (clGetDeviceInfo(device, CL_DEVICE_TOPOLOGY_AMD, sizeof(topology), &topology, NULL) == CL_SUCCESS
+			&& topology.raw.type == 1) {
+		pci->domain = 0;
+		pci->bus = topology.pcie.bus;
+		pci->device = topology.pcie.device;
+		pci->function = topology.pcie.function;
+		return 1;
+	}
+	return 0;
+}
+
+int topologyDeviceNode(cl_device_id device) {
+	if (!numa || nodeCount() < 2)
+		return -1;
+	PciBusInfo pci;
+	if (!pciAddress(device, &pci))
+		return -1;
+	char path[MAX_STRING];
+	snprintf(path, sizeof(path), "/sys/bus/pci/devices/%04x:%02x:%02x.%x/numa_node",
+			pci.domain, pci.bus, pci.device, pci.function);
+	FILE * f = fopen(path, "r");
+	if (f == NULL)
+		return -1;
+	int node = -1;
+	if (fscanf(f, "%d", &node) != 1 || node >= MAX_NUMA_NODES)
+		node = -1;
+	fclose(f);
+	return node;
+}
+
+void topologyPinThread(int node) {
+	if (node < 0 || node >= nodeCount())
+		return;
+	pthread_setaffinity_np(pthread_self(), sizeof(cpu_set_t), &node_cpus[node]);
+}
+
+void topologyPlace(void * addr, size_t bytes, int node) {
+	if (node < 0 || addr == NULL || bytes == 0)
+		return;
+	// mbind works on whole pages
+	unsigned long page = sysconf(_SC_PAGESIZE);
+	unsigned long start = (unsigned long) addr & ~(page - 1);
+	unsigned long len = (unsigned long) addr + bytes - start;
+	unsigned long mask = 1UL << node;
+	if (syscall(SYS_mbind, start, len, MPOL_PREFERRED, &mask, MAX_NUMA_NODES + 1, MPOL_MF_MOVE) != 0
+			&& !place_failed) {
+		place_failed = 1;
+		if (debug_mode > 0)
+			perror("mbind, host buffers are not placed");
+	}
+}
+
+int topologyNodeCount() {
+	int n = 0;
+	while (topologyNode(n) >= 0)
+		n++;
+	return n;
+}
+
+// Nodes are counted in ascending order, -1 past the last one
+int topologyNode(int k) {
+	for (int node = 0; node < MAX_NUMA_NODES; node++) {
+		int used = 0;
+		for (unsigned int i = 0; i < gpuTrainers.size(); i++)
+			used |= gpuTrainers[i].getNumaNode() == node;
+		if (used && k-- == 0)
+			return node;
+	}
+	return -1;
+}
+
+void topologyRows(int k, long long rows, long long * first, long long * last) {
+	int n = topologyNodeCount();
+	if (n == 0)
+		n = 1;
+	*first = rows * k / n;
+	*last = rows * (k + 1) / n;
+}
+
+void topologyReport() {
+	if (debug_mode == 0 || nodeCount() < 2)
+		return;
+	printf("NUMA: %d nodes, placement %s\n", nodeCount(), numa ? "on" : "off");
+	for (unsigned int i = 0; i < gpuTrainers.size(); i++) {
+		int node = gpuTrainers[i].getNumaNode();
+		if (node >= 0)
+			printf("\tdevice %d (%s): node %d, %d CPUs\n", i, gpuTrainers[i].getDeviceName(), node,
+					CPU_COUNT(&node_cpus[node]));
+		else
+			printf("\tdevice %d (%s): node unknown, not pinned\n", i, gpuTrainers[i].getDeviceName());
+	}
+}
+
+// Compare runs with -numa 1 and -numa 0 to see the effect of the placement
+void topologyReport(unsigned long long words, double elapsed) {
+	if (nodeCount() < 2)
+		return;
+	printf("NUMA placement %s over %d of %d nodes: %.2fk words/sec\n", numa ? "on" : "off",
+			topologyNodeCount(), nodeCount(), words / elapsed / 1000);
+	fflush(stdout);
+}
@@ -0,0 +1,36 @@
+/*
+ * topology.h
+ *
+ *  NUMA placement on multi-socket hosts. Every device is mapped to the node
+ *  of its PCIe root through sysfs, its feeder thread is pinned to the CPUs of
+ *  that node and its host buffers are placed there. The host model is split
+ *  in row ranges over the nodes that have devices, each range is averaged
+ *  by a thread of its node.
+ */
+
+#ifndef TOPOLOGY_H_
+#define TOPOLOGY_H_
+
+#include "cbow.h"
+
+// Nodes the CPU masks and placements can address
+#define MAX_NUMA_NODES 64
+
+extern int numa;
+
+// Node of the device, -1 if unknown, placement is off or there is one node
+int topologyDeviceNode(cl_device_id device);
+void topologyPinThread(int node);
+// Moves the pages of the range to the node, a no-op for node -1
+void topologyPlace(void * addr, size_t bytes, int node);
+
+// Nodes that have devices, the host model is split over them
+int topologyNodeCount();
+int topologyNode(int k);
+// Rows of the host model placed on the k-th of those nodes
+void topologyRows(int k, long long rows, long long * first, long long * last);
+
+void topologyReport();
+void topologyReport(unsigned long long words, double elapsed);
+
+#endif /* TOPOLOGY_H_ */
@@ -1,18 +1,171 @@
 #define EXP_TABLE_SIZE 1000
 #define MAX_EXP 6
-#define MAX_SENTENCE_LENGTH 102400
 #define MAX_CODE_LENGTH 40
-#define MAX_SENTENCE_NUM 6
 #define ALIGNMENT_FACTOR 32
-#define THREADS_PER_WORD 128
-#define BLOCK_SIZE 128
+// THREADS_PER_WORD, BLOCK_SIZE and SCAN_BLOCK are set by the host as build
+// options, see GPUTrainer::buildProgram
 
-kernel void device_memset(global float * array, int size){
-	int idx = get_global_id(0);
+kernel void device_memset(global float * array, long size){
+	long idx = get_global_id(0);
 	if (idx < size)
 		array[idx] = 0;
 }
 
+kernel void device_add(global float * array, global const float * delta, long size){
+	long idx = get_global_id(0);
+	if (idx < size)
+		array[idx] += delta[idx];
+}
+
+// Quantized sync, one SCAN_BLOCK work group per row: the change of the row
+// since the last sync, plus what its last quantization left out when error
+// is given, as signed bytes times the largest magnitude / 127. Bytes are
+// packed layer1_size per row.
+kernel void device_quantize_delta(global const float * model, global const float * ref, global float * error,
+		int layer1_size, int layer1_size_aligned, global char * q, global float * scale){
+	local float tmp[SCAN_BLOCK];
+	int row = get_group_id(0);
+	int lid = get_local_id(0);
+	global const float * m = model + (long) row * layer1_size_aligned;
+	global const float * r = ref + (long) row * layer1_size_aligned;
+	global float * e = error ? error + (long) row * layer1_size_aligned : 0;
+	float largest = 0;
+	for (int b = lid; b < layer1_size; b += SCAN_BLOCK)
+		largest = fmax(largest, fabs(m[b] - r[b] + (e ? e[b] : 0)));
+	tmp[lid] = largest;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset = SCAN_BLOCK / 2; offset > 0; offset >>= 1) {
+		if (lid < offset)
+			tmp[lid] = fmax(tmp[lid], tmp[lid + offset]);
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	float s = tmp[0] / 127;
+	for (int b = lid; b < layer1_size; b += SCAN_BLOCK) {
+		float d = m[b] - r[b] + (e ? e[b] : 0);
+		char v = s > 0 ? convert_char_sat_rte(d / s) : 0;
+		q[(long) row * layer1_size + b] = v;
+		if (e)
+			e[b] = d - v * s;
+	}
+	if (lid == 0)
+		scale[row] = s;
+}
+
+// Quantized sync, the other way: adds the averaged change to the model the
+// devices got last time, which becomes the model and the new reference
+kernel void device_apply_delta(global float * model, global float * ref, global const char * q,
+		global const float * scale, int layer1_size, int layer1_size_aligned, long size){
+	long idx = get_global_id(0);
+	if (idx >= size)
+		return;
+	long row = idx / layer1_size_aligned;
+	int b = idx - row * layer1_size_aligned;
+	if (b >= layer1_size)
+		return;
+	float v = ref[idx] + q[row * layer1_size + b] * scale[row];
+	model[idx] = v;
+	ref[idx] = v;
+}
+
+
+// Counter based random number for the subsampling decision of one token
+uint hashRandom(uint seed, uint index){
+	uint h = seed ^ (index * 0x9E3779B9u);
+	h ^= h >> 16;
+	h *= 0x85EBCA6Bu;
+	h ^= h >> 13;
+	h *= 0xC2B2AE35u;
+	h ^= h >> 16;
+	return h;
+}
+
+// The subsampling randomly discards frequent words while keeping the ranking same
+int subsampleKeep(global int * d_sen, int ntokens, global float * d_keep, uint seed, int pos){
+	if (pos >= ntokens)
+		return 0;
+	float ran = d_keep[d_sen[pos]];
+	return ran >= (hashRandom(seed, pos) & 0xFFFF) / (float) 65536;
+}
+
+// Inclusive scan of one value per work item over a SCAN_BLOCK work group
+int scanBlock(local int * tmp, int value){
+	int lid = get_local_id(0);
+	tmp[lid] = value;
+	barrier(CLK_LOCAL_MEM_FENCE);
+	for (int offset = 1; offset < SCAN_BLOCK; offset <<= 1) {
+		int add = lid >= offset ? tmp[lid - offset] : 0;
+		barrier(CLK_LOCAL_MEM_FENCE);
+		tmp[lid] += add;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	return tmp[lid];
+}
+
+// Subsampling step 1: number of surviving tokens per SCAN_BLOCK slice of raw ids
+kernel void device_subsample_count(global int * d_sen, int ntokens, global float * d_keep, uint seed,
+		global int * d_block_sum){
+	local int tmp[SCAN_BLOCK];
+	int gid = get_global_id(0);
+	int keep = subsampleKeep(d_sen, ntokens, d_keep, seed, gid);
+	int total = scanBlock(tmp, keep);
+	if (get_local_id(0) == SCAN_BLOCK - 1)
+		d_block_sum[get_group_id(0)] = total;
+}
+
+// Subsampling step 2: a single work group turns the slice counts into output
+// offsets and stores the number of surviving tokens
+kernel void device_subsample_scan(global int * d_block_sum, int nblocks, global int * d_count){
+	local int tmp[SCAN_BLOCK];
+	int lid = get_local_id(0);
+	int carry = 0;
+	for (int base = 0; base < nblocks; base += SCAN_BLOCK) {
+		int value = base + lid < nblocks ? d_block_sum[base + lid] : 0;
+		int inclusive = scanBlock(tmp, value);
+		if (base + lid < nblocks)
+			d_block_sum[base + lid] = carry + inclusive - value;
+		carry += tmp[SCAN_BLOCK - 1];
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+	if (lid == 0)
+		d_count[0] = carry;
+}
+
+// Subsampling step 3: scatter the surviving ids and remember where every raw
+// position landed, so that sentence offsets can be translated
+kernel void device_subsample_compact(global int * d_sen, int ntokens, global float * d_keep, uint seed,
+		global int * d_block_sum, global int * d_words, global int * d_position){
+	local int tmp[SCAN_BLOCK];
+	int gid = get_global_id(0);
+	int keep = subsampleKeep(d_sen, ntokens, d_keep, seed, gid);
+	int exclusive = d_block_sum[get_group_id(0)] + scanBlock(tmp, keep) - keep;
+	if (gid < ntokens)
+		d_position[gid] = exclusive;
+	if (keep)
+		d_words[exclusive] = d_sen[gid];
+}
+
+// Subsampling step 4: sentence offsets of the compacted batch
+kernel void device_subsample_offsets(global int * d_sen_offsets, int sentence_num, int ntokens,
+		global int * d_position, global int * d_count, global int * d_offsets){
+	int s = get_global_id(0);
+	if (s > sentence_num)
+		return;
+	int raw = d_sen_offsets[s];
+	d_offsets[s] = raw < ntokens ? d_position[raw] : d_count[0];
+}
+
+// Index of the sentence holding a token: last s with d_offsets[s] <= position
+int findSentence(global int * d_offsets, int sentence_num, int position){
+	int lo = 0, hi = sentence_num;
+	while (hi - lo > 1) {
+		int mid = (lo + hi) / 2;
+		if (d_offsets[mid] <= position)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	return lo;
+}
 
 void reduceInWarp(volatile local float * f, int idInWarp){
 
@@ -51,14 +204,14 @@ void reduceInWarp64(volatile local float * f, int idInWarp){
 	}
 }
 
-kernel void device_cbow(int sentence_num, int layer1_size, int layer1_size_aligned,
+kernel void device_cbow(int sentence_num, float alpha, int layer1_size, int layer1_size_aligned,
 		int window, int negative, int table_size, int vocab_size,
-		 global int * d_sen,  global int * d_table,
+		 global int * d_sen, global int * d_offsets, global int * d_count, global int * d_table,
 		 global float * d_syn0, global float *d_syn1neg,
 		 global unsigned int * d_random,  global float * expTable, volatile local float * shared ){
 
 
-	int sentence_position = (get_local_id(0) / THREADS_PER_WORD) + (get_local_size(0) / THREADS_PER_WORD) * get_group_id(0);
+	int position = (get_local_id(0) / THREADS_PER_WORD) + (get_local_size(0) / THREADS_PER_WORD) * get_group_id(0);
 	int idInWarp = get_local_id(0) % THREADS_PER_WORD;
 
 
@@ -66,135 +219,135 @@ kernel void device_cbow(int sentence_num, int layer1_size, int layer1_size_align
 	volatile local float * neu1 = &shared [ BLOCK_SIZE + (get_local_id(0) / THREADS_PER_WORD) * layer1_size_aligned];
 	volatile local float * neu1e= & shared[BLOCK_SIZE + (get_local_size(0) / THREADS_PER_WORD) * layer1_size_aligned + (get_local_id(0) / THREADS_PER_WORD) * layer1_size_aligned];
 
-	if (sentence_position < MAX_SENTENCE_LENGTH) {
-		unsigned int next_random = d_random[sentence_position];
-
-		for (int sentence_idx = 0; sentence_idx < sentence_num; sentence_idx++){
-
-			for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1[c] = 0;
-			for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1e[c] = 0;
-
-
+	if (position < d_count[0]) {
+		unsigned int next_random = d_random[position];
+		// Context windows are clipped to the sentence of this token
+		int sentence_idx = findSentence(d_offsets, sentence_num, position);
+		int sentence_start = d_offsets[sentence_idx];
+		int sentence_end = d_offsets[sentence_idx + 1];
+
+		for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1[c] = 0;
+		for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1e[c] = 0;
+
+
+
+		next_random = next_random * (unsigned int) 1664525 + 1013904223;
+		int b = next_random % window;
+		int word = d_sen[position];
+		// in -> hidden
+		int cw = 0;
+		for (int a = b; a < window * 2 + 1 - b; a++)
+			if (a != window) {
+				int w = position - window + a;
+				if (w < sentence_start)
+					continue;
+				if (w >= sentence_end)
+					continue;
+				int last_word = d_sen[w];
+				for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
+					neu1[c] += d_syn0[c + (long) last_word * layer1_size_aligned];
 
-			next_random = next_random * (unsigned int) 1664525 + 1013904223;
-			int b = next_random % window;
-			int word = d_sen[sentence_idx * MAX_SENTENCE_LENGTH + sentence_position];
-			// in -> hidden
-			int cw = 0;
-			for (int a = b; a < window * 2 + 1 - b; a++)
-				if (a != window) {
-					int w = sentence_position - window + a;
-					if (w < 0)
-						continue;
-					if (w>= MAX_SENTENCE_LENGTH)
+				cw++;
+			}
+		
+		if (cw) {
+			for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
+				neu1[c] /= cw;
+		
+		// NEGATIVE SAMPLING
+		int target, label;
+
+		if (negative > 0)
+
+			for (int d = 0; d < negative + 1; d++) {
+
+
+				if (d == 0) {
+					target = word;
+					label = 1;
+				} else {
+					next_random = next_random * (unsigned int) 1664525
+							+ 1013904223;
+					target = d_table[(next_random) % table_size];
+					if (target == 0)
+						target = next_random % (vocab_size - 1) + 1;
+					if (target == word)
 						continue;
-					int last_word = d_sen[sentence_idx * MAX_SENTENCE_LENGTH + w];
-					for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
-						neu1[c] += d_syn0[c + last_word * layer1_size_aligned];
-
-					cw++;
+					label = 0;
 				}
+				long l2 = (long) target * layer1_size_aligned;
+				f[idInWarp] = 0;
 			
-			if (cw) {
-				for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
-					neu1[c] /= cw;
-			
-			// NEGATIVE SAMPLING
-			int target, label;
-			float alpha =((global float *) &d_sen[MAX_SENTENCE_NUM * MAX_SENTENCE_LENGTH + sentence_idx])[0];
-
-			if (negative > 0)
-
-				for (int d = 0; d < negative + 1; d++) {
-
-
-					if (d == 0) {
-						target = word;
-						label = 1;
-					} else {
-						next_random = next_random * (unsigned int) 1664525
-								+ 1013904223;
-						target = d_table[(next_random) % table_size];
-						if (target == 0)
-							target = next_random % (vocab_size - 1) + 1;
-						if (target == word)
-							continue;
-						label = 0;
-					}
-					int l2 = target * layer1_size_aligned;
-					f[idInWarp] = 0;
 				
-					
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD){
-						f[idInWarp] += neu1[c] * d_syn1neg[c + l2];   
-					}
-					barrier(CLK_LOCAL_MEM_FENCE);
-					// Do reduction here;
-					for (unsigned int i=THREADS_PER_WORD /2; i>32; i>>=1) {
-					if (idInWarp < i) {
-						f[idInWarp] += f[idInWarp + i];
-					}
-					barrier(CLK_LOCAL_MEM_FENCE);
-					}
-					if (idInWarp < 32){
-						f[idInWarp] += f[idInWarp + 32];
-						f[idInWarp] += f[idInWarp + 16];
-						f[idInWarp] += f[idInWarp + 8];
-						f[idInWarp] += f[idInWarp + 4];
-						f[idInWarp] += f[idInWarp + 2];
-						f[idInWarp] += f[idInWarp + 1];
-					}
-
-					barrier(CLK_LOCAL_MEM_FENCE);
-					
-					float g;
-					if (f[0] > MAX_EXP)
-						g = (label - 1) * alpha;
-					else if (f[0] < -MAX_EXP)
-						g = (label - 0) * alpha;
-					else
-						g = (label - expTable[(int) ((f[0] + MAX_EXP)
-									* (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-
-					//barrier(CLK_LOCAL_MEM_FENCE);	
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
-						neu1e[c] += g * d_syn1neg[c + l2];
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
-						d_syn1neg[c + l2] += g * neu1[c];
-					
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD){
+					f[idInWarp] += neu1[c] * d_syn1neg[c + l2];   
+				}
+				barrier(CLK_LOCAL_MEM_FENCE);
+				// Do reduction here;
+				for (unsigned int i=THREADS_PER_WORD /2; i>32; i>>=1) {
+				if (idInWarp < i) {
+					f[idInWarp] += f[idInWarp + i];
+				}
+				barrier(CLK_LOCAL_MEM_FENCE);
+				}
+				if (idInWarp < 32){
+					f[idInWarp] += f[idInWarp + 32];
+					f[idInWarp] += f[idInWarp + 16];
+					f[idInWarp] += f[idInWarp + 8];
+					f[idInWarp] += f[idInWarp + 4];
+					f[idInWarp] += f[idInWarp + 2];
+					f[idInWarp] += f[idInWarp + 1];
 				}
-			// hidden -> in
-			for (int a = b; a < window * 2 + 1 - b; a++)
-				if (a != window) {
-					int w = sentence_position - window + a;
-					if (w < 0)
-						continue;
-					if (w >= MAX_SENTENCE_LENGTH)
-						continue;
-					int last_word = d_sen[sentence_idx * MAX_SENTENCE_LENGTH + w];
 
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
-						d_syn0[c + last_word * layer1_size_aligned] += neu1e[c];
+				barrier(CLK_LOCAL_MEM_FENCE);
+				
+				float g;
+				if (f[0] > MAX_EXP)
+					g = (label - 1) * alpha;
+				else if (f[0] < -MAX_EXP)
+					g = (label - 0) * alpha;
+				else
+					g = (label - expTable[(int) ((f[0] + MAX_EXP)
+								* (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+
+				//barrier(CLK_LOCAL_MEM_FENCE);	
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
+					neu1e[c] += g * d_syn1neg[c + l2];
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
+					d_syn1neg[c + l2] += g * neu1[c];
+				
+			}
+		// hidden -> in
+		for (int a = b; a < window * 2 + 1 - b; a++)
+			if (a != window) {
+				int w = position - window + a;
+				if (w < sentence_start)
+					continue;
+				if (w >= sentence_end)
+					continue;
+				int last_word = d_sen[w];
+
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
+					d_syn0[c + (long) last_word * layer1_size_aligned] += neu1e[c];
 
-				}
 			}
+		}
 
-		}// End for sentence_idx
 		// Update d_random
-		if (idInWarp == 0 ) d_random[sentence_position] = next_random;
+		if (idInWarp == 0 ) d_random[position] = next_random;
 	
 	}
 }
 
 
-kernel void device_cbow64(int sentence_num, int layer1_size, int layer1_size_aligned,
+kernel void device_cbow64(int sentence_num, float alpha, int layer1_size, int layer1_size_aligned,
 		int window, int negative, int table_size, int vocab_size,
-		global int * d_sen, global int * d_table,
+		global int * d_sen, global int * d_offsets, global int * d_count, global int * d_table,
 		global float * d_syn0, global float *d_syn1neg,
 		global unsigned int * d_random, __constant float * expTable, volatile local float * shared ){
 
 
-	int sentence_position = (get_local_id(0) / THREADS_PER_WORD) + (get_local_size(0) / THREADS_PER_WORD) * get_group_id(0);
+	int position = (get_local_id(0) / THREADS_PER_WORD) + (get_local_size(0) / THREADS_PER_WORD) * get_group_id(0);
 	int idInWarp = get_local_id(0) % THREADS_PER_WORD;
 
 
@@ -202,107 +355,240 @@ kernel void device_cbow64(int sentence_num, int layer1_size, int layer1_size_ali
 	volatile local float * neu1 = shared + BLOCK_SIZE + (get_local_id(0) / THREADS_PER_WORD) * layer1_size_aligned;
 	volatile local float * neu1e= shared + BLOCK_SIZE + (get_local_size(0) / THREADS_PER_WORD) * layer1_size_aligned + (get_local_id(0) / THREADS_PER_WORD) * layer1_size_aligned;
 
-	if (sentence_position < MAX_SENTENCE_LENGTH) {
-		unsigned int next_random = d_random[sentence_position];
+	if (position < d_count[0]) {
+		unsigned int next_random = d_random[position];
+		// Context windows are clipped to the sentence of this token
+		int sentence_idx = findSentence(d_offsets, sentence_num, position);
+		int sentence_start = d_offsets[sentence_idx];
+		int sentence_end = d_offsets[sentence_idx + 1];
+
+		for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1[c] = 0;
+		for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1e[c] = 0;
+
+
+
+		next_random = next_random * (unsigned int) 1664525 + 1013904223;
+		int b = next_random % window;
+		int word = d_sen[position];
+		// in -> hidden
+		int cw = 0;
+		for (int a = b; a < window * 2 + 1 - b; a++)
+			if (a != window) {
+				int w = position - window + a;
+				if (w < sentence_start)
+					continue;
+				if (w >= sentence_end)
+					continue;
+				int last_word = d_sen[w];
+				for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
+					neu1[c] += d_syn0[c + (long) last_word * layer1_size_aligned];
 
-		for (int sentence_idx = 0; sentence_idx < sentence_num; sentence_idx++){
+				cw++;
+			}
+		
+		if (cw) {
+			for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
+				neu1[c] /= cw;
+		
+		// NEGATIVE SAMPLING
+		int target, label;
+
+		if (negative > 0)
+
+			for (int d = 0; d < negative + 1; d++) {
+
+
+				if (d == 0) {
+					target = word;
+					label = 1;
+				} else {
+					next_random = next_random * (unsigned int) 1664525
+							+ 1013904223;
+					target = d_table[(next_random) % table_size];
+					if (target == 0)
+						target = next_random % (vocab_size - 1) + 1;
+					if (target == word)
+						continue;
+					label = 0;
+				}
+				long l2 = (long) target * layer1_size_aligned;
+				f[idInWarp] = 0;
+			
+				
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD){
+					f[idInWarp] += neu1[c] * d_syn1neg[c + l2];   
+				}
+				barrier(CLK_LOCAL_MEM_FENCE);
+				// Do reduction here;
+				reduceInWarp64(f, idInWarp);
 
-			for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1[c] = 0;
-			for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD) neu1e[c] = 0;
+				barrier(CLK_LOCAL_MEM_FENCE);
+				
+				float g;
+				if (f[0] > MAX_EXP)
+					g = (label - 1) * alpha;
+				else if (f[0] < -MAX_EXP)
+					g = (label - 0) * alpha;
+				else
+					g = (label - expTable[(int) ((f[0] + MAX_EXP)
+								* (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+
+				//barrier(CLK_LOCAL_MEM_FENCE);	
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
+					neu1e[c] += g * d_syn1neg[c + l2];
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
+					d_syn1neg[c + l2] += g * neu1[c];
+				
+			}
+		// hidden -> in
+		for (int a = b; a < window * 2 + 1 - b; a++)
+			if (a != window) {
+				int w = position - window + a;
+				if (w < sentence_start)
+					continue;
+				if (w >= sentence_end)
+					continue;
+				int last_word = d_sen[w];
+
+				for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
+					d_syn0[c + (long) last_word * layer1_size_aligned] += neu1e[c];
 
+			}
+		}
+		// Update d_random
+		if (idInWarp == 0 ) d_random[position] = next_random;
+	}
+}
 
+// device_cbow for -cbow-tile: a work group of THREADS_PER_WORD threads
+// trains tile consecutive positions one after the other. The syn0 rows of
+// the tile and of the window on both sides are read once, into local memory
+// as a running sum, so the context of any position is the difference of two
+// sums. The updates of the context rows are gathered the same way, added
+// at the edges of each window, and a running sum over them gives the update
+// of every row, written back once. Positions of a tile see syn0 as of its
+// start, like neighbouring work groups of device_cbow do.
+kernel void device_cbow_tile(int sentence_num, float alpha, int layer1_size, int layer1_size_aligned,
+		int window, int negative, int table_size, int vocab_size,
+		global int * d_sen, global int * d_offsets, global int * d_count, global int * d_table,
+		global float * d_syn0, global float * d_syn1neg,
+		global unsigned int * d_random, global float * expTable, local float * shared, int tile){
+	int id = get_local_id(0);
+	int count = d_count[0];
+	int first = get_group_id(0) * tile;
+	if (first >= count)
+		return;
+	int last = min(first + tile, count);
+	// Staged rows [lo, hi)
+	int lo = max(first - window, 0);
+	int hi = min(last + window, count);
+	int rows = hi - lo;
+
+	local float * f = shared;
+	local float * neu1 = shared + THREADS_PER_WORD;
+	local float * neu1e = neu1 + layer1_size_aligned;
+	// sum[k]: rows lo .. lo + k - 1 added up. update[k]: how the update of
+	// row lo + k differs from the one of row lo + k - 1.
+	local float * sum = neu1e + layer1_size_aligned;
+	local float * update = sum + (tile + 2 * window + 1) * layer1_size_aligned;
+
+	for (int c = id; c < layer1_size; c += THREADS_PER_WORD) {
+		float running = 0;
+		sum[c] = 0;
+		update[c] = 0;
+		for (int k = 0; k < rows; k++) {
+			running += d_syn0[c + (long) d_sen[lo + k] * layer1_size_aligned];
+			sum[(k + 1) * layer1_size_aligned + c] = running;
+			update[(k + 1) * layer1_size_aligned + c] = 0;
+		}
+	}
 
-			next_random = next_random * (unsigned int) 1664525 + 1013904223;
-			int b = next_random % window;
-			int word = d_sen[sentence_idx * MAX_SENTENCE_LENGTH + sentence_position];
+	for (int position = first; position < last; position++) {
+		unsigned int next_random = d_random[position];
+		// Context windows are clipped to the sentence of this token
+		int sentence_idx = findSentence(d_offsets, sentence_num, position);
+		int sentence_start = d_offsets[sentence_idx];
+		int sentence_end = d_offsets[sentence_idx + 1];
+		next_random = next_random * (unsigned int) 1664525 + 1013904223;
+		int b = next_random % window;
+		int word = d_sen[position];
+		// Context [from, to] around the position, itself left out
+		int from = max(position - window + b, sentence_start);
+		int to = min(position + window - b, sentence_end - 1);
+		int cw = to - from;
+		int k0 = from - lo, k1 = to + 1 - lo, self = position - lo;
+
+		if (cw) {
 			// in -> hidden
-			int cw = 0;
-			for (int a = b; a < window * 2 + 1 - b; a++)
-				if (a != window) {
-					int w = sentence_position - window + a;
-					if (w < 0)
-						continue;
-					if (w>= MAX_SENTENCE_LENGTH)
-						continue;
-					int last_word = d_sen[sentence_idx * MAX_SENTENCE_LENGTH + w];
-					for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
-						neu1[c] += d_syn0[c + last_word * layer1_size_aligned];
+			for (int c = id; c < layer1_size; c += THREADS_PER_WORD) {
+				float context = sum[k1 * layer1_size_aligned + c] - sum[k0 * layer1_size_aligned + c];
+				float own = sum[(self + 1) * layer1_size_aligned + c] - sum[self * layer1_size_aligned + c];
+				neu1[c] = (context - own) / cw;
+				neu1e[c] = 0;
+			}
 
-					cw++;
-				}
-			
-			if (cw) {
-				for (int c = idInWarp; c < layer1_size; c+= THREADS_PER_WORD)
-					neu1[c] /= cw;
-			
 			// NEGATIVE SAMPLING
-			int target, label;
-			float alpha =*((global float *) &d_sen[MAX_SENTENCE_NUM * MAX_SENTENCE_LENGTH + sentence_idx]);
-
 			if (negative > 0)
-
-				for (int d = 0; d < negative + 1; d++) {
-
-
-					if (d == 0) {
-						target = word;
-						label = 1;
-					} else {
-						next_random = next_random * (unsigned int) 1664525
-								+ 1013904223;
-						target = d_table[(next_random) % table_size];
-						if (target == 0)
-							target = next_random % (vocab_size - 1) + 1;
-						if (target == word)
-							continue;
-						label = 0;
-					}
-					int l2 = target * layer1_size_aligned;
-					f[idInWarp] = 0;
-				
-					
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD){
-						f[idInWarp] += neu1[c] * d_syn1neg[c + l2];   
-					}
-					barrier(CLK_LOCAL_MEM_FENCE);
-					// Do reduction here;
-					reduceInWarp64(f, idInWarp);
-
+			for (int d = 0; d < negative + 1; d++) {
+				int target, label;
+				if (d == 0) {
+					target = word;
+					label = 1;
+				} else {
+					next_random = next_random * (unsigned int) 1664525 + 1013904223;
+					target = d_table[(next_random) % table_size];
+					if (target == 0)
+						target = next_random % (vocab_size - 1) + 1;
+					if (target == word)
+						continue;
+					label = 0;
+				}
+				long l2 = (long) target * layer1_size_aligned;
+				float partial = 0;
+				for (int c = id; c < layer1_size; c += THREADS_PER_WORD)
+					partial += neu1[c] * d_syn1neg[c + l2];
+				f[id] = partial;
+				barrier(CLK_LOCAL_MEM_FENCE);
+				for (int i = THREADS_PER_WORD / 2; i > 0; i >>= 1) {
+					if (id < i)
+						f[id] += f[id + i];
 					barrier(CLK_LOCAL_MEM_FENCE);
-					
-					float g;
-					if (f[0] > MAX_EXP)
-						g = (label - 1) * alpha;
-					else if (f[0] < -MAX_EXP)
-						g = (label - 0) * alpha;
-					else
-						g = (label - expTable[(int) ((f[0] + MAX_EXP)
-									* (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
-
-					//barrier(CLK_LOCAL_MEM_FENCE);	
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
-						neu1e[c] += g * d_syn1neg[c + l2];
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
-						d_syn1neg[c + l2] += g * neu1[c];
-					
 				}
-			// hidden -> in
-			for (int a = b; a < window * 2 + 1 - b; a++)
-				if (a != window) {
-					int w = sentence_position - window + a;
-					if (w < 0)
-						continue;
-					if (w >= MAX_SENTENCE_LENGTH)
-						continue;
-					int last_word = d_sen[sentence_idx * MAX_SENTENCE_LENGTH + w];
-
-					for (int c = idInWarp; c < layer1_size; c+=THREADS_PER_WORD)
-						d_syn0[c + last_word * layer1_size_aligned] += neu1e[c];
-
+				float dot = f[0];
+				// f is written again for the next target
+				barrier(CLK_LOCAL_MEM_FENCE);
+
+				float g;
+				if (dot > MAX_EXP)
+					g = (label - 1) * alpha;
+				else if (dot < -MAX_EXP)
+					g = (label - 0) * alpha;
+				else
+					g = (label - expTable[(int) ((dot + MAX_EXP) * (EXP_TABLE_SIZE / MAX_EXP / 2))]) * alpha;
+				for (int c = id; c < layer1_size; c += THREADS_PER_WORD) {
+					neu1e[c] += g * d_syn1neg[c + l2];
+					d_syn1neg[c + l2] += g * neu1[c];
 				}
 			}
-		}// End for sentence_idx
-		// Update d_random
-		if (idInWarp == 0 ) d_random[sentence_position] = next_random;
+
+			// hidden -> in: neu1e for rows from .. to, but the position
+			for (int c = id; c < layer1_size; c += THREADS_PER_WORD) {
+				update[k0 * layer1_size_aligned + c] += neu1e[c];
+				update[k1 * layer1_size_aligned + c] -= neu1e[c];
+				update[self * layer1_size_aligned + c] -= neu1e[c];
+				update[(self + 1) * layer1_size_aligned + c] += neu1e[c];
+			}
+		}
+		if (id == 0)
+			d_random[position] = next_random;
+	}
+
+	for (int c = id; c < layer1_size; c += THREADS_PER_WORD) {
+		float running = 0;
+		for (int k = 0; k < rows; k++) {
+			running += update[k * layer1_size_aligned + c];
+			if (running != 0)
+				d_syn0[c + (long) d_sen[lo + k] * layer1_size_aligned] += running;
+		}
 	}
 }
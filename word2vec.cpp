@@ -26,6 +26,19 @@
 #include <pthread.h>
 #include <vector>
 #include "cbow.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "autotune.h"
+#include "cluster.h"
+#include "topology.h"
+#include "sketch.h"
+#include "eval.h"
+#include "reader.h"
+#include "pq.h"
+#include "kmeans.h"
+#include "batchqueue.h"
+#include "shard.h"
+#include "quantize.h"
 
 std::vector<GPUTrainer> gpuTrainers;
 
@@ -34,7 +47,7 @@ const int vocab_hash_size = 30000000; // Maximum 30 * 0.7 = 21M words in the voc
 // Precision of float numbers
 
 struct vocab_word {
-	int cn;
+	long long cn;
 	int *point;
 	char *word, *code, codelen;
 };
@@ -48,143 +61,34 @@ int *vocab_hash;
 int vocab_max_size = 1000, vocab_size = 0, layer1_size = 100,
 		layer1_size_aligned;
 ;
-unsigned int train_words = 0, iter = 5;
-int file_size = 0, classes = 0;
-unsigned int word_count_actual = 0;
+unsigned long long train_words = 0;
+unsigned int iter = 5;
+long long file_size = 0;
+int classes = 0, class_iterations = 10, bench_classes = 0;
+unsigned long long word_count_actual = 0;
 real alpha = 0.025, starting_alpha, sample = 1e-3;
 real *syn0;
 real *syn1neg;
 
-clock_t start;
-
 int benchmark = 0;
+int async_average = 0;
+// -sync-quantize: syn0 / syn1neg as the devices got them at the last
+// distribution, what rounding the distributed change left out (error
+// feedback only), and the quantized change sent to the devices
+real * sync_ref[2], * sync_residual[2];
+signed char * sync_q[2];
+float * sync_scale[2];
+// Squared sums of the averaged change and of its rounding error since the
+// last SyncReport(), per averaging lane and of the distribution
+double sync_change[MAX_READBACK_LANES + 1], sync_noise[MAX_READBACK_LANES + 1];
 int hs = 0, negative = 5;
 int table_size = 1e8;
 int *table;
+real *keep_table;
 
 
-#define IO_BLOCK_SIZE  4096
-int buf_io_fd[MAX_GPU_SUPPORT] = { -1, -1, -1, -1, -1, -1, -1, -1 };
-int end_flag[MAX_GPU_SUPPORT] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-char* buf[MAX_GPU_SUPPORT] = { NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL };
-char word[MAX_GPU_SUPPORT][MAX_STRING];
-
-ssize_t cur_pos[MAX_GPU_SUPPORT] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-ssize_t cur_end[MAX_GPU_SUPPORT] = { 0, 0, 0, 0, 0, 0, 0, 0 };
-
-int fill_buffer(int id) {
-	ssize_t rd = 0;
-
-	while ((rd = read(buf_io_fd[id], &(buf[id][cur_pos[id]]),
-			IO_BLOCK_SIZE - cur_pos[id])) < 0) {
-		if (errno == EINTR)
-			continue;
-
-		// all the other errors read can return should never happen, if they do
-		// something has gone very wrong, and there's nothing we can really do about it.
-		perror("read");
-		abort();
-	}
-
-	cur_end[id] = cur_pos[id] + rd;
-
-	if (rd != IO_BLOCK_SIZE - cur_pos[id]) {
-		buf[id][cur_pos[id] + rd] = '\0';
-	}
-	return 0;
-}
-
-#define isdelim(c) (((c) == ' ')  | ((c) == '\t') | ((c) == '\n') | ((c) == '\r'))
-
-void buffered_readWord(int id) {
-
-	if (cur_pos[id] >= IO_BLOCK_SIZE) {
-		cur_pos[id] = 0;
-		fill_buffer(id);
-	} else if (cur_pos[id] >= cur_end[id]) { // EOF
-		end_flag[id] = 1;
-		return;
-	}
-
-	// look for start of token (first non-whitespace character)
-	while (isdelim(buf[id][cur_pos[id]]) && buf[id][cur_pos[id]]) {
-		cur_pos[id]++;
-		if (cur_pos[id] >= IO_BLOCK_SIZE) {
-			cur_pos[id] = 0;
-			fill_buffer(id);
-		}
-	}
-
-	ssize_t ptmp = cur_pos[id]; // need to rember start of token
-
-	while (!isdelim(buf[id][cur_pos[id]]) && buf[id][cur_pos[id]]) // scan for end of token
-	{
-		cur_pos[id]++;
-		if (cur_pos[id] >= IO_BLOCK_SIZE) {
-			// copy already looked at part to begining
-			// should never overlap, at least for tokens shorter than IO_BLOCK_SIZE/2
-			memcpy(buf[id], &(buf[id][ptmp]),
-					sizeof(char) * (IO_BLOCK_SIZE - ptmp));
-
-			cur_pos[id] = IO_BLOCK_SIZE - ptmp;
-			ptmp = 0;
-			fill_buffer(id);
-		}
-	}
-
-	ssize_t wordlen = (cur_pos[id] - ptmp);
-	if (wordlen >= MAX_STRING)
-		wordlen = MAX_STRING - 1;
-
-	buf[id][cur_pos[id]] = '\0'; // replace space with null
-	memcpy(word[id], &(buf[id][ptmp]), wordlen);
-	word[id][wordlen] = '\0';
-	cur_pos[id]++;
-}
-
-void reset_read_word(int id, float offset = 0) {
-	file_size = lseek(buf_io_fd[id], 0, SEEK_END);
-	off_t ret = lseek(buf_io_fd[id], (int)(file_size * offset), SEEK_SET);
-
-	if (ret < 0) {
-		perror("lseek");
-	}
-	end_flag[id] = 0;
-	cur_pos[id] = 0;
-	cur_end[id] = 0;
-	//printf("calling fill from reset\n");
-	fill_buffer(id);
-}
-
-int open_buffered_file(int id, float offset = 0) {
-	if (buf_io_fd[id] != -1) {
-		printf("file already open");
-		exit(1);
-	}
-	buf_io_fd[id] = open(train_file, O_RDONLY);
-	if (buf_io_fd[id] == -1)
-		perror("open");
-
-	size_t alignment = 4096;
-	if (posix_memalign((void**) &buf[id], alignment, IO_BLOCK_SIZE) != 0) {
-		perror("posix_memalign");
-	}
-	reset_read_word(id, offset );
-	return 1;
-
-}
-
-int close_buffered_file(int id) {
-	if (buf_io_fd[id] == -1) {
-		printf("file already closed");
-		exit(1);
-	}
-
-	close(buf_io_fd[id]);
-	buf_io_fd[id] = -1;
-	free(buf[id]);
-	return 1;
-}
+// Floats per block of the background delta computation
+#define AVERAGE_BLOCK (1 << 16)
 
 void InitUnigramTable() {
 	int a, i;
@@ -206,6 +110,19 @@ void InitUnigramTable() {
 	}
 }
 
+// Probability to keep each word when subsampling frequent words, used by the devices
+void InitSubsampleTable() {
+	int a;
+	keep_table = (real *) malloc(vocab_size * sizeof(real));
+	for (a = 0; a < vocab_size; a++) {
+		if (sample > 0 && vocab[a].cn > 0)
+			keep_table[a] = (sqrt(vocab[a].cn / (sample * train_words)) + 1)
+					* (sample * train_words) / vocab[a].cn;
+		else
+			keep_table[a] = 1;
+	}
+}
+
 // Reads a single word from a file, assuming space + tab + EOL to be word boundaries
 void ReadWord(char *word, FILE *fin) {
 	int a = 0, ch;
@@ -232,18 +149,21 @@ void ReadWord(char *word, FILE *fin) {
 	word[a] = 0;
 }
 
-// Returns hash value of a word
-int GetWordHash(char *word) {
+// Hash of a word before it is reduced to the table size
+unsigned int WordHash(char *word) {
 	unsigned int a, hash = 0;
 	for (a = 0; a < strlen(word); a++)
 		hash = hash * 257 + word[a];
-	hash = hash % vocab_hash_size;
 	return hash;
 }
 
+// Returns hash value of a word
+int GetWordHash(char *word) {
+	return WordHash(word) % vocab_hash_size;
+}
+
 // Returns position of a word in the vocabulary; if the word is not found, returns -1
-int SearchVocab(char *word) {
-	unsigned int hash = GetWordHash(word);
+int SearchVocabHash(char *word, unsigned int hash) {
 	while (1) {
 		if (vocab_hash[hash] == -1)
 			return -1;
@@ -254,13 +174,21 @@ int SearchVocab(char *word) {
 	return -1;
 }
 
+int SearchVocab(char *word) {
+	return SearchVocabHash(word, GetWordHash(word));
+}
+
+// The reader hashed the word while tokenizing it
+int SearchVocab(Reader * reader) {
+	return SearchVocabHash(reader->word, reader->hash % vocab_hash_size);
+}
+
 // Reads a word and returns its index in the vocabulary
-int ReadWordIndex(int id) {
-	//char word[MAX_STRING];
-	buffered_readWord(id);
-	if (end_flag[id])
+int ReadWordIndex(Reader * reader) {
+	readerReadWord(reader);
+	if (reader->end_flag)
 		return -1;
-	return SearchVocab(word[id]);
+	return SearchVocab(reader);
 }
 
 // Adds a word to the vocabulary
@@ -287,7 +215,8 @@ int AddWordToVocab(char *word) {
 
 // Used later for sorting by word counts
 int VocabCompare(const void *a, const void *b) {
-	return ((struct vocab_word *) b)->cn - ((struct vocab_word *) a)->cn;
+	long long ca = ((struct vocab_word *) a)->cn, cb = ((struct vocab_word *) b)->cn;
+	return ca < cb ? 1 : ca > cb ? -1 : 0;
 }
 
 // Sorts the vocabulary by frequency using word counts
@@ -347,6 +276,69 @@ void ReduceVocab() {
 	fflush(stdout);
 	min_reduce++;
 }
+
+// Bounded vocabulary counting (-vocab-memory): words start in the sketch and
+// enter the exact table once their estimate reaches promote_count. The
+// estimate never undercounts, so no word that reaches min_count is missed.
+long long vocab_memory = 0;
+CountMinSketch vocab_sketch;
+long long promote_count;
+int max_exact_words;
+// Approximate cost of a word in the exact table: entry, string and malloc
+#define EXACT_WORD_BYTES 64
+
+void InitVocabSketch() {
+	// Half of the budget goes to the sketch, half to the exact table
+	sketchInit(&vocab_sketch, vocab_memory / 2);
+	max_exact_words = vocab_memory / 2 / EXACT_WORD_BYTES;
+	if (max_exact_words > vocab_hash_size * 0.7)
+		max_exact_words = vocab_hash_size * 0.7;
+	promote_count = min_count > 1 ? min_count : 1;
+}
+
+// The exact table is full: the promotion bar doubles and the words below it
+// go back to the sketch with their counts
+void DemoteVocab() {
+	int a, b;
+	unsigned int hash;
+	while (vocab_size > max_exact_words * 3 / 4) {
+		promote_count *= 2;
+		b = 1;
+		for (a = 1; a < vocab_size; a++)
+			if (vocab[a].cn >= promote_count)
+				vocab[b++] = vocab[a];
+			else {
+				unsigned int count = vocab[a].cn < SKETCH_MAX_COUNT ? vocab[a].cn : SKETCH_MAX_COUNT;
+				sketchRaise(&vocab_sketch, vocab[a].word, strlen(vocab[a].word), count);
+				free(vocab[a].word);
+			}
+		vocab_size = b;
+	}
+	for (a = 0; a < vocab_hash_size; a++)
+		vocab_hash[a] = -1;
+	for (a = 0; a < vocab_size; a++) {
+		hash = GetWordHash(vocab[a].word);
+		while (vocab_hash[hash] != -1)
+			hash = (hash + 1) % vocab_hash_size;
+		vocab_hash[hash] = a;
+	}
+}
+
+void ReportVocabSketch() {
+	double bound = sketchErrorBound(&vocab_sketch);
+	int uncertain = 0;
+	for (int a = 1; a < vocab_size; a++)
+		if (vocab[a].cn - bound < min_count)
+			uncertain++;
+	printf("Vocab sketch: %d x %llu counters (%.1f MB), exact table of at most %d words (%.1f MB)\n",
+			SKETCH_DEPTH, vocab_sketch.width,
+			SKETCH_DEPTH * vocab_sketch.width * sizeof(unsigned int) / 1048576.0, max_exact_words,
+			(double) max_exact_words * EXACT_WORD_BYTES / 1048576.0);
+	printf("Counts overestimated by at most %.1f with probability %.1f%%, %d of %d words are that close"
+			" to min_count\n", bound, sketchConfidence() * 100, uncertain, vocab_size);
+	if (promote_count > min_count)
+		printf("The exact table filled up, words seen fewer than %lld times may be missing\n", promote_count);
+}
 /*
  // Create binary Huffman tree using the word counts
  // Frequent words will have short uniqe binary codes
@@ -426,204 +418,827 @@ void LearnVocabFromTrainFile() {
 	 printf("ERROR: training data file not found!\n");
 	 exit(1);
 	 }*/
-	open_buffered_file(0);
+	Reader * reader = readerOpen(train_file, 0);
 	vocab_size = 0;
 	AddWordToVocab((char *) "</s>");
+	if (vocab_memory > 0)
+		InitVocabSketch();
+	// The shard index comes with the counting pass
+	shardIndexBegin(reader);
 	while (1) {
-		buffered_readWord(0);
-		if (end_flag[0])
+		readerReadWord(reader);
+		if (reader->end_flag)
 			break;
+		shardIndexNote(reader);
 		train_words++;
 		if ((debug_mode > 1) && (train_words % 100000 == 0)) {
-			printf("%dK%c", train_words / 1000, 13);
+			printf("%lluK%c", train_words / 1000, 13);
 			fflush(stdout);
 		}
-		i = SearchVocab(word[0]);
-		if (i == -1) {
-			a = AddWordToVocab(word[0]);
-			vocab[a].cn = 1;
-		} else
+		i = SearchVocab(reader);
+		if (i != -1)
 			vocab[i].cn++;
-		if (vocab_size > vocab_hash_size * 0.7)
+		else if (vocab_memory == 0) {
+			a = AddWordToVocab(reader->word);
+			vocab[a].cn = 1;
+		} else {
+			unsigned int estimate = sketchAdd(&vocab_sketch, reader->word, reader->length);
+			if (estimate >= promote_count || estimate == SKETCH_MAX_COUNT) {
+				a = AddWordToVocab(reader->word);
+				vocab[a].cn = estimate;
+			}
+		}
+		if (vocab_memory > 0 && vocab_size >= max_exact_words)
+			DemoteVocab();
+		else if (vocab_size > vocab_hash_size * 0.7)
 			ReduceVocab();
 	}
+	shardIndexEnd(reader);
 	SortVocab();
 	if (debug_mode > 0) {
 		printf("Vocab size: %d\n", vocab_size);
-		printf("Words in train file: %d\n", train_words);
+		printf("Words in train file: %llu\n", train_words);
+	}
+	if (vocab_memory > 0) {
+		if (debug_mode > 0)
+			ReportVocabSketch();
+		sketchFree(&vocab_sketch);
 	}
 	//file_size = ftell(fin);
-	close_buffered_file(0);
+	readerClose(reader);
+}
+
+// Binary vocabulary: the header, then the counts, the offsets of the words
+// in the arena, the shard index of the corpus, the word hashes and the arena
+// of zero terminated strings
+#define VOCAB_FILE_MAGIC "w2vvocab"
+#define VOCAB_FILE_VERSION 2
+
+struct VocabFileHeader {
+	char magic[8];
+	int version, vocab_size, min_count, reserved;
+	unsigned long long train_words, arena_size, index_points;
+	// Size and modification time of the corpus the words were counted in
+	long long corpus_size, corpus_mtime_ns;
+};
+
+long long CorpusMtime(struct stat *st) {
+	return (long long) st->st_mtim.tv_sec * 1000000000LL + st->st_mtim.tv_nsec;
 }
 
 void SaveVocab() {
-	int i;
+	int a;
+	struct stat st;
 	FILE *fo = fopen(save_vocab_file, "wb");
-	for (i = 0; i < vocab_size; i++)
-		fprintf(fo, "%s %d\n", vocab[i].word, vocab[i].cn);
-	fclose(fo);
+	if (fo == NULL || stat(train_file, &st) != 0) {
+		printf("Cannot save the vocabulary to %s\n", save_vocab_file);
+		exit(1);
+	}
+	VocabFileHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, VOCAB_FILE_MAGIC, sizeof(header.magic));
+	header.version = VOCAB_FILE_VERSION;
+	header.vocab_size = vocab_size;
+	header.min_count = min_count;
+	header.train_words = train_words;
+	header.index_points = shardIndexSize();
+	header.corpus_size = st.st_size;
+	header.corpus_mtime_ns = CorpusMtime(&st);
+	std::vector<unsigned int> hashes(vocab_size);
+	std::vector<unsigned long long> offsets(vocab_size);
+	for (a = 0; a < vocab_size; a++) {
+		hashes[a] = WordHash(vocab[a].word);
+		offsets[a] = header.arena_size;
+		header.arena_size += strlen(vocab[a].word) + 1;
+	}
+	fwrite(&header, sizeof(header), 1, fo);
+	for (a = 0; a < vocab_size; a++)
+		fwrite(&vocab[a].cn, sizeof(long long), 1, fo);
+	fwrite(&offsets[0], sizeof(unsigned long long), vocab_size, fo);
+	if (header.index_points > 0)
+		fwrite(shardIndexPoints(), sizeof(ShardPoint), header.index_points, fo);
+	fwrite(&hashes[0], sizeof(unsigned int), vocab_size, fo);
+	for (a = 0; a < vocab_size; a++)
+		fwrite(vocab[a].word, 1, strlen(vocab[a].word) + 1, fo);
+	if (fclose(fo) != 0) {
+		printf("Cannot save the vocabulary to %s\n", save_vocab_file);
+		exit(1);
+	}
 }
-/*
- void ReadVocab() {
- int a, i = 0;
- char c;
- char word[MAX_STRING];
- FILE *fin = fopen(read_vocab_file, "rb");
- if (fin == NULL) {
- printf("Vocabulary file not found\n");
- exit(1);
- }
- for (a = 0; a < vocab_hash_size; a++) vocab_hash[a] = -1;
- vocab_size = 0;
- while (1) {
- ReadWord(word, fin);
- if (feof(fin)) break;
- a = AddWordToVocab(word);
- fscanf(fin, "%d%c", &vocab[a].cn, &c);
- i++;
- }
- SortVocab();
- if (debug_mode > 0) {
- printf("Vocab size: %d\n", vocab_size);
- printf("Words in train file: %d\n", train_words);
- }
- fin = fopen(train_file, "rb");
- if (fin == NULL) {
- printf("ERROR: training data file not found!\n");
- exit(1);
- }
- fseek(fin, 0, SEEK_END);
- file_size = ftell(fin);
- fclose(fin);
- }
- */
+
+// Loads a vocabulary saved by SaveVocab for the same corpus. The words stay
+// in the arena of the file buffer and the saved hashes go straight into
+// the table. Returns 0 when the file is missing, stale or counted with a
+// higher min-count, then the vocabulary has to be learned again.
+int ReadVocab() {
+	int a;
+	struct stat st, corpus;
+	unsigned long long start = monotonicNs();
+	FILE *fin = fopen(read_vocab_file, "rb");
+	if (fin == NULL || fstat(fileno(fin), &st) != 0) {
+		printf("Vocabulary file %s not found, counting the words\n", read_vocab_file);
+		if (fin != NULL)
+			fclose(fin);
+		return 0;
+	}
+	char *data = (char *) malloc(st.st_size);
+	VocabFileHeader *header = (VocabFileHeader *) data;
+	if (data == NULL || fread(data, 1, st.st_size, fin) != (size_t) st.st_size
+			|| st.st_size < (off_t) sizeof(VocabFileHeader)
+			|| memcmp(header->magic, VOCAB_FILE_MAGIC, sizeof(header->magic))
+			|| header->version != VOCAB_FILE_VERSION || header->vocab_size < 1
+			|| st.st_size != (off_t) (sizeof(VocabFileHeader)
+					+ header->vocab_size * (sizeof(long long) + sizeof(unsigned long long) + sizeof(unsigned int))
+					+ header->index_points * sizeof(ShardPoint) + header->arena_size)) {
+		printf("%s is not a vocabulary file, counting the words\n", read_vocab_file);
+		fclose(fin);
+		free(data);
+		return 0;
+	}
+	fclose(fin);
+	if (stat(train_file, &corpus) != 0 || corpus.st_size != header->corpus_size
+			|| CorpusMtime(&corpus) != header->corpus_mtime_ns) {
+		printf("Vocabulary %s is stale, %s changed since it was counted\n", read_vocab_file, train_file);
+		free(data);
+		return 0;
+	}
+	if (header->min_count > min_count) {
+		printf("Vocabulary %s was counted with min-count %d, counting the words\n", read_vocab_file,
+				header->min_count);
+		free(data);
+		return 0;
+	}
+	long long *counts = (long long *) (data + sizeof(VocabFileHeader));
+	unsigned long long *offsets = (unsigned long long *) (counts + header->vocab_size);
+	ShardPoint *points = (ShardPoint *) (offsets + header->vocab_size);
+	unsigned int *hashes = (unsigned int *) (points + header->index_points);
+	char *arena = (char *) (hashes + header->vocab_size);
+	shardIndexLoad(points, header->index_points);
+	// The words are sorted by count, a higher min-count only cuts the tail
+	vocab_size = 1;
+	while (vocab_size < header->vocab_size && counts[vocab_size] >= min_count)
+		vocab_size++;
+	vocab_max_size = vocab_size + 1;
+	vocab = (struct vocab_word *) realloc(vocab, vocab_max_size * sizeof(struct vocab_word));
+	for (a = 0; a < vocab_hash_size; a++)
+		vocab_hash[a] = -1;
+	train_words = 0;
+	for (a = 0; a < vocab_size; a++) {
+		unsigned int hash = hashes[a] % vocab_hash_size;
+		vocab[a].word = arena + offsets[a];
+		vocab[a].cn = counts[a];
+		vocab[a].point = NULL;
+		vocab[a].code = NULL;
+		vocab[a].codelen = 0;
+		while (vocab_hash[hash] != -1)
+			hash = (hash + 1) % vocab_hash_size;
+		vocab_hash[hash] = a;
+		train_words += counts[a];
+	}
+	if (debug_mode > 0) {
+		printf("Read vocabulary from %s in %.2fs\n", read_vocab_file, (monotonicNs() - start) / 1e9);
+		printf("Vocab size: %d\n", vocab_size);
+		printf("Words in train file: %llu\n", train_words);
+	}
+	return 1;
+}
+
+// Counter based random stream: the value only depends on the matrix
+// position, so the initial model is the same for any number of threads
+real InitialWeight(long long a, long long b) {
+	unsigned long long x = (unsigned long long) (a * layer1_size + b)
+			* 0x9E3779B97F4A7C15ULL + 0x632BE59BD9B4E019ULL;
+	x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	x = (x ^ (x >> 27)) * 0x94D049BB133111EBULL;
+	x = x ^ (x >> 31);
+	return (((x & 0xFFFF) / (real) 65536) - 0.5) / layer1_size;
+}
+
+int init_threads = 1;
+
+void *InitNetThread(void *id) {
+	long long a, b;
+	long long first = vocab_size * (long long) id / init_threads;
+	long long last = vocab_size * ((long long) id + 1) / init_threads;
+	for (a = first; a < last; a++) {
+		for (b = 0; b < layer1_size; b++)
+			syn0[a * layer1_size_aligned + b] = InitialWeight(a, b);
+		for (; b < layer1_size_aligned; b++)
+			syn0[a * layer1_size_aligned + b] = 0;
+		if (negative > 0)
+			memset(&syn1neg[a * layer1_size_aligned], 0,
+					layer1_size_aligned * sizeof(real));
+	}
+	return NULL;
+}
+
 void InitNet() {
-	int a, b;
-	unsigned int next_random = 1;
+	int a;
 	a = posix_memalign((void **) &syn0, 128,
-			(int) vocab_size * layer1_size_aligned * sizeof(real));
+			(size_t) vocab_size * layer1_size_aligned * sizeof(real));
 	if (syn0 == NULL) {
 		printf("Memory allocation failed\n");
 		exit(1);
 	}
 
-	for (a = 0; a < vocab_size; a++)
-		for (b = 0; b < layer1_size; b++) {
-			next_random = next_random * (unsigned int) 1664525 + 1013904223;
-			syn0[a * layer1_size_aligned + b] = (((next_random & 0xFFFF)
-					/ (real) 65536) - 0.5) / layer1_size;
-
-		}
-
 	if (negative > 0)
 	{
 		a = posix_memalign((void **) &syn1neg, 128,
-				(int) vocab_size * layer1_size_aligned * sizeof(real));
+				(size_t) vocab_size * layer1_size_aligned * sizeof(real));
 		if (syn1neg == NULL) {
 			printf("Memory allocation failed\n");
 			exit(1);
 		}
-		for (a = 0; a < vocab_size; a++)
-			for (b = 0; b < layer1_size; b++) {
-				syn1neg[a * layer1_size_aligned + b] = 0;
-			}
 	}
+	// Row ranges of the model live on the nodes that average them, see
+	// AverageModel(). Placed before the first touch.
+	for (int k = 0; k < topologyNodeCount(); k++) {
+		long long first, last;
+		topologyRows(k, vocab_size, &first, &last);
+		size_t offset = first * layer1_size_aligned * sizeof(real);
+		size_t bytes = (last - first) * layer1_size_aligned * sizeof(real);
+		topologyPlace((char *) syn0 + offset, bytes, topologyNode(k));
+		if (negative > 0)
+			topologyPlace((char *) syn1neg + offset, bytes, topologyNode(k));
+	}
+	init_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (init_threads < 1)
+		init_threads = 1;
+	pthread_t *pt = (pthread_t *) malloc(init_threads * sizeof(pthread_t));
+	for (a = 0; a < init_threads; a++)
+		pthread_create(&pt[a], NULL, InitNetThread, (void *) (long) a);
+	for (a = 0; a < init_threads; a++)
+		pthread_join(pt[a], NULL);
+	free(pt);
 	//CreateBinaryTree();
 }
 
-void *TrainModelThread(void *id) {
-	int word, sentence_length = 0;
-	unsigned int word_count = 0, last_word_count = 0;
-	unsigned int next_random = (long) id;
-	int fid = (int) (long) id;
+// Linearly decaying learning rate, from the number of words all threads consumed so far
+real CurrentAlpha(unsigned long long words_done) {
+	// The other processes of a cluster are assumed to be as far as this one
+	real a = starting_alpha * (1 - words_done * (real) cluster_size / (real) (iter * train_words + 1));
+	if (a < starting_alpha * 0.0001)
+		a = starting_alpha * 0.0001;
+	return a;
+}
+
+// Reads the first words of the corpus for the autotuner, 0 marks line breaks
+int ReadSample(int * sample, int max_tokens) {
+	int word, n = 0;
+	Reader * reader = readerOpen(train_file, 0);
+	while (n < max_tokens) {
+		word = ReadWordIndex(reader);
+		if (reader->end_flag)
+			break;
+		if (word == -1)
+			continue;
+		sample[n++] = word;
+	}
+	readerClose(reader);
+	return n;
+}
+
+// Quantized sync: the change of a row averaged over the devices that
+// changed it, added to the model they all started from
+void AverageQuantizedRows(long long a0, long long a1, ReadbackRows * rows, int lane) {
+	int matrices = negative > 0 ? 2 : 1;
+	real * models[2] = { syn0, syn1neg };
+	float * weight = (float *) malloc(num_threads * sizeof(float));
+	for (long long a = a0; a < a1; a++) {
+		long long r = a - a0;
+		for (int m = 0; m < matrices; m++) {
+			int c = 0;
+			double noise = 0;
+			for (int i = 0; i < num_threads; i++)
+				if (rows[i].scale[m][r] > 0)
+					c++;
+			for (int i = 0; i < num_threads; i++) {
+				weight[i] = c > 0 ? rows[i].scale[m][r] / c : 0;
+				// Rounding to the nearest step is off by scale^2 / 12 on average
+				noise += weight[i] * weight[i] / 12;
+			}
+			for (long long b = 0; b < layer1_size; b++) {
+				long long index = a * layer1_size_aligned + b;
+				float change = 0;
+				for (int i = 0; i < num_threads; i++)
+					change += rows[i].q[m][r * layer1_size + b] * weight[i];
+				models[m][index] = sync_ref[m][index] + change;
+				sync_change[lane] += change * change;
+			}
+			sync_noise[lane] += noise * layer1_size;
+		}
+	}
+	free(weight);
+}
+
+// Averages rows [first, last) of the device models into syn0 / syn1neg,
+// READBACK_ROWS at a time through the staging of the lane. The next rows
+// are requested before the current ones are averaged. rows_done, if given,
+// counts the rows ready for the other processes.
+void AverageRows(long long first, long long last, int lane, long long * rows_done) {
+	long long a, b;
+	ReadbackRows * rows = (ReadbackRows *) malloc(num_threads * sizeof(ReadbackRows));
+	if (first < last)
+		for (int i = 0; i < num_threads; i++)
+			gpuTrainers[i].requestRows(lane, first, first + READBACK_ROWS < last ? first + READBACK_ROWS : last);
+	for (long long a0 = first; a0 < last; a0 += READBACK_ROWS) {
+		long long a1 = a0 + READBACK_ROWS < last ? a0 + READBACK_ROWS : last;
+		for (int i = 0; i < num_threads; i++)
+			gpuTrainers[i].waitRows(lane, &rows[i]);
+		if (a1 < last)
+			for (int i = 0; i < num_threads; i++)
+				gpuTrainers[i].requestRows(lane, a1, a1 + READBACK_ROWS < last ? a1 + READBACK_ROWS : last);
+		if (sync_quantize)
+			AverageQuantizedRows(a0, a1, rows, lane);
+		else {
+			for (a = a0; a < a1; a++) {
+				for (b = 0; b < layer1_size; b++)
+				{
+					float value = 0;
+					int c = 0;
+					long long index = a * layer1_size_aligned + b;
+					long long row_index = (a - a0) * layer1_size_aligned + b;
+					for (int i = 0 ; i < num_threads; i++)
+					{
+						if (gpuTrainers[i].bitmap.getBit(a)) {
+							value += rows[i].values[0][row_index];
+							c++;
+						}
+					}
+					// Rows no device saw keep their value
+					if (c > 0)
+						syn0[index] = value / c;
+
+					// update global syn1neg
+					value = 0;
+					c = 0;
+					for (int i = 0 ; i < num_threads; i++)
+					{
+						if (rows[i].values[1][row_index] > 0)
+						{
+							value += rows[i].values[1][row_index];
+							c++;
+						}
+
+					}
+					syn1neg[index] = c > 0? (value / c) : 0;
+
+				}
+			}
+		}
+		if (rows_done != NULL) {
+			*rows_done += a1 - a0;
+			clusterRowsReady(*rows_done);
+		}
+	}
+	free(rows);
+}
+
+// Rows of one NUMA node, averaged by a thread pinned to it
+struct AverageRange {
+	long long first, last;
+	int node, lane;
+};
+
+void *AverageRowsThread(void * arg) {
+	AverageRange * range = (AverageRange *) arg;
+	topologyPinThread(range->node);
+	AverageRows(range->first, range->last, range->lane, NULL);
+	return NULL;
+}
+
+// Averages the device models into syn0 / syn1neg
+void AverageModel() {
+	// Other processes average the rows this one finished meanwhile
+	real * models[2] = { syn0, syn1neg };
+	clusterAverageBegin(models, 2, vocab_size, layer1_size_aligned);
+	if (sync_quantize)
+		for (int i = 0; i < num_threads; i++)
+			gpuTrainers[i].quantizeDelta();
+	int nodes = topologyNodeCount();
+	long long rows_done = 0;
+	for (int k = 0; k < clusterSegmentCount(); k++) {
+		int first, last;
+		clusterSegmentRows(k, &first, &last);
+		if (nodes < 2) {
+			AverageRows(first, last, 0, &rows_done);
+			continue;
+		}
+		// Every node averages the part of the segment that lives on it
+		pthread_t pt[MAX_NUMA_NODES];
+		AverageRange ranges[MAX_NUMA_NODES];
+		for (int n = 0; n < nodes; n++) {
+			long long node_first, node_last;
+			topologyRows(n, vocab_size, &node_first, &node_last);
+			ranges[n].first = node_first > first ? node_first : first;
+			ranges[n].last = node_last < last ? node_last : last;
+			if (ranges[n].last < ranges[n].first)
+				ranges[n].last = ranges[n].first;
+			ranges[n].node = topologyNode(n);
+			ranges[n].lane = n;
+			pthread_create(&pt[n], NULL, AverageRowsThread, &ranges[n]);
+		}
+		for (int n = 0; n < nodes; n++)
+			pthread_join(pt[n], NULL);
+		rows_done += last - first;
+		clusterRowsReady(rows_done);
+	}
+	clusterRowsReady(rows_done);
+	clusterAverageEnd();
+}
+
+static double MB(size_t bytes) {
+	return bytes / 1048576.0;
+}
+
+// Where the host and device memory of the run goes, printed once the
+// devices hold the model
+void MemoryReport() {
+	if (debug_mode == 0)
+		return;
+	size_t words = 0;
+	for (long long a = 0; a < vocab_size; a++)
+		words += strlen(vocab[a].word) + 1;
+	size_t vocab_bytes = vocab_max_size * sizeof(struct vocab_word) + words + vocab_hash_size * sizeof(int);
+	size_t model = (size_t) vocab_size * layer1_size_aligned * sizeof(real) * (negative > 0 ? 2 : 1);
+	// The reference, the residual and the quantized change of -sync-quantize
+	size_t sync = sync_quantize ? (model * (sync_quantize == 2 ? 2 : 1)
+			+ (size_t) vocab_size * (layer1_size + sizeof(float)) * (negative > 0 ? 2 : 1)) : 0;
+	size_t host = vocab_bytes + model + sync, device = 0;
+	int lanes = topologyNodeCount() > 1 ? topologyNodeCount() : 1;
+	TrainerMemory m;
+	for (int i = 0; i < num_threads; i++) {
+		gpuTrainers[i].memoryUsage(lanes, &m);
+		host += m.host_batches + m.host_model + m.host_readback;
+		device += m.device_model + m.device_tables + m.device_batches;
+	}
+	printf("Memory: %.1f MB host, %.1f MB on the devices\n", MB(host), MB(device));
+	printf("\tvocabulary: %.1f MB (entries %.1f, words %.1f, hash %.1f)\n", MB(vocab_bytes),
+			MB(vocab_max_size * sizeof(struct vocab_word)), MB(words), MB(vocab_hash_size * sizeof(int)));
+	printf("\tmodel: %.1f MB\n", MB(model));
+	if (sync_quantize)
+		printf("\tquantized sync: %.1f MB\n", MB(sync));
+	if (negative > 0)
+		printf("\tunigram table: %.1f MB, freed once uploaded\n", MB(table_size * sizeof(int)));
+	for (int i = 0; i < num_threads; i++) {
+		gpuTrainers[i].memoryUsage(lanes, &m);
+		printf("\tdevice %d (%s): host %.1f MB (batches %.1f, model copy %.1f, readback staging %.1f),\n", i,
+				gpuTrainers[i].getDeviceName(), MB(m.host_batches + m.host_model + m.host_readback),
+				MB(m.host_batches), MB(m.host_model), MB(m.host_readback));
+		printf("\t\tdevice %.1f MB (model %.1f, tables %.1f, batches %.1f)\n",
+				MB(m.device_model + m.device_tables + m.device_batches), MB(m.device_model),
+				MB(m.device_tables), MB(m.device_batches));
+	}
+	fflush(stdout);
+}
+
+// Turns the host copy of every device model into the correction that brings
+// it to the average, applied later by GPUTrainer::mergeDelta()
+void ComputeDeltas() {
+	long long size = (long long) vocab_size * layer1_size_aligned;
+	for (long long first = 0; first < size; first += AVERAGE_BLOCK)
+		for (int i = 0; i < num_threads; i++) {
+			long long last = first + AVERAGE_BLOCK < size ? first + AVERAGE_BLOCK : size;
+			real * delta0 = gpuTrainers[i].getSyn0();
+			real * delta1 = gpuTrainers[i].getSyn1Neg();
+			for (long long j = first; j < last; j++) {
+				delta0[j] = syn0[j] - delta0[j];
+				delta1[j] = syn1neg[j] - delta1[j];
+			}
+		}
+}
+
+// -sync-quantize, at the first distribution: the devices got the whole
+// model, it is the reference of the changes from now on
+void InitSyncQuantize() {
+	size_t size = (size_t) vocab_size * layer1_size_aligned;
+	real * models[2] = { syn0, syn1neg };
+	for (int m = 0; m < (negative > 0 ? 2 : 1); m++) {
+		sync_ref[m] = (real *) malloc(size * sizeof(real));
+		sync_residual[m] = sync_quantize == 2 ? (real *) calloc(size, sizeof(real)) : NULL;
+		sync_q[m] = (signed char *) malloc((size_t) vocab_size * layer1_size);
+		sync_scale[m] = (float *) malloc(vocab_size * sizeof(float));
+		if (sync_ref[m] == NULL || (sync_quantize == 2 && sync_residual[m] == NULL) || sync_q[m] == NULL
+				|| sync_scale[m] == NULL) {
+			printf("Memory allocation failed\n");
+			exit(1);
+		}
+		memcpy(sync_ref[m], models[m], size * sizeof(real));
+	}
+	for (int i = 0; i < num_threads; i++)
+		gpuTrainers[i].resetReference();
+}
+
+// -sync-quantize: sends the change of the averaged model since the last
+// distribution as 8-bit rows, the devices add it to their reference and
+// the host to its copy of it
+void DistributeQuantized() {
+	real * models[2] = { syn0, syn1neg };
+	real * change = (real *) malloc(layer1_size * sizeof(real));
+	for (int m = 0; m < (negative > 0 ? 2 : 1); m++)
+		for (long long a = 0; a < vocab_size; a++) {
+			real * ref = sync_ref[m] + a * layer1_size_aligned;
+			real * model = models[m] + a * layer1_size_aligned;
+			real * residual = sync_residual[m] ? sync_residual[m] + a * layer1_size_aligned : NULL;
+			for (long long b = 0; b < layer1_size; b++)
+				change[b] = model[b] - ref[b] + (residual ? residual[b] : 0);
+			signed char * q = sync_q[m] + a * layer1_size;
+			float scale = quantizeRow(change, layer1_size, q, residual);
+			sync_scale[m][a] = scale;
+			for (long long b = 0; b < layer1_size; b++) {
+				ref[b] += q[b] * scale;
+				sync_change[MAX_READBACK_LANES] += change[b] * change[b];
+				sync_noise[MAX_READBACK_LANES] += (change[b] - q[b] * scale) * (change[b] - q[b] * scale);
+			}
+		}
+	free(change);
+	for (int i = 0; i < num_threads; i++)
+		gpuTrainers[i].applyDelta(sync_q, sync_scale);
+}
+
+// Bytes the last sync step moved, and with -sync-quantize how far rounding
+// took the change of the model off, relative to the change
+void SyncReport(const char * step, unsigned long long bytes_before) {
+	double change = 0, noise = 0;
+	for (int k = 0; k <= MAX_READBACK_LANES; k++) {
+		change += sync_change[k];
+		noise += sync_noise[k];
+		sync_change[k] = sync_noise[k] = 0;
+	}
+	if (debug_mode == 0)
+		return;
+	printf("%s: %.1f MB between host and devices", step, (metricsSyncBytes() - bytes_before) / 1048576.0);
+	if (sync_quantize && change > 0)
+		printf(", rounding error %.2f%% of the change (RMS)", 100 * sqrt(noise / change));
+	printf("\n");
+	fflush(stdout);
+}
+
+// Background averaging of the last epoch's snapshot. The trainer threads
+// wait for it at their next safe point, see WaitAverage().
+pthread_t average_thread;
+int average_pending = 0, average_done = 0;
+pthread_mutex_t average_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t average_cond = PTHREAD_COND_INITIALIZER;
+
+void *AverageModelThread(void *) {
+	unsigned long long start = monotonicNs();
+	AverageModel();
+	ComputeDeltas();
+	unsigned long long end = monotonicNs();
+	profilerHostSpan(HOST_TRACK, "average model (async)", start, end);
+	pthread_mutex_lock(&average_mutex);
+	average_done = 1;
+	pthread_cond_broadcast(&average_cond);
+	pthread_mutex_unlock(&average_mutex);
+	return NULL;
+}
+
+void WaitAverage() {
+	pthread_mutex_lock(&average_mutex);
+	while (!average_done)
+		pthread_cond_wait(&average_cond, &average_mutex);
+	pthread_mutex_unlock(&average_mutex);
+}
+
+// The words by row of syn0
+char **VocabWords() {
+	static char ** words = NULL;
+	if (words == NULL) {
+		words = (char **) malloc(vocab_size * sizeof(char *));
+		for (int a = 0; a < vocab_size; a++)
+			words[a] = vocab[a].word;
+	}
+	return words;
+}
+
+// Evaluates syn0, label tells when in the run it was taken
+void EvalModel(const char * label) {
+	if (cluster_rank != 0)
+		return;
+	evalModel(VocabWords(), syn0, vocab_size, layer1_size, layer1_size_aligned, label);
+}
+
+void EvalAtSync(unsigned int local_iter) {
+	char label[MAX_STRING];
+	if (!eval_sync || !evalEnabled())
+		return;
+	snprintf(label, sizeof(label), "after iteration %d, %.1fs, %lluk words", local_iter + 1,
+			metricsElapsed(), metricsTotalWords() / 1000);
+	EvalModel(label);
+}
+
+// -sync-quantize: the final model is averaged at full precision. With
+// evaluation on, the quantized average of the same device models is scored
+// first, the "final" score after it shows what the rounding cost.
+void AverageFullPrecision() {
+	unsigned long long sync_bytes = metricsSyncBytes();
+	if (evalEnabled())
+		EvalModel("final, quantized average");
+	int quantize = sync_quantize;
+	sync_quantize = 0;
+	AverageModel();
+	SyncReport("Averaged the model at full precision", sync_bytes);
+	sync_quantize = quantize;
+}
+
+// Batches of one device between its tokenizer threads and the thread
+// driving it. Slot indices circulate through the queues: free ones wait to
+// be filled, full ones to be trained.
+struct DeviceFeed {
+	BatchQueue free_slots, full_slots;
+	// What the tokenizer packed into each slot
+	std::vector<int> ntokens, sentence_num;
+	std::vector<real> alpha;
+	int tokenizers_done;
+};
+std::vector<DeviceFeed> feeds;
+
+struct TokenizerArgs {
+	int device, index;
+};
+
+// Allocated once the batch geometry is final, every slot starts free
+void InitFeeds() {
+	feeds.resize(num_threads);
+	for (int i = 0; i < num_threads; i++) {
+		DeviceFeed & feed = feeds[i];
+		int slots = gpuTrainers[i].getSlotCount();
+		batchQueueInit(&feed.free_slots, slots);
+		batchQueueInit(&feed.full_slots, slots);
+		feed.ntokens.resize(slots);
+		feed.sentence_num.resize(slots);
+		feed.alpha.resize(slots);
+		for (int s = 0; s < slots; s++)
+			batchQueuePush(&feed.free_slots, s);
+	}
+}
+
+// Tokenizes one part of the range of a device into free slots of the
+// device and queues them for training
+void *TokenizerThread(void *arg) {
+	TokenizerArgs * args = (TokenizerArgs *) arg;
+	int word, ntokens;
+	unsigned long long word_count = 0, last_word_count = 0;
+	int fid = args->device;
 	int sentence_num;
-	clock_t now;
-	int * sen = gpuTrainers[fid].getSentencePtr();
-	real * alpha_ptr = (float *) sen + MAX_SENTENCE_NUM * MAX_SENTENCE_LENGTH;
-	//FILE *fi = fopen(train_file, "rb");
-	//fseek(fi, file_size / (int)num_threads * (long)id, SEEK_SET);
-	//printf("opening file\n");
-
-	open_buffered_file(fid, gpuTrainers[fid].getStart());
-	//printf("resetting file\n");
-	//reset_read_word();
-	unsigned int maxPartialCount =(unsigned int)( train_words * (gpuTrainers[fid].getEnd() - gpuTrainers[fid].getStart()));
-
-	sentence_length = 0;
-	sentence_num = 0;
-	int count_kernels = 0;
+	real thread_alpha = CurrentAlpha(word_count_actual);
+	GPUTrainer & trainer = gpuTrainers[fid];
+	DeviceFeed & feed = feeds[fid];
+	const BatchGeometry & geometry = trainer.getGeometry();
+	// Tokenize on the socket the device is attached to, the reader buffers
+	// are then first touched there too
+	topologyPinThread(trainer.getNumaNode());
+
+	// The part of the device range this tokenizer reads, from the shard
+	// index if there is one. Otherwise from a fraction of the file until
+	// its share of the words.
+	double part = (trainer.getEnd() - trainer.getStart()) / tokenizer_threads;
+	double first = trainer.getStart() + part * args->index;
+	double last = args->index == tokenizer_threads - 1 ? trainer.getEnd() : first + part;
+	ShardRange range;
+	Reader * reader;
+	unsigned long long maxPartialCount = ~0ULL;
+	if (shardRange(first, last, &range))
+		reader = shardOpen(train_file, &range);
+	else {
+		// Compressed ranges end at a frame, the words of a frame are not known
+		reader = readerOpenRange(train_file, first, last);
+		if (reader->decoder == NULL)
+			maxPartialCount = (unsigned long long) (train_words * (last - first));
+	}
+
 	while (1) {
 		if (word_count - last_word_count > 10000) {
-			word_count_actual += word_count - last_word_count;
+			unsigned long long words_done = __sync_add_and_fetch(&word_count_actual,
+					word_count - last_word_count);
+			metricsAddWords(fid, word_count - last_word_count);
 			last_word_count = word_count;
+			thread_alpha = CurrentAlpha(words_done);
 			if ((debug_mode > 1)) {
-				now = clock();
 				printf(
-						"%cAlpha: %f  Progress: %.2f%%  Words/thread/sec: %.2fk  ",
-						13, alpha,
-						word_count_actual / (real) (iter * train_words + 1)
+						"%cAlpha: %f  Progress: %.2f%%  Words/sec: %.2fk  ",
+						13, thread_alpha,
+						words_done * (real) cluster_size / (real) (iter * train_words + 1)
 								* 100,
-						word_count_actual
-								/ ((real) (now - start + 1)
-										/ (real) CLOCKS_PER_SEC * 1000));
+						metricsWordsPerSec(HOST_TRACK) / 1000);
 				fflush(stdout);
 			}
-			alpha = starting_alpha
-					* (1 - word_count_actual / (real) (iter * train_words + 1));
-			if (alpha < starting_alpha * 0.0001)
-				alpha = starting_alpha * 0.0001;
 		}
 
-		while (1) {
-			word = ReadWordIndex(fid);
-			if (end_flag[fid])
+		int slot;
+		for (int attempt = 0; !batchQueuePop(&feed.free_slots, &slot); attempt++)
+			batchQueueIdle(attempt);
+		unsigned long long assemble_start = monotonicNs();
+		// With shared memory the arrays are the device buffers of the batch
+		trainer.beginBatch(slot);
+		int * sen = trainer.getSentencePtr(slot);
+		int * offsets = trainer.getOffsetsPtr(slot);
+		// Pack the batch CSR style: word ids back to back, offsets[s] is the
+		// start of sentence s and offsets[sentence_num] the end of the last one
+		ntokens = 0;
+		sentence_num = 0;
+		offsets[0] = 0;
+		while (ntokens < geometry.batchTokens()) {
+			word = ReadWordIndex(reader);
+			if (reader->end_flag)
 				break;
 			if (word == -1)
 				continue;
 			word_count++;
-			if (word == 0)
-				break;
-			// The subsampling randomly discards frequent words while keeping the ranking same
-			if (sample > 0) {
-				real ran = (sqrt(vocab[word].cn / (sample * train_words)) + 1)
-						* (sample * train_words) / vocab[word].cn;
-				next_random = next_random * (unsigned int) 1664525 + 1013904223;
-				if (ran < (next_random & 0xFFFF) / (real) 65536)
-					continue;
+			// </s> closes the current sentence, empty sentences are not stored
+			if (word == 0) {
+				if (ntokens > offsets[sentence_num])
+					offsets[++sentence_num] = ntokens;
+				continue;
 			}
-			sen[sentence_num * MAX_SENTENCE_LENGTH + sentence_length] = word;
-			if (gpuTrainers[fid].bitmap.getBit(word) == 0)
+			// Subsampling of frequent words happens on the device, see keep_table
+			sen[ntokens++] = word;
+			if (trainer.bitmap.getBit(word) == 0)
 			{
-				gpuTrainers[fid].bitmap.setBit(word);
-			}
-			sentence_length++;
-			if (sentence_length >= MAX_SENTENCE_LENGTH) {
-				alpha_ptr[sentence_num] = alpha;
-				sentence_num++;
-				sentence_length = 0;
-				if (sentence_num >= MAX_SENTENCE_NUM)
-					break;
+				trainer.bitmap.setBit(word);
 			}
+			// Overlong sentences are split
+			if (ntokens - offsets[sentence_num] >= geometry.sentence_length)
+				offsets[++sentence_num] = ntokens;
 		}
+		// Keep the words of the last, partially filled sentence
+		if (ntokens > offsets[sentence_num])
+			offsets[++sentence_num] = ntokens;
+
+		profilerHostSpan(fid, "assemble batch", assemble_start, monotonicNs());
+
+		// The queues hold every slot, pushing never fails
+		if (ntokens > 0) {
+			feed.ntokens[slot] = ntokens;
+			feed.sentence_num[slot] = sentence_num;
+			feed.alpha[slot] = thread_alpha;
+			batchQueuePush(&feed.full_slots, slot);
+		} else
+			batchQueuePush(&feed.free_slots, slot);
 
-		if (benchmark > 0 && count_kernels == benchmark)
-			exit(1);
-		// Do GPU training here
-		gpuTrainers[fid].trainGPU(sentence_num);
-		count_kernels++;
-		//////////////////////
-		sentence_num = 0;
-		sentence_length = 0;
-
-		if (end_flag[fid] || (word_count > maxPartialCount)) {
-			word_count_actual += word_count - last_word_count;
+		if (reader->end_flag || (word_count > maxPartialCount)) {
+			__sync_add_and_fetch(&word_count_actual, word_count - last_word_count);
+			metricsAddWords(fid, word_count - last_word_count);
 			break;
 		}
+	}
+	readerClose(reader);
+	__sync_add_and_fetch(&feed.tokenizers_done, 1);
+	return NULL;
+}
 
+// Drives one device: starts its tokenizers and trains the batches they
+// queue until all of them are done
+void *TrainModelThread(void *id) {
+	int fid = (int) (long) id;
+	GPUTrainer & trainer = gpuTrainers[fid];
+	DeviceFeed & feed = feeds[fid];
+	topologyPinThread(trainer.getNumaNode());
+	feed.tokenizers_done = 0;
+	pthread_t * pt = (pthread_t *) malloc(tokenizer_threads * sizeof(pthread_t));
+	TokenizerArgs * args = (TokenizerArgs *) malloc(tokenizer_threads * sizeof(TokenizerArgs));
+	for (int t = 0; t < tokenizer_threads; t++) {
+		args[t].device = fid;
+		args[t].index = t;
+		pthread_create(&pt[t], NULL, TokenizerThread, &args[t]);
 	}
 
-	gpuTrainers[fid].getResultData();
-	close_buffered_file(fid);
+	int count_kernels = 0;
+	for (int attempt = 0;; attempt++) {
+		// Read before the pop: once all tokenizers are done, an empty queue
+		// stays empty
+		int done = __sync_add_and_fetch(&feed.tokenizers_done, 0);
+		int slot;
+		if (!batchQueuePop(&feed.full_slots, &slot)) {
+			if (done == tokenizer_threads)
+				break;
+			batchQueueIdle(attempt);
+			continue;
+		}
+		attempt = -1;
+		if (benchmark > 0 && count_kernels == benchmark)
+			exit(1);
+		// Do GPU training here
+		trainer.trainGPU(slot, feed.ntokens[slot], feed.sentence_num[slot], feed.alpha[slot]);
+		count_kernels++;
+		batchQueuePush(&feed.free_slots, slot);
+	}
+	for (int t = 0; t < tokenizer_threads; t++)
+		pthread_join(pt[t], NULL);
+	free(pt);
+	free(args);
+
+	unsigned long long sync_start = monotonicNs();
+	// Safe point: the device is idle, apply the average of the last epoch
+	if (average_pending) {
+		WaitAverage();
+		trainer.mergeDelta();
+	}
+	trainer.getResultData();
+	unsigned long long sync_end = monotonicNs();
+	profilerHostSpan(fid, "read back", sync_start, sync_end);
+	metricsAddSyncTime(fid, sync_end - sync_start);
 	pthread_exit(NULL);
 }
 
@@ -633,72 +1248,112 @@ void TrainModel() {
 
 	printf("Starting training using file %s\n", train_file);
 	starting_alpha = alpha;
-	LearnVocabFromTrainFile();
-	/*if (read_vocab_file[0] != 0) ReadVocab(); else LearnVocabFromTrainFile();
-	 if (save_vocab_file[0] != 0) SaveVocab();*/
+	if (read_vocab_file[0] != 0 && ReadVocab()) {
+		// Already saved when both name the same file
+		if (save_vocab_file[0] != 0 && strcmp(save_vocab_file, read_vocab_file))
+			SaveVocab();
+	} else {
+		LearnVocabFromTrainFile();
+		if (save_vocab_file[0] != 0)
+			SaveVocab();
+	}
 	if (output_file[0] == 0)
 		return;
+	clusterInit();
+	profilerInit();
+	// Device contexts and programs are built in the background while the
+	// host initializes the model and the unigram table
+	initializeGPU();
 	InitNet();
 	if (negative > 0)
 		InitUnigramTable();
-	initializeGPU();
+	InitSubsampleTable();
+	uploadGPUData();
+	topologyReport();
 	num_threads = gpuTrainers.size();
 	pthread_t *pt = (pthread_t *) malloc(num_threads * sizeof(pthread_t));
-	start = clock();
+	metricsInit(num_threads);
+	if (autotuneNeeded()) {
+		int * sample = (int *) malloc(AUTOTUNE_SAMPLE_TOKENS * sizeof(int));
+		autotuneDevices(sample, ReadSample(sample, AUTOTUNE_SAMPLE_TOKENS));
+		free(sample);
+		// Forget the batches of the timed runs
+		metricsInit(num_threads);
+	}
+	MemoryReport();
+	InitFeeds();
+	metricsStart();
 	// loop iteration
 	for (unsigned int local_iter = 0; local_iter < iter; local_iter++){
-		// distribute global syn0 to all GPUTrainer's syn0
-		if (local_iter % NUM_ITERATION_DO_SYNC_SYN0 == 0){
-			for (int i = 0; i < num_threads; i++)
-			{
-				gpuTrainers[i].updateSyn0(syn0);
-				gpuTrainers[i].updateSyn1Neg(syn1neg);
-			}
+		// distribute global syn0 to all GPUTrainer's syn0, async averaging
+		// merges the average into the devices instead
+		if (local_iter == 0 || (!async_average && local_iter % NUM_ITERATION_DO_SYNC_SYN0 == 0)){
+			unsigned long long sync_start = monotonicNs();
+			unsigned long long sync_bytes = metricsSyncBytes();
+			if (sync_quantize && local_iter > 0)
+				DistributeQuantized();
+			else
+				for (int i = 0; i < num_threads; i++)
+				{
+					gpuTrainers[i].updateSyn0(syn0);
+					gpuTrainers[i].updateSyn1Neg(syn1neg);
+				}
+			if (sync_quantize && local_iter == 0)
+				InitSyncQuantize();
+			SyncReport("Distributed the model", sync_bytes);
+			unsigned long long sync_end = monotonicNs();
+			profilerHostSpan(HOST_TRACK, "distribute model", sync_start, sync_end);
+			metricsAddSyncTime(HOST_TRACK, sync_end - sync_start);
 		}
 		// launch threads
 		for (a = 0; a < num_threads; a++)
 			pthread_create(&pt[a], NULL, TrainModelThread, (void *) a);
 		for (a = 0; a < num_threads; a++)
 			pthread_join(pt[a], NULL);
+		if (average_pending) {
+			pthread_join(average_thread, NULL);
+			average_pending = 0;
+			// syn0 holds the average of the previous iteration
+			EvalAtSync(local_iter - 1);
+		}
 
-		// update global syn0 from all GPUTrainer's syn0
-		if ((local_iter % NUM_ITERATION_DO_SYNC_SYN0 == 0) || (local_iter == iter -1)){
-			for (a = 0; a < vocab_size ; a++)
-				for (b = 0; b < layer1_size; b++)
-				{
-					float value = 0;
-					int c = 0;
-					int index = a * layer1_size_aligned + b;
-					for (int i = 0 ; i < num_threads; i++)
-					{
-						if (gpuTrainers[i].bitmap.getBit(a)) {
-							value += gpuTrainers[i].getSyn0()[index];
-							c++;
-						}
-					}
-					syn0[index] = value / c;
-
-					// update global syn1neg
-					value = 0;
-					c = 0;
-					index = a * layer1_size_aligned + b;
-					for (int i = 0 ; i < num_threads; i++)
-					{
-						if (gpuTrainers[i].getSyn1Neg()[index] > 0)
-						{
-							value += gpuTrainers[i].getSyn1Neg()[index];
-							c++;
-						}
-
-					}
-					syn1neg[index] = c > 0? (value / c) : 0;
-
-				}
+		// update global syn0 from all GPUTrainer's syn0, in the background
+		// while the next epoch trains if async averaging is on
+		if (async_average && local_iter < iter - 1) {
+			average_done = 0;
+			average_pending = 1;
+			pthread_create(&average_thread, NULL, AverageModelThread, NULL);
+		}
+		else if ((local_iter % NUM_ITERATION_DO_SYNC_SYN0 == 0) || (local_iter == iter -1)){
+			unsigned long long sync_start = monotonicNs();
+			unsigned long long sync_bytes = metricsSyncBytes();
+			AverageModel();
+			SyncReport("Averaged the model", sync_bytes);
+			if (sync_quantize && local_iter == iter - 1)
+				AverageFullPrecision();
+			unsigned long long sync_end = monotonicNs();
+			profilerHostSpan(HOST_TRACK, "average model", sync_start, sync_end);
+			metricsAddSyncTime(HOST_TRACK, sync_end - sync_start);
+			if (local_iter < iter - 1)
+				EvalAtSync(local_iter);
 		}
+		if (debug_mode > 0)
+			metricsPrintSummary();
 	}
+	metricsStop();
+	clusterReport(metricsTotalWords(), metricsElapsed());
+	topologyReport(metricsTotalWords(), metricsElapsed());
+	if (evalEnabled())
+		EvalModel("final");
+	clusterClose();
+	profilerWrite();
+	releaseGPU();
 
 
 //	cleanUpGPU();
+	// All ranks hold the same averaged model, the first one saves it
+	if (cluster_rank != 0)
+		return;
 	fo = fopen(output_file, "wb");
 	if (classes == 0) {
 		// Save the word vectors
@@ -714,8 +1369,26 @@ void TrainModel() {
 					fprintf(fo, "%f ", syn0[a * layer1_size_aligned + b]);
 			fprintf(fo, "\n");
 		}
+	} else {
+		// Run K-means on the word vectors
+		if (classes > vocab_size)
+			classes = vocab_size;
+		real * centroids = (real *) malloc((long long) classes * layer1_size * sizeof(real));
+		int * cl = (int *) malloc(vocab_size * sizeof(int));
+		KmeansStats stats;
+		double error = kmeans(syn0, vocab_size, layer1_size, layer1_size_aligned, classes,
+				class_iterations, 1, centroids, cl, &stats);
+		printf("Classes: %d of %d words in %.2fs (seeding %.2fs, %d iterations), mean squared distance %f\n",
+				classes, vocab_size, stats.total_ns / 1e9, stats.seed_ns / 1e9, stats.iterations, error);
+		// Save the K-means classes
+		for (a = 0; a < vocab_size; a++)
+			fprintf(fo, "%s %d\n", vocab[a].word, cl[a]);
+		free(centroids);
+		free(cl);
 	}
 	fclose(fo);
+	if (pq_output_file[0])
+		pqExport(VocabWords(), syn0, vocab_size, layer1_size, layer1_size_aligned);
 }
 
 int ArgPos(char *str, int argc, char **argv) {
@@ -733,12 +1406,14 @@ int ArgPos(char *str, int argc, char **argv) {
 
 int main(int argc, char **argv) {
 	int i;
+	metricsMarkLaunch();
 	if (argc == 1) {
 		printf("WORD VECTOR estimation toolkit v 0.1c\n\n");
 		printf("Options:\n");
 		printf("Parameters for training:\n");
 		printf("\t-train <file>\n");
-		printf("\t\tUse text data from <file> to train the model\n");
+		printf("\t\tUse text data from <file> to train the model; .gz and .zst files are decompressed while reading,\n");
+		printf("\t\tdevices read in parallel when the file has several members / frames (bgzip, pzstd)\n");
 		printf("\t-output <file>\n");
 		printf(
 				"\t\tUse <file> to save the resulting word vectors / word clusters\n");
@@ -769,6 +1444,11 @@ int main(int argc, char **argv) {
 		printf("\t-classes <int>\n");
 		printf(
 				"\t\tOutput word classes rather than word vectors; default number of classes is 0 (vectors are written)\n");
+		printf("\t-class-iter <int>\n");
+		printf("\t\tAt most <int> k-means iterations for -classes; default is 10\n");
+		printf("\t-bench-classes <int>\n");
+		printf(
+				"\t\tTime the -classes k-means on random vectors of -size floats for 10000 up to <int> words and exit\n");
 		printf("\t-debug <int>\n");
 		printf(
 				"\t\tSet the debug mode (default = 2 = more info during training)\n");
@@ -776,13 +1456,117 @@ int main(int argc, char **argv) {
 		printf(
 				"\t\tSave the resulting vectors in binary moded; default is 0 (off)\n");
 		printf("\t-save-vocab <file>\n");
-		printf("\t\tThe vocabulary will be saved to <file>\n");
+		printf("\t\tThe vocabulary will be saved to <file> (binary, with the size and time of the training file)\n");
 		printf("\t-read-vocab <file>\n");
 		printf(
-				"\t\tThe vocabulary will be read from <file>, not constructed from the training data\n");
+				"\t\tThe vocabulary will be read from <file>, not constructed from the training data; it is counted\n");
+		printf("\t\tagain if the training file changed. Give the same <file> to -save-vocab to cache the vocabulary\n");
 		printf("\t-cbow <int>\n");
 		printf(
 				"\t\tUse the continuous bag of words model; default is 1 (use 0 for skip-gram model)\n");
+		printf("\t-profile <file>\n");
+		printf(
+				"\t\tRecord OpenCL events and host spans and save them to <file> as a Chrome trace (JSON)\n");
+		printf("\t-metrics <file>\n");
+		printf(
+				"\t\tPeriodically write per-device throughput metrics to <file> in Prometheus text format\n");
+		printf("\t-metrics-interval <int>\n");
+		printf("\t\tSeconds between two metrics file updates; default is 10\n");
+		printf("\t-threads-per-word <int>\n");
+		printf("\t\tWork group size of the training kernel, a power of two; default is 128\n");
+		printf("\t-batch-sentences <int>\n");
+		printf("\t\tSentences of -sentence-length words per device batch; default is 6\n");
+		printf("\t-sentence-length <int>\n");
+		printf("\t\tLonger sentences are split; default is 102400\n");
+		printf("\t-autotune <int>\n");
+		printf(
+				"\t\tPick threads per word and batch sentences per device from short timed runs; default is 0 (off),\n");
+		printf("\t\t1 reuses cached results, 2 always tunes\n");
+		printf("\t-autotune-cache <file>\n");
+		printf("\t\tCache of the tuned settings per device; default is word2vec.autotune\n");
+		printf("\t-async-average <int>\n");
+		printf(
+				"\t\tAverage the device models in the background while the next iteration trains and merge the\n");
+		printf("\t\tresult into the devices one iteration later; default is 0 (off)\n");
+		printf("\t-cluster <file>\n");
+		printf(
+				"\t\tTrain with one process per line of <file> (\"host port\"), each on its own shard of the corpus,\n");
+		printf("\t\taveraging the models over TCP\n");
+		printf("\t-rank <int>\n");
+		printf("\t\tLine of the -cluster file of this process; default is 0\n");
+		printf("\t-eval-analogy <file>\n");
+		printf(
+				"\t\tScore the final model on the analogy questions in <file> (questions-words.txt format), 3CosAdd and 3CosMul\n");
+		printf("\t-eval-similarity <file>\n");
+		printf("\t\tScore the final model on the word pairs with similarity ratings in <file> (Spearman correlation)\n");
+		printf("\t-eval-vocab <int>\n");
+		printf("\t\tAnswer analogies among the <int> most frequent words; default is 30000\n");
+		printf("\t-eval-sync <int>\n");
+		printf("\t\tIf 1, also evaluate after every model average to follow quality over time\n");
+		printf("\t-eval-model <file>\n");
+		printf("\t\tOnly evaluate the model saved in <file> (text, or binary with -binary 1) and exit\n");
+		printf("\t-pq-output <file>\n");
+		printf(
+				"\t\tAlso save the vectors product quantized to <file>, one byte per subspace, and report size and recall\n");
+		printf("\t-pq-subspaces <int>\n");
+		printf("\t\tNumber of subspaces (bytes per vector) of -pq-output; default is a quarter of -size\n");
+		printf("\t-pq-train <int>\n");
+		printf("\t\tTrain the codebooks on <int> vectors spread over the vocabulary; default is 32768\n");
+		printf("\t-vocab-memory <int>\n");
+		printf(
+				"\t\tCount the vocabulary in <int> MB: rare words are counted approximately in a count-min sketch\n");
+		printf("\t\tand enter the exact table once they may reach min-count; default is 0 (exact counting)\n");
+		printf("\t-numa <int>\n");
+		printf(
+				"\t\tPin the thread feeding each device to the NUMA node of the device and place its buffers there;\n");
+		printf("\t\tdefault is 1, use 0 to compare\n");
+		printf("\t-zero-copy <int>\n");
+		printf(
+				"\t\tDevices sharing memory with the host (CPU, integrated GPU) fill batches and read results in place,\n");
+		printf("\t\tdiscrete ones transfer through pinned memory; default is 1, use 0 for plain host copies\n");
+		printf("\t-queue-depth <int>\n");
+		printf(
+				"\t\tBatches in flight per device (max %d); uploads of the next batches overlap the running kernel;\n",
+				MAX_QUEUE_DEPTH);
+		printf("\t\tdefault is 2, use 1 to serialize upload and training\n");
+		printf("\t-tokenizer-threads <int>\n");
+		printf("\t\tThreads tokenizing the corpus for each device (max %d); default is 0, the CPUs shared\n",
+				MAX_TOKENIZER_THREADS);
+		printf("\t\tamong the devices, at most %d per device\n", AUTO_TOKENIZER_THREADS);
+		printf("\t-cbow-tile <int>\n");
+		printf(
+				"\t\tTrain <int> consecutive positions per work group, reading the syn0 rows of their windows once;\n");
+		printf("\t\tcut to what fits local memory. Default is 0, one position per work group; devices without\n");
+		printf("\t\tlockstep wavefronts of 32 or 64 threads, such as CPUs, always train with tiles\n");
+		printf("\t-sync-quantize <int>\n");
+		printf(
+				"\t\tSynchronous averaging moves the change of the model since the last sync as 8-bit rows with a scale\n");
+		printf(
+				"\t\teach, about a quarter of the bytes; 2 also carries what rounding left out into the next sync (error\n");
+		printf(
+				"\t\tfeedback). Default is 0, the whole model. The final average is taken at full precision; with\n");
+		printf("\t\t-eval-analogy / -eval-similarity the quantized one is scored before it for comparison\n");
+		printf("\t-device-type <string>\n");
+		printf("\t\tType of the devices to train on: gpu, cpu, accelerator or all; default is gpu\n");
+		printf("\t-devices <list>\n");
+		printf("\t\tNumbers of the devices to train on as listed at startup, separated by commas, e.g. 1,3;\n");
+		printf("\t\tdefault is all devices of -device-type\n");
+		printf("\t-sub-devices <int>\n");
+		printf(
+				"\t\tSplit every device into <int> sub-devices with equal compute units, a trainer each; default is 1.\n");
+		printf("\t\tWith -device-type cpu this tests and benchmarks several devices on one machine\n");
+		printf("\t-check-tokenizer <int>\n");
+		printf(
+				"\t\tIf 1, compare the vector and the byte by byte scanner with the original tokenizer on built-in\n");
+		printf("\t\tfixtures and with each other on the training file, if given, and exit\n");
+		printf("\t-check-shards <int>\n");
+		printf(
+				"\t\tIndex the training file, tokenize it in <int> shards from the index, compare with one pass\n");
+		printf("\t\tover the whole file and exit\n");
+		printf("\t-check-queue <int>\n");
+		printf(
+				"\t\tPass values through a batch queue of four cells with <int> producer and <int> consumer threads,\n");
+		printf("\t\tcheck each arrives once and in order and exit\n");
 		printf("\nExamples:\n");
 		printf(
 				"./word2vec -train data.txt -output vec.txt -size 200 -window 5 -sample 1e-4 -negative 5 -hs 0 -binary 0 -cbow 1 -iter 3\n\n");
@@ -791,6 +1575,8 @@ int main(int argc, char **argv) {
 	output_file[0] = 0;
 	save_vocab_file[0] = 0;
 	read_vocab_file[0] = 0;
+	profile_file[0] = 0;
+	metrics_file[0] = 0;
 	if ((i = ArgPos((char *) "-size", argc, argv)) > 0) {
 		layer1_size = atoi(argv[i + 1]);
 		layer1_size_aligned = ((layer1_size - 1) / ALIGNMENT_FACTOR + 1)
@@ -830,8 +1616,102 @@ int main(int argc, char **argv) {
 		min_count = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-classes", argc, argv)) > 0)
 		classes = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-class-iter", argc, argv)) > 0)
+		class_iterations = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-bench-classes", argc, argv)) > 0)
+		bench_classes = atoi(argv[i + 1]);
 	if ((i = ArgPos((char *) "-benchmark", argc, argv)) > 0)
 		benchmark = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-profile", argc, argv)) > 0) {
+		strcpy(profile_file, argv[i + 1]);
+		profiling = 1;
+	}
+	if ((i = ArgPos((char *) "-metrics", argc, argv)) > 0)
+		strcpy(metrics_file, argv[i + 1]);
+	if ((i = ArgPos((char *) "-metrics-interval", argc, argv)) > 0)
+		metrics_interval = atoi(argv[i + 1]);
+	if (metrics_interval < 1) {
+		printf("-metrics-interval is at least 1 second\n");
+		return 1;
+	}
+	if ((i = ArgPos((char *) "-threads-per-word", argc, argv)) > 0)
+		default_geometry.threads_per_word = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-batch-sentences", argc, argv)) > 0)
+		default_geometry.sentence_num = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-sentence-length", argc, argv)) > 0)
+		default_geometry.sentence_length = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-autotune", argc, argv)) > 0)
+		autotune = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-autotune-cache", argc, argv)) > 0)
+		strcpy(autotune_cache, argv[i + 1]);
+	if ((i = ArgPos((char *) "-async-average", argc, argv)) > 0)
+		async_average = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-cluster", argc, argv)) > 0)
+		strcpy(cluster_file, argv[i + 1]);
+	if ((i = ArgPos((char *) "-rank", argc, argv)) > 0)
+		cluster_rank = atoi(argv[i + 1]);
+	if (cluster_rank != 0 && cluster_file[0] == 0) {
+		printf("-rank %d needs the -cluster file it is a line of\n", cluster_rank);
+		return 1;
+	}
+	if ((i = ArgPos((char *) "-eval-analogy", argc, argv)) > 0)
+		strcpy(eval_analogy_file, argv[i + 1]);
+	if ((i = ArgPos((char *) "-eval-similarity", argc, argv)) > 0)
+		strcpy(eval_similarity_file, argv[i + 1]);
+	if ((i = ArgPos((char *) "-eval-vocab", argc, argv)) > 0)
+		eval_vocab = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-eval-sync", argc, argv)) > 0)
+		eval_sync = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-eval-model", argc, argv)) > 0)
+		strcpy(eval_model_file, argv[i + 1]);
+	if ((i = ArgPos((char *) "-pq-output", argc, argv)) > 0)
+		strcpy(pq_output_file, argv[i + 1]);
+	if ((i = ArgPos((char *) "-pq-subspaces", argc, argv)) > 0)
+		pq_subspaces = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-pq-train", argc, argv)) > 0)
+		pq_train_rows = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-vocab-memory", argc, argv)) > 0)
+		vocab_memory = atoll(argv[i + 1]) << 20;
+	if ((i = ArgPos((char *) "-zero-copy", argc, argv)) > 0)
+		zero_copy = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-queue-depth", argc, argv)) > 0)
+		queue_depth = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-tokenizer-threads", argc, argv)) > 0)
+		tokenizer_threads = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-cbow-tile", argc, argv)) > 0)
+		cbow_tile = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-sync-quantize", argc, argv)) > 0)
+		sync_quantize = atoi(argv[i + 1]);
+	if (sync_quantize < 0 || sync_quantize > 2) {
+		printf("-sync-quantize is 0, 1 or 2\n");
+		return 1;
+	}
+	if (sync_quantize && async_average) {
+		printf("-sync-quantize applies to synchronous averaging, ignored with -async-average\n");
+		sync_quantize = 0;
+	}
+	if ((i = ArgPos((char *) "-device-type", argc, argv)) > 0)
+		strcpy(device_type, argv[i + 1]);
+	if ((i = ArgPos((char *) "-devices", argc, argv)) > 0)
+		strcpy(device_list, argv[i + 1]);
+	if ((i = ArgPos((char *) "-sub-devices", argc, argv)) > 0)
+		sub_devices = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-numa", argc, argv)) > 0)
+		numa = atoi(argv[i + 1]);
+	if ((i = ArgPos((char *) "-check-tokenizer", argc, argv)) > 0 && atoi(argv[i + 1]))
+		return readerSelfCheck(train_file);
+	if ((i = ArgPos((char *) "-check-shards", argc, argv)) > 0 && atoi(argv[i + 1]) > 0)
+		return shardSelfCheck(train_file, atoi(argv[i + 1]));
+	if ((i = ArgPos((char *) "-check-queue", argc, argv)) > 0 && atoi(argv[i + 1]) > 0)
+		return batchQueueSelfCheck(atoi(argv[i + 1]));
+	if (bench_classes > 0) {
+		kmeansBenchmark(bench_classes, layer1_size);
+		return 0;
+	}
+	if (eval_model_file[0]) {
+		evalModelFile(eval_model_file, binary);
+		return 0;
+	}
 	vocab = (struct vocab_word *) calloc(vocab_max_size,
 			sizeof(struct vocab_word));
 	vocab_hash = (int *) calloc(vocab_hash_size, sizeof(int));